@@ -23,69 +23,644 @@
 
 #include <string.h>
 
-#define SHELL_LABEL_LENGTH		80
 #define SHELL_BUFFER_SIZE		256
+#ifndef SHELL_RX_SIZE
+#define SHELL_RX_SIZE			256		// Size of the reception ring buffer. Must be a power of two.
+#endif
+#ifndef SHELL_TX_SIZE
+#define SHELL_TX_SIZE			1024	// Size of the transmission ring buffer. Must be a power of two, at least SHELL_EDIT_ROOM.
+#endif
+#ifndef SHELL_PATH_DEPTH
+#define SHELL_PATH_DEPTH		8		// Maximum depth of the current path, root block included
+#endif
+#ifndef SHELL_MAX_ARGS
+#define SHELL_MAX_ARGS			8		// Maximum number of words on a command line, command word included
+#endif
+#ifndef SHELL_CONTEXT_SIZE
+#define SHELL_CONTEXT_SIZE		64		// Size of the context of the command in progress (see SHELL_CONTEXT), in bytes
+#endif
+#ifndef SHELL_JOBS
+#define SHELL_JOBS				2		// Number of commands that can run in the background, per instance (see "shell_jobs.c")
+#endif
+#ifndef SHELL_WATCH_SIZE
+#define SHELL_WATCH_SIZE		512		// Maximum size of the output of a watched command, per run (see "shell_watch.c")
+#endif
+#ifndef SHELL_SCRIPT_DEPTH
+#define SHELL_SCRIPT_DEPTH		4		// Maximum nesting of scripts : command lists, and macros that run macros (see "shell_script.c")
+#endif
+#ifndef SHELL_MACROS_RAM
+#define SHELL_MACROS_RAM		4		// Number of macros that can be defined at run time, with the "macro" command
+#endif
+#ifndef SHELL_HISTORY_SIZE
+#define SHELL_HISTORY_SIZE		512		// Size of the history of the lines typed at the prompt, in bytes. Must be a power of two, at least SHELL_BUFFER_SIZE. (see "shell_edit.c")
+#endif
+#ifndef SHELL_SEARCH_SIZE
+#define SHELL_SEARCH_SIZE		32		// Maximum length of a history search pattern (Ctrl-R)
+#endif
+#ifndef SHELL_FRAME_SIZE
+#define SHELL_FRAME_SIZE		256		// Maximum size of a binary mode frame, requests and responses (see "shell_binary.c")
+#endif
 
 // Pseudo file system command block structure
+// Blocks are read-only : declare them "const" so they stay in flash. Labels are pointers to string literals, which the
+// compiler stores once each (identical labels are merged), instead of fixed-size arrays.
 typedef struct t_shell_block_entry t_shell_block_entry;
 struct t_shell_block_entry
 {
-	char label[SHELL_LABEL_LENGTH];	// Command and parameter list, or block title
+	char *label;					// Command and parameter list, or block title
 	void (*fp)();					// Pointer to the function for this command
-	t_shell_block_entry *cb;		// Child block, if the entry is for a "sub block". If this entry is a block title, this points to the parent block, if any
+	const t_shell_block_entry *cb;	// Child block, if the entry is for a "sub block". Zero in a block title : the path stack (sh->path) knows the parents
+	char *args;						// Argument schema of the command (see below), or zero if the command parses its arguments itself
 };
 
+// Argument schemas : one character per argument, the parser checks and converts the arguments before calling the command.
+//   i : integer (decimal, or hex with a 0x prefix)   x : hexadecimal integer   f : float   s : string
+//   {a|b|c} : one of the words listed, converted to its position in the list (0 for "a", 1 for "b"...)
+//   ? : the arguments that follow are optional       * : any number of extra string arguments, not converted
+// Example : "ix?{on|off}" is an integer, a hex number and optionally "on" or "off".
+// Arguments are separated by spaces. Double quotes make a single string argument out of several words.
+typedef union t_shell_arg
+{
+	long i;							// i
+	unsigned long x;				// x
+	float f;						// f
+	char *s;						// s (for every type, sh->argv[n] holds the argument as typed)
+	int e;							// {...}
+} t_shell_arg;
+
 // Global instances of blocks declared in separate source files for clarity :
-extern t_shell_block_entry shell_block[];
-extern t_shell_block_entry system_block[];	// The library provides an empty place-holder (see "shell_pfs.c")
+extern const t_shell_block_entry shell_block[];
+extern const t_shell_block_entry system_block[];	// The library provides an empty place-holder (see "shell_commands.c")
+extern const t_shell_block_entry root_block[];		// Must be declared by the application (same)
 
 // Type cast macros to simplify coding PFS blocks
 #define BLOCK_LEN (void (*)())	// macro to simplify using a function pointer to hold a number
-#define CMD_BLOCK (t_shell_block_entry*)
+#define CMD_BLOCK (const t_shell_block_entry *)
+#define BLOCK_COUNT(B) ((int) (long) (B)[0].fp)	// reverse of BLOCK_LEN : number of entries in a block, read from its title entry
+
+// Macros to declare blocks without counting their entries or casting pointers. The title entry is generated, with the
+// number of entries filled-in at build time. Example :
+//   SHELL_BLOCK_DECLARE (motor_block);
+//   SHELL_BLOCK (root_block, "STM32",
+//       SHELL_CMD ("led <on|off>", command_led, "{on|off}"),
+//       SHELL_SUB ("motor", motor_block));
+//   SHELL_BLOCK (motor_block, "Motor",
+//       SHELL_CMD ("stop", command_stop));
+#define SHELL_BLOCK_DECLARE(NAME) extern const t_shell_block_entry NAME[]	// Needed to refer to a block defined further down
+#define SHELL_BLOCK(NAME, TITLE, ...) const t_shell_block_entry NAME[] = \
+	{ { TITLE, BLOCK_LEN (sizeof ((t_shell_block_entry []) { __VA_ARGS__ }) / sizeof (t_shell_block_entry)), 0, 0 }, __VA_ARGS__ }
+#define SHELL_CMD(LABEL, FP, ...) { LABEL, FP, 0, SHELL_SCHEMA (0, ##__VA_ARGS__, 0, 0) }	// Command entry, with an optional argument schema
+#define SHELL_SUB(LABEL, BLOCK) { LABEL, 0, BLOCK, 0 }			// Sub-block entry
+#define SHELL_SCHEMA(Z, SCHEMA, ...) SCHEMA		// The schema given to SHELL_CMD, or 0 without one
+
+// Dispatch index : a sorted view of each block's entries, built once by shell_state_init.
+// It lets the parser resolve a command word by binary search instead of comparing it against every entry.
+#ifndef SHELL_INDEX_BLOCKS
+#define SHELL_INDEX_BLOCKS		32		// Maximum number of indexed blocks. Blocks beyond that are searched linearly.
+#endif
+#ifndef SHELL_INDEX_ENTRIES
+#define SHELL_INDEX_ENTRIES		256		// Maximum number of indexed entries, all blocks combined
+#endif
+
+typedef struct t_shell_index_slot
+{
+	const t_shell_block_entry *entry;	// Block entry
+	int wlen;						// Length of the first word of the entry's label (the command word)
+} t_shell_index_slot;
+
+typedef struct t_shell_index
+{
+	const t_shell_block_entry *block;	// Indexed block
+	t_shell_index_slot *slot;		// Block entries sorted by command word (title entry excluded)
+	int count;						// Number of slots
+} t_shell_index;
+
+// Results of a dispatch index lookup
+#define SHELL_MATCH_NONE		0		// No entry matches the command word
+#define SHELL_MATCH_FOUND		1		// Exact match, or the command word is the prefix of exactly one entry
+#define SHELL_MATCH_AMBIGUOUS	2		// The command word is the prefix of several entries
 
 // Macros to simplify coding command functions
-#define COMMAND_END	{shell_state.command_fp = 0; shell_fp = shell_state_output;}	// nullifies current command pointer, transitions back to the prompt
-#define SHELL_PRINT(S) {shell_out(S, strlen(S)); while (shell_state.busy == 1);}	// prints a string to the terminal, blocks until transmission is complete
+// Command functions receive the shell instance they run on, and these macros expect it to be named "sh" :
+#define SHELL_COMMAND(NAME) void NAME (t_shell_state *sh)	// declares or defines a command function
+#define COMMAND_END	{sh->command_fp = 0; sh->fp = shell_state_output;}	// nullifies current command pointer, transitions back to the prompt
+#define SHELL_PRINT(S) shell_print(sh, S)	// prints a string to the terminal, only blocks if the transmission ring is full
+#define COMMAND_LAST_LINE {sh->command_fp = command_native_end; sh->fp = shell_state_output;}	// prints the output buffer, then ends the command
+#define COMMAND_FAIL {sh->error = 1; COMMAND_LAST_LINE}	// same, for an error message : the command has failed (scripts may stop, see "shell_script.c")
+#define SHELL_WAIT(E) {sh->wait = (E);}	// tells shell_poll not to call the current state again until one of the events E occurs
+#define SHELL_SLEEP(T) {sh->wake_time = shell_ticks () + (T); sh->wait = SHELL_EVENT_TIMER;}	// same, for T ticks
+
+// Coroutine macros : a command can be written as straight code that prints, waits and loops, instead of a state machine.
+// The command function is re-entered after each yield and resumes where it left off (sh->command_state holds a number
+// unique to each yielding macro). Like any stackless coroutine, local variables are lost across yields : keep them in
+// the context instead. No yielding macro inside a switch of the command's own. Example :
+//   typedef struct { int n; } t_count_context;
+//   SHELL_COMMAND (command_count)
+//   {
+//       t_count_context *ctx = SHELL_CONTEXT (t_count_context);
+//       SHELL_BEGIN
+//       for (ctx->n = 0; ctx->n < 10; ctx->n++)
+//           SHELL_YIELD_PRINTF ("\r\n%d", ctx->n);
+//       SHELL_END
+//   }
+// The resume points are numbered with __COUNTER__, so several yielding macros can share a line (i.e. in a macro of the
+// application's). Compilers without it fall back to __LINE__ : then two of them on the same line fail to build, with a
+// "duplicate case value" error.
+#ifdef __COUNTER__
+#define SHELL_RESUME_POINT		(__COUNTER__ + 1)	// Never zero, that's SHELL_BEGIN's
+#else
+#define SHELL_RESUME_POINT		__LINE__
+#endif
+#define SHELL_CONTEXT(TYPE) ((TYPE *) (sh->context + 0 * sizeof (char [(sizeof (TYPE) <= SHELL_CONTEXT_SIZE) ? 1 : -1])))	// Per-invocation variables, zeroed when the command starts (the size is checked at build time)
+#define SHELL_BEGIN switch (sh->command_state) { case 0:	// Start of the command's body
+#define SHELL_END } COMMAND_END	// End of the command's body : the command ends when it gets there
+#define SHELL_YIELD SHELL_YIELD_AT (SHELL_RESUME_POINT)	// Let other instances and the application run
+#define SHELL_AWAIT(E, COND) SHELL_AWAIT_AT (SHELL_RESUME_POINT, E, COND)	// Wait until COND is true, checking it when one of the events E occurs
+#define SHELL_AWAIT_INPUT SHELL_AWAIT_INPUT_AT (SHELL_RESUME_POINT)	// Wait for a line of input : it's then in sh->input
+#define SHELL_YIELD_PRINT(S) SHELL_YIELD_PRINT_AT (SHELL_RESUME_POINT, S)	// Print a line (waiting for room in the transmission ring), then yield
+#define SHELL_YIELD_PRINTF(...) {snprintf (sh->output, SHELL_BUFFER_SIZE, __VA_ARGS__); SHELL_YIELD_PRINT (sh->output)}	// Same, formatted in the output buffer
+
+// The yielding macros, with the number of their resume point : the macros above expand SHELL_RESUME_POINT once, as the
+// argument, so that the state stored and the case label get the same number. The fall-through into the case label is
+// deliberate (the condition is checked right away, then each time the command is resumed).
+#define SHELL_YIELD_AT(N) {sh->command_state = (N); return; case (N):;}
+#define SHELL_AWAIT_AT(N, E, COND) {sh->command_state = (N); __attribute__((fallthrough)); case (N): if (!(COND)) {SHELL_WAIT (E) return;}}
+#define SHELL_AWAIT_INPUT_AT(N) {sh->command_state = (N); sh->fp = shell_state_input; return; case (N):;}
+#define SHELL_YIELD_PRINT_AT(N, S) {sh->command_state = (N); __attribute__((fallthrough)); case (N): if (shell_yield_print (sh, (S)) != 0) return; \
+	sh->command_state = -(N); return; case -(N):;}
+
+// Events (bit mask) : what a shell instance can wait for when it's run by shell_poll
+#define SHELL_EVENT_RX			1		// Bytes have been received
+#define SHELL_EVENT_TX			2		// A transfer has completed : there's room in the transmission ring
+#define SHELL_EVENT_YIELD		4		// Posted by the application to resume a command waiting for it (i.e. data is ready)
+#define SHELL_EVENT_TIMER		8		// sh->wake_time has been reached
+#define SHELL_EVENT_LOG			16		// A message has been logged (posted to the log console only)
+#ifndef SHELL_POLL_STEPS
+#define SHELL_POLL_STEPS		16		// Maximum number of states run by a single call to shell_poll
+#endif
+
+// Bulk transfers (see "shell_transfer.c") : the "download" and "upload" native commands move the contents of memory regions
+// over the link, with a YMODEM-like protocol. Regions are declared by the application, like root_block :
+//   const t_shell_region shell_regions[] = { { "capture", capture_buffer, sizeof (capture_buffer), 0 }, { 0 } };
+typedef struct t_shell_region
+{
+	char *name;						// Name given to the commands, zero for the last entry of the table
+	char *base;						// Start of the region. Downloads are sent from there by DMA (see shell_tx_direct).
+	unsigned long size;				// Size of the region, in bytes
+	int writable;					// Non-zero if uploads are allowed
+} t_shell_region;
+
+extern const t_shell_region shell_regions[];	// The library provides an empty table, unless SHELL_REGIONS is defined
+
+// Variables (see "shell_trace.c") : firmware variables the "get", "set" and "trace" commands access by name. Like
+// commands, they're declared in a const table, by the application :
+//   const t_shell_var shell_vars[] = { SHELL_VAR ("speed", motor_speed, 'f'), SHELL_VAR ("mode", mode, 'u'), { 0 } };
+typedef struct t_shell_var
+{
+	char *name;						// Name given to the commands, zero for the last entry of the table
+	void *addr;						// Address of the variable
+	char type;						// 'i' : signed integer, 'u' : unsigned integer, 'x' : same in hex, 'f' : float
+	char size;						// Size of the variable : 1, 2 or 4 bytes
+} t_shell_var;
+
+#define SHELL_VAR(NAME, VAR, TYPE) { NAME, (void *) &(VAR), TYPE, \
+	sizeof (VAR) + 0 * sizeof (char [((sizeof (VAR) == 1) || (sizeof (VAR) == 2) || (sizeof (VAR) == 4)) ? 1 : -1]) }	// Variable entry (the size is checked at build time)
+
+extern const t_shell_var shell_vars[];	// The library provides an empty table, unless SHELL_VARS is defined
 
-// Main data structure, with one global instance
-typedef struct s_shell_state
+// Macros (see "shell_script.c") : named scripts, run by "run <name>". Commands are separated by ';' or line feeds.
+// Besides those defined with the "macro" command, macros are declared in flash by the application, like root_block :
+//   const t_shell_macro shell_macros[] = { SHELL_MACRO ("init", "cd motor; set speed 0", SHELL_SCRIPT_STOP), { 0 } };
+// The boot script is a macro too (shell_boot, if SHELL_BOOT_SCRIPT is defined) : it runs before the first prompt of the
+// default instance.
+typedef struct t_shell_macro
 {
-	char path[SHELL_BUFFER_SIZE];	// Current path and prompt.
-	char input[SHELL_BUFFER_SIZE];	// Input buffer (stores a complete line)
-	char output[SHELL_BUFFER_SIZE];	// Output buffer (used for DMA transfers)
-	int busy;						// If non-zero, DMA transfer in progress
+	char *name;						// Name given to "run", zero for the last entry of the table
+	char *script;					// The commands
+	int on_error;					// What a failed command does (see COMMAND_FAIL) :
+} t_shell_macro;
+
+#define SHELL_SCRIPT_STOP		0		// It stops the script (and the scripts that ran it)
+#define SHELL_SCRIPT_CONTINUE	1		// It's counted, and the script goes on
+
+#define SHELL_MACRO(NAME, SCRIPT, ON_ERROR) { NAME, SCRIPT, ON_ERROR }	// Macro entry
+
+extern const t_shell_macro shell_macros[];	// The library provides an empty table, unless SHELL_MACROS is defined
+extern const t_shell_macro shell_boot;		// The library provides an empty script, unless SHELL_BOOT_SCRIPT is defined
+
+// A script in progress : where it's at
+typedef struct t_shell_script
+{
+	const char *next;				// Rest of the script
+	const char *name;				// Name of the macro, zero for a command list typed at the prompt
+	int on_error;					// SHELL_SCRIPT_STOP or SHELL_SCRIPT_CONTINUE
+} t_shell_script;
+
+#ifndef SHELL_VARS_INDEXED
+#define SHELL_VARS_INDEXED		64		// Maximum number of variables sorted for lookup by name. The others are searched linearly.
+#endif
+#ifndef SHELL_TRACE_SIZE
+#define SHELL_TRACE_SIZE		1024	// Size of the trace ring, in 32-bit words (one per variable and per sample)
+#endif
+#ifndef SHELL_TRACE_VARS
+#define SHELL_TRACE_VARS		4		// Maximum number of variables traced together
+#endif
+
+#ifndef SHELL_TRANSFER_BLOCK
+#define SHELL_TRANSFER_BLOCK	1024	// Maximum size of the data of a packet
+#endif
+#ifndef SHELL_TRANSFER_WINDOW
+#define SHELL_TRANSFER_WINDOW	8		// Number of packets that can be sent ahead of the acknowledgements (less than 256)
+#endif
+#ifndef SHELL_TRANSFER_TIMEOUT
+#define SHELL_TRANSFER_TIMEOUT	1000	// Time without progress before resending, in shell_ticks units
+#endif
+#ifndef SHELL_TRANSFER_RETRIES
+#define SHELL_TRANSFER_RETRIES	10		// Number of timeouts or rejections in a row before giving up
+#endif
+
+// State of the transfer in progress (the commands' own state is in command_state)
+typedef struct t_shell_transfer
+{
+	char *data;						// Start of the data : region base plus offset
+	unsigned long length;			// Number of bytes to send (download) or room in the region (upload)
+	unsigned long done;				// Number of bytes received (upload)
+	int packets;					// Number of packets to send, end of transmission included (download)
+	int acked;						// First packet not acknowledged yet (download)
+	int next;						// Next packet to send (download)
+	int stage;						// Progress within the packet being sent or received
+	int count;						// Bytes left to receive or skip in the current packet (upload)
+	int size;						// Size of the data of the current packet
+	unsigned short crc;				// CRC of the data received so far (upload)
+	unsigned char seq;				// Sequence number expected next (upload)
+	char control;					// Control byte received, waiting for its sequence number (download)
+	int cancel;						// Number of consecutive cancel bytes received
+	int started;					// Non-zero once the other side has answered
+	int retries;					// Timeouts and rejections since the last progress
+	unsigned long deadline;			// shell_ticks () value of the next timeout
+} t_shell_transfer;
+
+// State of the watch in progress (see "shell_watch.c") : the output of the previous run, as displayed, and the progress of
+// the comparison with the output of the current run
+typedef struct t_shell_watch
+{
+	const t_shell_block_entry *entry;	// Command being watched, zero if there's no watch in progress
+	char line[SHELL_BUFFER_SIZE];	// Its command line, restored before each run
+	unsigned long period;			// Time between runs, in shell_ticks units
+	unsigned long next;				// shell_ticks () value of the next run
+	char shadow[SHELL_WATCH_SIZE];	// Output of the previous run
+	char output[SHELL_WATCH_SIZE];	// Output of the current run (capture buffer)
+	int shadow_len;
+	int output_len;
+	int shadow_pos;					// Position of the next line of each output, while comparing them
+	int output_pos;
+	int shadow_lines;				// Number of lines displayed
+	int row;						// Line being compared
+	int cursor;						// Line the cursor is on (-1 for the command line)
+	int cursor_col;					// Length of the last line drawn : the cursor is left at its end
+	int stage;
+	unsigned long runs;
+	unsigned long sent;				// Number of bytes sent...
+	unsigned long full;				// ... and number of bytes printing the whole output every time would have taken
+} t_shell_watch;
+
+// Places a shell instance in the ".shell" linker section (see "shell.c")
+#define SHELL_SECTION __attribute__ ((section (".shell")))
+
+// Main data structure. There's one instance per console, see "shell.c" for the default one.
+typedef struct s_shell_state t_shell_state;
+
+// Background job (see "shell_jobs.c") : the execution state of a command, swapped with the foreground's for each of its
+// steps. These fields have the same meaning as the instance's fields of the same name.
+typedef struct t_shell_job
+{
+	void (*fp)(t_shell_state *);	// Current state of the job, zero if the slot is free
+	void (*command_fp)();			// The command, zero once it has ended
+	int command_state;
+	int command_index;
+	long long context[(SHELL_CONTEXT_SIZE + sizeof (long long) - 1) / sizeof (long long)];
+	int argc;
+	char *argv[SHELL_MAX_ARGS];
+	t_shell_arg arg[SHELL_MAX_ARGS];
+	char *input;					// Buffers : these pointers move along with the commands, between the slots and the foreground
+	char *output;
+	unsigned int wait;
+	unsigned long wake_time;
+	int error;
+
+	int id;							// Job number, as shown in the tags of its output and given to "fg" and "kill"
+	int stopped;					// Set when the job waits for input : it's left alone until "fg" brings it to the foreground
+	const t_shell_block_entry *entry;	// Entry of the command
+	char input_buffer[SHELL_BUFFER_SIZE];	// Buffers of the slot
+	char output_buffer[SHELL_BUFFER_SIZE];
+} t_shell_job;
+
+struct s_shell_state
+{
+	void (*fp)(t_shell_state *);	// Current state of the shell instance (zero before initialization)
+	const t_shell_block_entry *path[SHELL_PATH_DEPTH];	// Current path : stack of blocks from the root (path[0]) to the current block
+	int path_length[SHELL_PATH_DEPTH];	// Length of the title of each block in the path
+	int depth;						// Number of blocks in the path
+	int prompt_length;				// Length of the path, as printed in the prompt ("/root/block")
+	char *input;					// Input buffer (stores a complete line)
+	char *output;					// Output buffer (a line of command output, copied to the transmission ring by the output state)
+	char input_buffer[SHELL_BUFFER_SIZE];	// Storage of the buffers. input and output point to them, or to a job slot's
+	char output_buffer[SHELL_BUFFER_SIZE];	// buffers after a command has been moved to the background or the foreground.
+	volatile int busy;				// If non-zero, DMA transfer in progress
 	int index;						// Input buffer index, used when receiving data from the shell
+	int cr;							// Set when the last byte received was a carriage return (see shell_state_idle)
+	int cursor;						// Position of the cursor in the input buffer (index is the length of the line)
+	int escape;						// Progress in an escape sequence (see "shell_edit.c")...
+	int escape_param;				// ... and its numeric parameter
 	void (*command_fp)();			// Pointer to the function for the command in progress, or zero if no command in progress
+	int command_state;				// Free for use by the command in progress (i.e. for its own state machine). Zeroed when it starts.
+	int command_index;				// Same
+	long long context[(SHELL_CONTEXT_SIZE + sizeof (long long) - 1) / sizeof (long long)];	// Same, see SHELL_CONTEXT
+
+	// Arguments of the command in progress, only set for commands with an argument schema. argv[0] is the command word as
+	// typed (possibly abbreviated), arg[n] is the converted value of argv[n]. The strings are in the input buffer.
+	int argc;
+	char *argv[SHELL_MAX_ARGS];
+	t_shell_arg arg[SHELL_MAX_ARGS];
 
 	// PFS :
-	t_shell_block_entry *root;		// Root block for the application-specific command blocks tree
-	t_shell_block_entry *block;		// Current block (commands located at "path")
-	t_shell_block_entry *shell;		// Shell block;
-	t_shell_block_entry *system;	// System block;
+	const t_shell_block_entry *root;	// Root block for the application-specific command blocks tree
+	const t_shell_block_entry *block;	// Current block (commands located at "path")
+	const t_shell_block_entry *shell;	// Shell block;
+	const t_shell_block_entry *system;	// System block;
+	t_shell_index *lookup;			// Dispatch index of the current block, or zero if it isn't indexed
+
+	// Reception : single-producer (UART / DMA interrupt), single-consumer (state machine) lock-free ring buffer.
+	// The indexes are free-running : the number of bytes in the ring is rx_head - rx_tail.
+	char rx[SHELL_RX_SIZE];			// Ring buffer storage
+	volatile unsigned int rx_head;	// Write index, only modified by the producer (shell_in and friends)
+	volatile unsigned int rx_tail;	// Read index, only modified by the consumer (shell_state_idle)
+	volatile unsigned int rx_overflow;	// Number of bytes dropped because the ring was full
+	int rx_dma;						// Last position read from the circular DMA buffer (see shell_in_dma)
+
+	// Transmission : everything the shell sends (echo, prompt, command output) is queued in this ring and sent by DMA,
+	// in transfers as large as possible. The main loop writes, transfer completion (possibly in interrupt context) reads.
+	char tx[SHELL_TX_SIZE];			// Ring buffer storage (DMA source)
+	volatile unsigned int tx_head;	// Write index, only modified by the main loop
+	volatile unsigned int tx_tail;	// Read index, advanced when a transfer completes
+	volatile unsigned int tx_len;	// Length of the transfer in progress, zero if none
+	volatile int tx_active;			// Set from the start of a transfer until its completion has been accounted for
+
+	// Output capture : while capture is set, whatever is written to the transmission ring goes to this buffer instead.
+	// Binary mode uses it to turn the output of a command into the payload of its response.
+	char *capture;					// Capture buffer, or zero
+	int capture_size;				// Size of the capture buffer
+	int capture_len;				// Number of bytes captured
+	int capture_lost;				// Number of bytes that didn't fit
+
+	// Binary mode (see "shell_binary.c")
+	int binary;						// Non-zero in binary mode
+	int binary_match;				// Number of bytes of SHELL_BINARY_ESCAPE received so far, at the prompt
+	char frame[SHELL_FRAME_SIZE];	// Request being received (COBS-encoded), then decoded in place
+	int frame_len;					// Number of bytes received, or -1 if the frame is too large and is being skipped
+	char reply[SHELL_FRAME_SIZE];	// Response being built : header, captured output and CRC
+	int reply_len;					// Length of the response, once complete
+
+	t_shell_transfer transfer;		// Bulk transfer in progress (download and upload commands)
+	t_shell_watch watch;			// Watch in progress ("watch" command)
+
+	// Scripts (see "shell_script.c")
+	t_shell_script script[SHELL_SCRIPT_DEPTH];	// Scripts in progress, the innermost last
+	int script_depth;				// Number of scripts in progress
+	char script_line[SHELL_BUFFER_SIZE];	// Command list typed at the prompt (the input buffer holds each of its commands in turn)
+	unsigned long script_start;		// shell_ticks () when the outermost script started
+	int script_count;				// Number of commands run...
+	int script_errors;				// ... and failed, since then
+	int error;						// Set when the last command failed (see COMMAND_FAIL)
+
+	// History of the lines typed at the prompt (see "shell_edit.c") : a ring of null-terminated lines, oldest first. The
+	// indexes are free-running, like the reception ring's.
+	char history[SHELL_HISTORY_SIZE];
+	unsigned int history_head;		// Where the next line goes
+	unsigned int history_tail;		// Oldest line
+	unsigned int history_pos;		// Line recalled with the arrows, history_head if none
+	int search;						// Length of the history search pattern, -1 when not searching (Ctrl-R)
+	char pattern[SHELL_SEARCH_SIZE];	// History search pattern
+
+	// Background jobs (see "shell_jobs.c")
+	t_shell_job jobs[SHELL_JOBS];	// Job table
+	int job_count;					// Number of jobs started so far : numbers the next one
+	int tag;						// Number of the job running a step, zero for the foreground (see shell_tx_write)
+	int redraw;						// Set when something has been printed over the prompt : the idle state prints it again
 
 	char c;							// Single-byte input buffer
-} t_shell_state;
+	void *port;						// Free for use by the portability layer (i.e. to tell which UART this instance uses)
 
-extern t_shell_state shell_state;
+	// Events (see shell_poll)
+	volatile unsigned int events;	// Events that occurred since the last call to shell_poll (set from interrupt context)
+	unsigned int wait;				// Events the current state is waiting for, zero if it can run right away
+	unsigned long wake_time;		// Expiration of SHELL_EVENT_TIMER, in shell_ticks units
+	unsigned long poll_count;		// Number of calls to shell_poll...
+	unsigned long poll_skipped;		// ... that returned without running anything, because the expected events didn't occur
+	unsigned long step_count;		// Number of states run by shell_poll
+
+#ifdef SHELL_STATS
+	// Traffic counters (see "shell_stats.c")
+	unsigned long rx_bytes;			// Number of bytes received, dropped ones included
+	unsigned long tx_bytes;			// Number of bytes sent
+	unsigned long tx_start;			// shell_cycles () when the transfer in progress was started
+#endif
+};
 
-// Function pointer for the current state of the shell :
-extern void (*shell_fp)();
+extern t_shell_state shell_state;	// Default instance
+
+void command_native_end (t_shell_state *sh);	// Pseudo-command that ends the command in progress (see COMMAND_LAST_LINE)
+void command_native_download (t_shell_state *sh);	// Send a memory region (see "shell_transfer.c")
+void command_native_upload (t_shell_state *sh);		// Receive into a memory region (same)
+void command_native_watch (t_shell_state *sh);		// Run a command periodically (see "shell_watch.c")
+void command_native_get (t_shell_state *sh);		// Print a variable (see "shell_trace.c"),
+void command_native_set (t_shell_state *sh);		// change it,
+void command_native_trace (t_shell_state *sh);		// and trace variables
+int shell_command_find (t_shell_state *sh, int wlen, const t_shell_block_entry **match);	// Look up a command word (see shell_state_parser)
+int shell_arguments (t_shell_state *sh, const t_shell_block_entry *entry);	// Split and convert the arguments of the command line
+void shell_join (t_shell_state *sh, int first, char *buff, int size);	// Put the arguments back together, from argv[first]
+
+// Scripts (see "shell_script.c")
+int shell_script_push (t_shell_state *sh, const char *script, const char *name, int on_error);	// Start a script. Returns -1 if they're nested too deep.
+int shell_script_split (const char *script);	// Length of the first command of a script
+void shell_script_abort (t_shell_state *sh);	// Drop the scripts in progress, without a word (see shell_state_init)
+void shell_macros_reset (void);				// Delete the macros defined at run time (see shell_reset)
+void command_native_run (t_shell_state *sh);	// Run a macro
+void command_native_macro (t_shell_state *sh);	// List, define or delete macros
+
+// Line editing (see "shell_edit.c")
+#define SHELL_EDIT_ROOM			(SHELL_BUFFER_SIZE + 32)	// Room in the transmission ring an editing key may need : enough to rewrite the line
+void shell_edit (t_shell_state *sh, char c);	// Process a byte of input, other than plain typing at the end of the line
+void shell_edit_move (t_shell_state *sh, int from, int to);	// Move the terminal's cursor along the line being typed
+void shell_history_add (t_shell_state *sh, const char *line);	// Store a line typed at the prompt in the history
+
+void shell_command_start (t_shell_state *sh, void (*fp)());	// Start a command : its state and context are zeroed
+int shell_yield_print (t_shell_state *sh, char *s);	// See SHELL_YIELD_PRINT
+
+// Run the current state of a shell instance. The application calls this continuously, for each instance.
+void shell_run (t_shell_state *sh);
+void shell_step (t_shell_state *sh);		// Same, for the foreground only (shell_run also runs a step of each job)
+
+// Put the state the instances share (run-time macros, trace, log ring and level, statistics) back as it was at start-up.
+// Meant for test rigs that run the library over and over in one process, i.e. a fuzzer : call it with no instance
+// running and the sampling interrupt stopped, then restart the instances (sh->fp = shell_state_init). The command tree,
+// the variables and the regions are constant : their dispatch index stays as it is.
+void shell_reset (void);
+
+// Event-driven alternative to shell_run : runs the instance only if it has something to do, and returns the events it's
+// waiting for (zero if it should be polled again right away). In between, the application can sleep until one of these
+// events occurs : shell_wakeup is called, possibly from interrupt context, whenever an event is posted.
+unsigned int shell_poll (t_shell_state *sh);
+void shell_event (t_shell_state *sh, unsigned int events);	// Post events to an instance. Interrupt-safe.
+unsigned long shell_wake_time (t_shell_state *sh);	// When SHELL_EVENT_TIMER is expected : the earliest timer of the foreground and the jobs
 
 // Main state machine state functions
-void shell_state_init ();			// Initialization state.
-void shell_state_output ();		// Output state, sends the prompt to the terminal.
-void shell_state_input ();		// Start acquiring user input.
-void shell_state_idle ();			// Wait for user input to complete.
-void shell_state_parser ();		// Parse user input.
+void shell_state_init (t_shell_state *sh);		// Initialization state.
+void shell_state_output (t_shell_state *sh);		// Output state, sends the prompt to the terminal.
+void shell_state_input (t_shell_state *sh);		// Start acquiring user input.
+void shell_state_idle (t_shell_state *sh);		// Wait for user input to complete.
+void shell_state_parser (t_shell_state *sh);		// Parse user input.
+void shell_state_binary (t_shell_state *sh);		// Binary mode : receive and dispatch a request.
+void shell_state_binary_reply (t_shell_state *sh);	// Binary mode : send the response of the last request.
+void shell_state_watch (t_shell_state *sh);		// Run a watched command periodically, and update its output in place.
+void shell_state_script (t_shell_state *sh);		// Feed the next command of a script to the parser.
+
+// Transmission functions (main loop only, except shell_tx_done)
+int shell_tx_write (t_shell_state *sh, char *buff, int length);	// Queue bytes for transmission, never blocks. Returns the number of bytes accepted.
+int shell_tx_free (t_shell_state *sh);			// Number of bytes that can be queued right now (use it for backpressure)
+int shell_tx_flush (t_shell_state *sh);			// Start the next transfer if the interface is ready. Returns the number of bytes not sent yet.
+void shell_print (t_shell_state *sh, char *s);	// Queue a string for transmission, waiting for room in the ring if necessary
+int shell_tx_direct (t_shell_state *sh, char *buff, int length);	// Send a buffer without copying it, once the ring is empty
+
+// Reception functions, for commands that read raw data (main loop only)
+int shell_rx_count (t_shell_state *sh);			// Number of bytes in the reception ring
+int shell_rx_read (t_shell_state *sh, char *buff, int length);	// Move bytes from the ring to buff (or drop them if buff is zero)
+
+// Dispatch index functions
+void shell_index_build ();			// Index the shell and system blocks, and every block of the tree under root_block
+t_shell_index *shell_index_find (const t_shell_block_entry *block);	// Returns the index of a block, or zero if it isn't indexed
+int shell_index_lookup (t_shell_index *index, const t_shell_block_entry *block, char *word, int wlen, const t_shell_block_entry **match);
+int shell_index_number (const t_shell_block_entry *block);	// Position of a block in the index, or -1 if it isn't indexed
+const t_shell_block_entry *shell_index_entry (int id);	// Entry with a numeric ID (binary mode), or zero if there's none
+
+// Navigation functions
+int shell_push_block (t_shell_state *sh, const t_shell_block_entry *block);	// Enter a sub-block. Returns -1 if the path is too deep.
+void shell_pop_block (t_shell_state *sh);			// Back to the parent block
+int shell_change_path (t_shell_state *sh, char *path);	// Navigate along a path ("a/b", "../c", "/"), returns zero or one of :
+#define SHELL_PATH_NOT_FOUND	1		// A block of the path doesn't exist
+#define SHELL_PATH_TOO_DEEP		2		// The path has more than SHELL_PATH_DEPTH blocks
+int shell_prompt_length (t_shell_state *sh);		// Number of bytes shell_prompt will send
+void shell_prompt (t_shell_state *sh);				// Queue the prompt for transmission
+
+// Variables and traces (see "shell_trace.c")
+const t_shell_var *shell_var_find (char *name);	// Look up a variable by name, or returns zero
+void shell_trace_sample (void);		// Take a sample of the traced variables : call it from a timer interrupt, at the sampling rate
+const t_shell_region *shell_trace_region (char *name);	// The captured trace, as a region for "download" (if name is "trace")
+void shell_trace_reset (void);		// Drop the trace and its settings, and the variable lookup index (see shell_reset)
+
+// Background jobs (see "shell_jobs.c") : a command line ending with "&" runs in the background, in a job slot.
+int shell_job_start (t_shell_state *sh, const t_shell_block_entry *entry);	// Move the command being started to a job slot. Returns -1 if none is free, or if the command needs the link to itself.
+void shell_jobs_wake (t_shell_state *sh, unsigned int events);	// Make the jobs waiting for these events ready to run
+void shell_jobs_step (t_shell_state *sh);	// Run a step of each job that's ready
+int shell_jobs_ready (t_shell_state *sh);	// Non-zero if a job is ready to run
+unsigned int shell_jobs_wait (t_shell_state *sh);	// Events the jobs are waiting for
+void command_native_jobs (t_shell_state *sh);	// Native commands : list the jobs,
+void command_native_fg (t_shell_state *sh);		// bring a job to the foreground,
+void command_native_kill (t_shell_state *sh);	// and stop a job
 
 // Portability layer (Shell communication interface. Weak functions to be overridden by target-specific implementations)
-void shell_in (char c);		// Feed incoming bytes to this function
-void shell_out (char *buff, int length);		// Send buffer out the UART
-void shell_get_byte (char *c);		// Called by the shell to read a byte from the UART
-void shell_state_error ();			// The shell transitions to this state in case of unrecoverable error.
+// Incoming bytes are stored in the reception ring and processed by the state machine, so these functions are safe to call
+// from an interrupt handler at any time, whatever the state of the shell. Use whichever matches your driver :
+void shell_in (t_shell_state *sh, char c);		// Feed incoming bytes to this function, one at a time (i.e. from a "Rx Complete" callback)
+void shell_in_burst (t_shell_state *sh, char *buff, int length);		// Feed a block of incoming bytes (i.e. from a DMA transfer complete callback)
+void shell_in_dma (t_shell_state *sh, char *buff, int size, int pos);	// Circular DMA reception : pos is the DMA write position within buff
+void shell_out (t_shell_state *sh, char *buff, int length);		// Start sending a buffer out the UART. Must not block.
+void shell_tx_done (t_shell_state *sh);			// Call this from the UART's "Tx Complete" callback or ISR : chains the next transfer
+void shell_get_byte (t_shell_state *sh, char *c);		// Called once by the shell to start reception from the UART. Reception must then keep going
+									// on its own : re-arm the read in your Rx callback, or better, use circular DMA.
+void shell_wakeup (t_shell_state *sh);			// Called when an event is posted : i.e. give the semaphore the shell's task waits on
+unsigned long shell_ticks ();					// Time source for SHELL_SLEEP and SHELL_EVENT_TIMER, i.e. milliseconds since boot
+unsigned long shell_cycles ();					// High resolution time source for the statistics, i.e. the DWT cycle counter
+void shell_state_error (t_shell_state *sh);		// The shell transitions to this state in case of unrecoverable error.
+
+// Logging (see "shell_log.c") : messages are stored unformatted in a ring buffer and printed when the log console is idle.
+// SHELL_LOG can be used anywhere, including interrupt handlers. Arguments are stored as long integers : use long-sized
+// conversions (%ld, %lx...), cast pointers to long, and only pass strings that will still exist when the message is printed.
+#ifndef SHELL_LOG_SIZE
+#define SHELL_LOG_SIZE			32		// Number of messages the ring can hold. Must be a power of two.
+#endif
+#define SHELL_LOG_ARGS			4		// Maximum number of arguments of a message
+
+#define SHELL_LOG_ERROR			0		// Severity levels, most severe first
+#define SHELL_LOG_WARNING		1
+#define SHELL_LOG_INFO			2
+#define SHELL_LOG_DEBUG			3
+
+typedef struct t_shell_log_entry
+{
+	volatile unsigned int seq;		// Position of the message in the ring, plus one, once it's ready to be printed
+	int level;						// Severity
+	unsigned long time;				// shell_ticks () when the message was logged
+	char *format;					// printf format string
+	long arg[SHELL_LOG_ARGS];		// Arguments
+} t_shell_log_entry;
+
+extern volatile int shell_log_level;			// Messages less severe than this level are discarded (runtime filter)
+extern volatile unsigned long shell_log_dropped;	// Number of messages lost because the ring was full
+extern t_shell_state *shell_log_console;		// Shell instance the messages are printed on (default : shell_state)
 
-// Logging function
-void shell_log (char *message);
+#define SHELL_LOG(LEVEL, FORMAT, ...) shell_log_write ((LEVEL), (FORMAT), (long [SHELL_LOG_ARGS]) { __VA_ARGS__ })
+void shell_log_write (int level, char *format, long *args);
+int shell_log_print (t_shell_state *sh);		// Called by the idle state, prints the pending messages on the log console
+void shell_log_reset (void);				// Empty the ring, back to the default level and console (see shell_reset)
+
+void shell_log (char *message);				// Original logging function, now logs message at the "info" level
 #define LOG(a) shell_log((a))		// In case you prefer your logging function "high-visibility"
 
+// Binary mode (see "shell_binary.c") : COBS-framed requests and responses with a CRC, for scripts and test rigs.
+// Receiving SHELL_BINARY_ESCAPE at the prompt switches to binary mode, request SHELL_BINARY_EXIT switches back. The escape
+// starts with a zero byte (a frame delimiter), which typing never sends : line noise or a stray key can't switch modes.
+#ifndef SHELL_BINARY_ESCAPE
+#define SHELL_BINARY_ESCAPE		"\0\x02SH"	// Frame delimiter, ASCII STX, then "SH"
+#endif
+#define SHELL_BINARY_ESCAPE_LEN	((int) sizeof (SHELL_BINARY_ESCAPE) - 1)
+#define SHELL_BINARY_EXIT		0xFFFF	// Command ID of the request that leaves binary mode
+
+#define SHELL_BINARY_OK			0		// Response status : the command ran, the payload is its output
+#define SHELL_BINARY_CRC		1		// The request was corrupted (bad CRC, bad framing, or too large)
+#define SHELL_BINARY_UNKNOWN	2		// No entry has this command ID
+#define SHELL_BINARY_ARGS		3		// The arguments don't match the command's schema
+#define SHELL_BINARY_TRUNCATED	4		// The command ran, but its output didn't fit : the payload is the beginning of it
+
+unsigned short shell_crc16 (unsigned short crc, char *buff, int length);	// CRC-16-CCITT (polynomial 0x1021), MSB first
+
+// Statistics (see "shell_stats.c") : define SHELL_STATS to time every step of the state machines, count the traffic of
+// each instance, and add the native "stats" command. Without it, none of this is compiled in.
+#ifdef SHELL_STATS
+#ifndef SHELL_STATS_ROWS
+#define SHELL_STATS_ROWS		24		// Number of states and commands that can be timed
+#endif
+#define SHELL_STATS_BUCKETS		24		// Histogram buckets : bucket n counts the durations below 2^n cycles (and at least 2^(n-1))
+
+typedef struct t_shell_stats_row
+{
+	void (*fp)();					// State or command function, zero if the row is free
+	unsigned long runs;				// Number of times the command was started (zero for the shell's own states)
+	unsigned long steps;			// Number of calls
+	unsigned long long cycles;		// Total duration of the calls
+	unsigned long max;				// Longest call
+	unsigned long hist[SHELL_STATS_BUCKETS];	// Number of calls by duration
+} t_shell_stats_row;
+
+extern t_shell_stats_row shell_stats_table[SHELL_STATS_ROWS];	// Steps of each state and command, all instances combined
+extern t_shell_stats_row shell_stats_tx;		// Transfers, from shell_out to shell_tx_done (fp is unused)
+extern unsigned long shell_stats_untracked;	// Number of steps not recorded because the table was full
+
+void shell_stats_record (t_shell_stats_row *row, unsigned long cycles);	// Add a call to a row
+void shell_stats_step (void (*fp)(), unsigned long cycles);	// Record a step of a state or command (called by shell_run)
+void shell_stats_run (void (*fp)());			// Count the start of a command (called on dispatch)
+void shell_stats_reset (t_shell_state *sh);	// Clear the table, and the traffic counters of an instance
+char *shell_stats_name (void (*fp)(), int *length);	// Name of a row : the command word, or the name of a state
+#endif
+
 #endif /* INC_SHELL_H_ */
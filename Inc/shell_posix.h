@@ -0,0 +1,57 @@
+/*
+ *  shell_posix.h
+ *
+ *  Portability layer for POSIX hosts (Linux) : binds shell instances to file descriptors, i.e. a pty or a pair of pipes.
+ *  Compile "shell_posix.c" with SHELL_PORT_POSIX defined to use it.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INC_SHELL_POSIX_H_
+#define INC_SHELL_POSIX_H_
+
+#include "shell.h"
+
+// Port data of a shell instance (pointed to by sh->port)
+typedef struct t_shell_posix
+{
+	int in_fd;						// The shell reads the terminal's keystrokes from this descriptor (non-blocking)
+	int out_fd;						// The shell writes its output to this descriptor
+	unsigned long rx_bytes;			// Number of bytes read from in_fd
+	unsigned long tx_bytes;			// Number of bytes written to out_fd
+	int wake_fd[2];					// Self-pipe : shell_wakeup writes to it, to end shell_posix_wait's poll
+	int waiting;					// Set while shell_posix_wait may block : shell_wakeup only writes to the pipe then
+} t_shell_posix;
+
+// Bind a shell instance to a pair of file descriptors (they can be the same, i.e. a socket). Returns 0, or -1 on error.
+int shell_posix_open (t_shell_state *sh, t_shell_posix *port, int in_fd, int out_fd);
+
+// Release the port's own descriptors (the wake-up pipe). The ones given to shell_posix_open are left to the caller.
+void shell_posix_close (t_shell_state *sh);
+
+// Bind a shell instance to a new pseudo-terminal. The name of its slave side (i.e. "/dev/pts/3", for a terminal emulator
+// or a test script to connect to) is copied to name. Returns 0, or -1 on error.
+int shell_posix_openpty (t_shell_state *sh, t_shell_posix *port, char *name, int size);
+
+// Read whatever the terminal sent and feed it to the shell instance. Call this in the main loop, along with shell_run.
+// Returns the number of bytes read, or -1 if the terminal side has been closed.
+int shell_posix_read (t_shell_state *sh);
+
+// Block until the events returned by shell_poll can occur : input is available on in_fd (SHELL_EVENT_RX), the timer
+// expires (SHELL_EVENT_TIMER), or another thread or a signal handler posts an event (shell_event, i.e. SHELL_EVENT_YIELD
+// or SHELL_EVENT_LOG). Transfers are synchronous on this port, so SHELL_EVENT_TX is always already posted.
+// Typical main loop : "while (shell_posix_read (sh) >= 0) shell_posix_wait (sh, shell_poll (sh));"
+void shell_posix_wait (t_shell_state *sh, unsigned int events);
+
+#endif /* INC_SHELL_POSIX_H_ */
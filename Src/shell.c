@@ -22,276 +22,1176 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-// Global instance of the shell state structure
+#if (SHELL_TX_SIZE < SHELL_EDIT_ROOM) || (SHELL_TX_SIZE & (SHELL_TX_SIZE - 1)) || (SHELL_RX_SIZE & (SHELL_RX_SIZE - 1))
+#error "SHELL_RX_SIZE and SHELL_TX_SIZE must be powers of two, and SHELL_TX_SIZE can't be smaller than SHELL_EDIT_ROOM"
+#endif
+
+// Default instance of the shell state structure, for applications with a single console. Each additional console
+// needs its own instance : every function of the library takes the instance it works on as its first argument.
 // IMPORTANT : this variable needs to go into its own linker section so it can be placed where DMA can reach it
 // If necessary, modify your linker script to add the ".shell" section and make sure it ends-up at an address that
-// is compatible with DMA transfers to the shell's serial interface.
+// is compatible with DMA transfers to the shell's serial interface. The same goes for any additional instance (SHELL_SECTION).
 // It is OK for your linker script to not have this section : the linker will then ignore the attribute.
-__attribute__ ((section (".shell"))) t_shell_state shell_state;
+SHELL_SECTION t_shell_state shell_state;
+
+
+
+// ======= Dispatch index =======
+
+// The index is built once and never modified afterwards. Each block gets a slice of the slot pool, sorted by command word,
+// so that all the entries starting with a given prefix are contiguous and can be found by binary search.
+static t_shell_index shell_index_pool[SHELL_INDEX_BLOCKS];
+static t_shell_index_slot shell_index_slots[SHELL_INDEX_ENTRIES];
+static int shell_index_blocks;		// Number of indexed blocks
+static int shell_index_entries;	// Number of slots in use
+static t_shell_index *shell_index_shell;	// Index of the shell block
+static t_shell_index *shell_index_system;	// Index of the system block
+
+// Length of the first word of a label. Labels without arguments have no space, so stop at the null terminator as well.
+static int shell_word_length (char *label)
+{
+	return strcspn (label, " ");
+}
+
+// Orders two command words the way the index is sorted : alphabetically, a prefix coming before the longer words it starts.
+static int shell_word_compare (char *a, int alen, char *b, int blen)
+{
+	int r = strncmp (a, b, (alen < blen) ? alen : blen);
+	return (r != 0) ? r : alen - blen;
+}
+
+// Returns the index of a block, or zero if the block isn't indexed. This is a linear search through the indexed blocks,
+// which is fine since it only happens on navigation, not on every command.
+t_shell_index *shell_index_find (const t_shell_block_entry *block)
+{
+	for (int i = 0; i < shell_index_blocks; i++)
+		if (shell_index_pool[i].block == block)
+			return &shell_index_pool[i];
+	return 0;
+}
+
+// Index a block, then its sub-blocks. Blocks that don't fit in the pool are left out : the parser searches them linearly.
+static t_shell_index *shell_index_add (const t_shell_block_entry *block)
+{
+	if (block == 0)
+		return 0;
+
+	t_shell_index *index = shell_index_find (block);
+	if (index != 0)		// This block is reachable through more than one path and has already been indexed
+		return index;
+
+	int len = BLOCK_COUNT (block);
+	if ((shell_index_blocks < SHELL_INDEX_BLOCKS) && (shell_index_entries + len <= SHELL_INDEX_ENTRIES))
+	{
+		index = &shell_index_pool[shell_index_blocks++];
+		index->block = block;
+		index->slot = &shell_index_slots[shell_index_entries];
+		index->count = len;
+		shell_index_entries += len;
+
+		// Insertion sort : it's stable (entries with the same command word stay in table order) and it only runs once
+		for (int k = 1; k <= len; k++)
+		{
+			t_shell_index_slot slot = { &block[k], shell_word_length (block[k].label) };
+			int i = k - 1;
+			while ((i > 0) && (shell_word_compare (index->slot[i - 1].entry->label, index->slot[i - 1].wlen, slot.entry->label, slot.wlen) > 0))
+			{
+				index->slot[i] = index->slot[i - 1];
+				i--;
+			}
+			index->slot[i] = slot;
+		}
+	}
+
+	// Recurse into the sub-blocks (they are indexed even if this block didn't fit)
+	for (int k = 1; k <= len; k++)
+		if ((block[k].fp == 0) && (block[k].cb != 0))
+			shell_index_add (block[k].cb);
+
+	return index;
+}
+
+// Build the dispatch index. Only the first call does anything : the block tables don't change at run time.
+// The index is shared by all the shell instances. shell_state_init calls this function, so when instances run on separate
+// threads, either call it before starting them or make sure the first instance is initialized before the others.
+void shell_index_build ()
+{
+	if (shell_index_blocks != 0)
+		return;
+
+	shell_index_shell = shell_index_add (shell_block);
+	shell_index_system = shell_index_add (system_block);
+	shell_index_add (root_block);
+}
+
+// Resolve a command word (first wlen characters of word) within a block. If the block has an index, the cost only depends
+// on the length of the word and the logarithm of the block's size. Otherwise, the block's entries are compared one by one.
+int shell_index_lookup (t_shell_index *index, const t_shell_block_entry *block, char *word, int wlen, const t_shell_block_entry **match)
+{
+	if (index == 0)		// Block isn't indexed : linear search
+	{
+		int len = BLOCK_COUNT (block);
+		int found = 0;
+		for (int k = 1; k <= len; k++)
+		{
+			int elen = shell_word_length (block[k].label);
+			if ((elen < wlen) || (strncmp (word, block[k].label, wlen) != 0))
+				continue;
+			if (elen == wlen)	// Exact match, no need to look further
+			{
+				*match = &block[k];
+				return SHELL_MATCH_FOUND;
+			}
+			if (found++ == 0)	// Prefix match : remember the first one, keep looking for an exact match or another candidate
+				*match = &block[k];
+		}
+		return (found == 0) ? SHELL_MATCH_NONE : (found == 1) ? SHELL_MATCH_FOUND : SHELL_MATCH_AMBIGUOUS;
+	}
+
+	// Binary search for the first slot that isn't sorted before the command word
+	int lo = 0, hi = index->count;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (shell_word_compare (index->slot[mid].entry->label, index->slot[mid].wlen, word, wlen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// All the entries starting with the command word follow, the exact match (if any) being the first one
+	t_shell_index_slot *slot = &index->slot[lo];
+	if ((lo == index->count) || (slot->wlen < wlen) || (strncmp (slot->entry->label, word, wlen) != 0))
+		return SHELL_MATCH_NONE;
+
+	*match = slot->entry;
+	if (slot->wlen == wlen)
+		return SHELL_MATCH_FOUND;
+
+	// Prefix match : it's only valid if the next entry doesn't start with the command word as well
+	slot++;
+	if ((lo + 1 < index->count) && (strncmp (slot->entry->label, word, wlen) == 0))
+		return SHELL_MATCH_AMBIGUOUS;
+	return SHELL_MATCH_FOUND;
+}
+
+// Position of a block in the index, or -1 if it isn't indexed
+int shell_index_number (const t_shell_block_entry *block)
+{
+	t_shell_index *index = shell_index_find (block);
+	return (index == 0) ? -1 : index - shell_index_pool;
+}
+
+// Numeric command IDs, used by binary mode : the position of the block in the index times 256, plus the position of the
+// entry in its block (the title entry is 0). They only depend on the block tables, not on the sort. Only indexed blocks
+// have IDs, and only their first 255 entries. Returns zero if no entry has this ID.
+const t_shell_block_entry *shell_index_entry (int id)
+{
+	int number = (id >> 8) & 0xFF;
+	int k = id & 0xFF;
+	if ((number >= shell_index_blocks) || (k > shell_index_pool[number].count))
+		return 0;
+	return &shell_index_pool[number].block[k];
+}
+
+// ======= Navigation =======
+
+// The current path is a stack of blocks, from the root to the current block. Navigating pushes or pops blocks, and the
+// prompt is printed straight from the blocks' titles, whose lengths are cached : nothing is ever searched or copied.
+
+// Make the block on top of the path stack the current block, and select its dispatch index
+static void shell_top_block (t_shell_state *sh)
+{
+	sh->block = sh->path[sh->depth - 1];
+	sh->lookup = shell_index_find (sh->block);
+}
 
-extern t_shell_block_entry root_block[];		// Must be declared by the application
+// Navigate to a sub-block of the current block. Returns -1 if the path stack is full (see SHELL_PATH_DEPTH).
+int shell_push_block (t_shell_state *sh, const t_shell_block_entry *block)
+{
+	if (sh->depth == SHELL_PATH_DEPTH)
+		return -1;
+	sh->path[sh->depth] = block;
+	sh->path_length[sh->depth] = strlen (block[0].label);
+	sh->prompt_length += sh->path_length[sh->depth] + 1;	// "/" and the block's title
+	sh->depth++;
+	shell_top_block (sh);
+	return 0;
+}
+
+// Navigate to the parent of the current block. Does nothing at the root.
+void shell_pop_block (t_shell_state *sh)
+{
+	if (sh->depth > 1)
+	{
+		sh->depth--;
+		sh->prompt_length -= sh->path_length[sh->depth] + 1;
+		shell_top_block (sh);
+	}
+}
+
+// Navigate along a path : block names separated by slashes, ".." for the parent block, and a leading slash to start
+// from the root (i.e. "/motor/pid", "../sensors"). Block names can be abbreviated like commands.
+// The whole path is resolved in one go. If it's invalid, the current path doesn't change, and the return value tells why :
+// SHELL_PATH_NOT_FOUND or SHELL_PATH_TOO_DEEP. Returns zero on success.
+int shell_change_path (t_shell_state *sh, char *path)
+{
+	// Keep a copy of the path stack, in case the path turns out to be invalid half-way
+	const t_shell_block_entry *saved[SHELL_PATH_DEPTH];
+	int depth = sh->depth;
+	int prompt_length = sh->prompt_length;
+	memcpy (saved, sh->path, sizeof (saved));
+
+	int result = 0;
+	if (*path == '/')
+		while (sh->depth > 1)
+			shell_pop_block (sh);
 
-// Function pointer for the current state of the shell :
-void (*shell_fp)() = shell_state_init;
+	while ((*path != 0) && (result == 0))
+	{
+		int len = strcspn (path, "/");
+		const t_shell_block_entry *match;
+
+		if ((len == 0) || ((len == 1) && (path[0] == '.')))
+			;	// Empty or "." : stay here
+		else if ((len == 2) && (path[0] == '.') && (path[1] == '.'))
+			shell_pop_block (sh);
+		else if ((shell_index_lookup (sh->lookup, sh->block, path, len, &match) != SHELL_MATCH_FOUND) || (match->fp != 0) || (match->cb == 0))
+			result = SHELL_PATH_NOT_FOUND;		// Not a sub-block of the current block
+		else if (shell_push_block (sh, match->cb) != 0)
+			result = SHELL_PATH_TOO_DEEP;
+
+		path += len;
+		if (*path == '/')
+			path++;
+	}
+
+	if (result != 0)	// Restore the path stack. The cached lengths of the saved blocks are recomputed.
+	{
+		memcpy (sh->path, saved, sizeof (saved));
+		for (int i = 0; i < depth; i++)
+			sh->path_length[i] = strlen (saved[i][0].label);
+		sh->depth = depth;
+		sh->prompt_length = prompt_length;
+		shell_top_block (sh);
+	}
+	return result;
+}
+
+// Length of the prompt : a line break, the path, and ">"
+int shell_prompt_length (t_shell_state *sh)
+{
+	return sh->prompt_length + 3;
+}
 
-// ======= Logging =======
+// Queue the prompt for transmission. The caller must make sure there's room for it (see shell_prompt_length).
+void shell_prompt (t_shell_state *sh)
+{
+	shell_tx_write (sh, "\r\n", 2);
+	for (int i = 0; i < sh->depth; i++)
+	{
+		shell_tx_write (sh, "/", 1);
+		shell_tx_write (sh, sh->path[i][0].label, sh->path_length[i]);
+	}
+	shell_tx_write (sh, ">", 1);
+}
 
-// Simple logging function. Should only be used OUTSIDE of Console command functions.
-// This is not robust, it is meant only as a cheap debugging tool during development, until I code something stronger.
-void shell_log (char *message)
+// Print the prompt and the line being typed again, if log messages or the output of a job have been printed over them.
+// Returns non-zero if the transmission ring doesn't have room for them yet.
+static int shell_redraw (t_shell_state *sh)
 {
-	// Copy the message to the egress buffer, prefix with a carriage return
-	sprintf (shell_state.output, "\r\n%s", message);
-	// Use the target's console output function to send it out
-	shell_out (shell_state.output, strlen (shell_state.output));
+	if (sh->redraw == 0)
+		return 0;
+	if (shell_tx_free (sh) < shell_prompt_length (sh) + sh->index + 16)
+		return 1;
+	shell_prompt (sh);
+	shell_tx_write (sh, sh->input, sh->index);
+	shell_edit_move (sh, sh->index, sh->cursor);	// Put the cursor back where it was
+	sh->redraw = 0;
+	return 0;
 }
 
 // ======= Main state machine state functions =======
 
+// Run the current state of a shell instance, then a step of each of its background jobs. Call this in a loop, for each
+// instance. A zero-initialized instance starts from the initialization state.
+void shell_run (t_shell_state *sh)
+{
+	shell_step (sh);
+	shell_jobs_wake (sh, ~0u);	// Called in a loop : whatever the jobs are waiting for, they check it themselves
+	shell_jobs_step (sh);
+}
+
+// Run the current state of the foreground
+void shell_step (t_shell_state *sh)
+{
+	if (sh->fp == 0)
+		sh->fp = shell_state_init;
+	sh->wait = 0;
+#ifdef SHELL_STATS
+	void (*fp) (t_shell_state *) = sh->fp;
+	unsigned long start = shell_cycles ();
+	(*fp) (sh);
+	shell_stats_step (fp, shell_cycles () - start);
+#else
+	(*sh->fp) (sh);
+#endif
+}
+
+// Event-driven version of shell_run. The states that wait for something (input, room in the transmission ring...)
+// say so with SHELL_WAIT : then they're not called again until the event occurs, instead of being called in a loop
+// only to find out there's still nothing to do. States must still check their own condition when they run : events
+// only tell when it's worth checking.
+// Returns the events the instance is waiting for, or zero if it can run again right away (after SHELL_POLL_STEPS states,
+// to give other instances and the application a chance to run).
+// A typical main loop : "if (shell_poll (&shell_state) != 0) wait_for_interrupt ();"
+// Background jobs are scheduled round-robin with the foreground : each round runs a state of the foreground and a step of
+// each job, as long as they have something to do.
+unsigned int shell_poll (t_shell_state *sh)
+{
+	sh->poll_count++;
+
+	if ((sh->busy == 0) && (sh->tx_active != 0))	// A transfer completed without shell_tx_done : account for it
+		shell_tx_flush (sh);
+	unsigned int events = __atomic_exchange_n (&sh->events, 0, __ATOMIC_ACQ_REL);
+	unsigned int fg_events = events;
+	if ((sh->wait & SHELL_EVENT_TIMER) && ((long) (shell_ticks () - sh->wake_time) >= 0))
+		fg_events |= SHELL_EVENT_TIMER;
+	if (fg_events & sh->wait)
+		sh->wait = 0;
+	shell_jobs_wake (sh, events);
+
+	if ((sh->wait != 0) && (shell_jobs_ready (sh) == 0))
+	{
+		sh->poll_skipped++;
+		return sh->wait | shell_jobs_wait (sh);
+	}
+
+	for (int n = 0; n < SHELL_POLL_STEPS; n++)
+	{
+		if (sh->wait == 0)
+		{
+			shell_step (sh);
+			sh->step_count++;
+		}
+		shell_jobs_step (sh);
+		if ((sh->wait != 0) && (shell_jobs_ready (sh) == 0))
+			return sh->wait | shell_jobs_wait (sh);
+	}
+	return 0;
+}
+
+// When the instance expects SHELL_EVENT_TIMER : the earliest expiration among the foreground and the jobs waiting for it.
+// Use it to program a wake-up timer when shell_poll returns SHELL_EVENT_TIMER.
+unsigned long shell_wake_time (t_shell_state *sh)
+{
+	unsigned long now = shell_ticks ();
+	unsigned long wake = now + 0x7FFFFFFF;
+	if ((sh->wait & SHELL_EVENT_TIMER) && ((long) (sh->wake_time - wake) < 0))
+		wake = sh->wake_time;
+	for (int i = 0; i < SHELL_JOBS; i++)
+		if ((sh->jobs[i].fp != 0) && (sh->jobs[i].wait & SHELL_EVENT_TIMER) && ((long) (sh->jobs[i].wake_time - wake) < 0))
+			wake = sh->jobs[i].wake_time;
+	return wake;
+}
+
+// Post events to a shell instance, and wake it up
+void shell_event (t_shell_state *sh, unsigned int events)
+{
+	__atomic_fetch_or (&sh->events, events, __ATOMIC_RELEASE);
+	shell_wakeup (sh);
+}
+
+// Shared state back to start-up (see shell.h). Each instance is reset by its own init state.
+void shell_reset (void)
+{
+	shell_macros_reset ();
+	shell_trace_reset ();
+	shell_log_reset ();
+#ifdef SHELL_STATS
+	shell_stats_reset (&shell_state);
+#endif
+}
+
 // Initial state - Runs once; performs initialization
-void shell_state_init ()
+void shell_state_init (t_shell_state *sh)
 {
 	// Empty the buffers by making them zero-length null-terminated strings :
-	shell_state.input[0] = 0;
-	shell_state.output[0] = 0;
-	shell_state.busy = 0;			// 0 == No transfer in progress, 1 == Transfer in progress
-	shell_state.index = 0;
+	sh->input = sh->input_buffer;
+	sh->output = sh->output_buffer;
+	sh->input[0] = 0;
+	sh->output[0] = 0;
+	sh->busy = 0;			// 0 == No transfer in progress, 1 == Transfer in progress
+	sh->index = 0;
+	sh->cr = 0;
+	sh->cursor = sh->escape = 0;	// Line editing (see "shell_edit.c")
+	sh->history_head = sh->history_tail = sh->history_pos = 0;	// Empty history
+	sh->search = -1;
+	sh->rx_head = sh->rx_tail = 0;	// Empty reception ring
+	sh->rx_overflow = 0;
+	sh->rx_dma = 0;
+	sh->tx_head = sh->tx_tail = sh->tx_len = 0;	// Empty transmission ring
+	sh->tx_active = 0;
+	sh->capture = 0;
+	sh->watch.entry = 0;
+	shell_script_abort (sh);	// No script in progress
+	sh->error = 0;
+	sh->binary = 0;			// Start in text mode
+	sh->binary_match = 0;
+#ifdef SHELL_STATS
+	sh->rx_bytes = sh->tx_bytes = 0;
+#endif
+
+	sh->command_fp = 0;	// No command in progress
+	sh->command_state = sh->command_index = 0;
+	sh->events = sh->wait = 0;
+
+	for (int i = 0; i < SHELL_JOBS; i++)	// No background jobs
+	{
+		sh->jobs[i].fp = 0;
+		sh->jobs[i].input = sh->jobs[i].input_buffer;
+		sh->jobs[i].output = sh->jobs[i].output_buffer;
+	}
+	sh->job_count = sh->tag = sh->redraw = 0;
+
+	sh->shell =	shell_block;	// Setup the PFS shell block (native shell commands like "cd.." and "ls")
+	sh->system = system_block;		// System block for now (application-defined, find a mechanism)
+	sh->root = root_block;
 
-	shell_state.command_fp = 0;	// No command in progress
+	shell_index_build ();		// Sort the block tables for the parser
+	// Shell starts at the root : initialize the path stack with it
+	sh->depth = sh->prompt_length = 0;
+	shell_push_block (sh, sh->root);
 
-	shell_state.shell =	shell_block;	// Setup the PFS shell block (native shell commands like "cd.." and "ls")
-	shell_state.system = system_block;		// System block for now (application-defined, find a mechanism)
-	shell_state.root = root_block;
-	shell_state.block = shell_state.root;	// Shell starts at the root.
+	// Start reception : from now on, incoming bytes are queued in the ring by shell_in
+	shell_get_byte (sh, &sh->c);
 
-	// Initialize the path string :
-	sprintf (shell_state.path, "\r\n/%s>", root_block[0].label);
+	// The boot script runs before the first prompt, on the default instance only
+	if ((sh == &shell_state) && (shell_boot.script != 0))
+		shell_script_push (sh, shell_boot.script, shell_boot.name, shell_boot.on_error);
 
 	// Transition to output state immediately after initialization :
-	shell_fp = shell_state_output;
+	sh->fp = shell_state_output;
 }
 
 // Displays the shell prompt or a line of command output, then transitions to user input state or back to command in progress
-void shell_state_output ()
+// The text is copied to the transmission ring, so there's no need to wait for the transfer to complete : the command can
+// prepare its next line right away. This state only waits if the ring doesn't have enough room.
+void shell_state_output (t_shell_state *sh)
 {
-	static int state = 0;		// This state has sub-states
+	if ((sh->binary != 0) && (sh->command_fp == 0))
+	{
+		sh->fp = shell_state_binary_reply;	// Binary mode : the command is over, send its response instead of the prompt
+		return;
+	}
+	if ((sh->watch.entry != 0) && (sh->command_fp == 0))
+	{
+		sh->fp = shell_state_watch;		// A run of a watched command is over : update the display instead of the prompt
+		return;
+	}
+	if ((sh->script_depth != 0) && (sh->command_fp == 0))
+	{
+		sh->fp = shell_state_script;	// A command of a script is over : run the next one, without a prompt
+		return;
+	}
+
+	// if a command isn't in progress, send the prompt instead
+	int len = (sh->command_fp != 0) ? strlen (sh->output) : shell_prompt_length (sh);
 
-	switch (state)
+	if (shell_tx_free (sh) < len)		// Wait for previous transfers to make room
 	{
-		case 0:		// Wait for previous DMA transfer to complete
-			if (shell_state.busy == 0)
-				state = 1;		// transition to next state if DMA is ready
-			break;
-		case 1:		// Transfer the output buffer : if a command isn't in progress, send the path instead
-			if (shell_state.command_fp != 0) // then we're here because a command wants to send some text to the terminal
-				shell_out (shell_state.output, strlen (shell_state.output));
-			else
-				shell_out (shell_state.path, strlen (shell_state.path));
-			state = 2;			// transition to next state
-			break;
-		case 2:		// Wait for transfer to complete
-			if (shell_state.busy == 0)
-				state = 3;
-			break;
-		case 3:		// Transition to input state, unless a command is in progress :
-			shell_fp = (shell_state.command_fp != 0) ? shell_state.command_fp : shell_state_input;
-			state = 0;	// reset this state machine
-			break;
+		shell_tx_flush (sh);
+		SHELL_WAIT (SHELL_EVENT_TX)
+		return;
 	}
+	if (sh->command_fp != 0)
+		shell_tx_write (sh, sh->output, len);
+	else
+		shell_prompt (sh);
+
+	// Transition to input state, unless a command is in progress :
+	sh->fp = (sh->command_fp != 0) ? sh->command_fp : shell_state_input;
 }
 
-void shell_state_input ()
+void shell_state_input (t_shell_state *sh)
 {
-	shell_get_byte (&shell_state.c);	// Ask the terminal interface (UART ?) for the next keystroke from the user...
-	shell_fp = shell_state_idle;		// ... and go idle until it arrives.
+	sh->fp = shell_state_idle;		// Go idle until a complete line has been received
 }
 
-void shell_state_idle ()
+// Process the bytes accumulated in the reception ring : line editing, echo, and end of line detection.
+// Bytes are consumed from the main loop rather than from the interrupt handler, so nothing is lost when they arrive
+// while the shell is busy elsewhere (i.e. when a script pastes several lines at once) : they simply wait in the ring.
+void shell_state_idle (t_shell_state *sh)
 {
-	// Do nothing. Used when waiting for the state machine state to be transitioned from an interrupt handler or callback
-	// DANGER : the shell will get stuck in that state if a key is pressed outside of the input state !
-	// SOLUTION : re-start the UART read. TO DO : find out how expensive this is.
-	shell_get_byte (&shell_state.c);
-	// Note : this solution is actually required when using a serial interface that doesn't have an interrupt-based API
-	// (specifically : my own USB Virtual COM Port library)
+	shell_tx_flush (sh);		// Start sending the echo queued on previous calls, if the interface is ready
+
+	// Print the pending log messages first (if this instance is the log console), then the prompt and the line being typed
+	// again if anything has been printed over them
+	if ((shell_log_print (sh) != 0) || (shell_redraw (sh) != 0))
+	{
+		SHELL_WAIT (SHELL_EVENT_TX)
+		return;
+	}
+
+	// Typing at the end of the line is echoed here, in a batch. Anything else goes to the line editor, which writes its
+	// updates directly and may need room for the whole line : bytes are only consumed once there's room to echo them.
+	char echo[SHELL_RX_SIZE];
+	int n = 0;				// Number of bytes to echo
+	int room = shell_tx_free (sh);
+	int eol = 0;			// Set when a carriage return is found
+	unsigned int tail = sh->rx_tail;
+	unsigned int head = __atomic_load_n (&sh->rx_head, __ATOMIC_ACQUIRE);	// Read the ring's contents after the index
+	while ((tail != head) && (eol == 0) && (sh->redraw == 0) && (n < SHELL_RX_SIZE))
+	{
+		char c = sh->rx[tail & (SHELL_RX_SIZE - 1)];
+		int typing = (sh->escape == 0) && (sh->cursor == sh->index) && ((unsigned char) c >= ' ') && (c != 127);
+		if (room - n < (typing ? 1 : SHELL_EDIT_ROOM))
+			break;
+		tail++;
+		int cr = sh->cr;
+		sh->cr = (c == 13);
+
+		if ((sh->binary_match != 0) && ((c != SHELL_BINARY_ESCAPE[sh->binary_match]) || (sh->command_fp != 0)))
+			sh->binary_match = 0;		// Not the escape after all : the bytes matched so far are dropped
+		if ((c == SHELL_BINARY_ESCAPE[sh->binary_match]) && (sh->command_fp == 0))
+		{
+			if (++sh->binary_match < SHELL_BINARY_ESCAPE_LEN)
+				continue;
+			// Switch to binary mode. The line typed so far is dropped.
+			sh->binary_match = 0;
+			sh->index = sh->cursor = 0;
+			sh->escape = 0;
+			sh->binary = 1;
+			break;
+		}
+
+		if ((c == 10) && (cr != 0))	// line feed of a CR LF line ending : the line is already complete
+			;
+		else if ((c == 13) || (c == 10))		// carriage return (or line feed alone, from scripts) : the line is complete
+		{
+			sh->input[sh->index] = 0;		// Add null termination
+			if (sh->command_fp == 0)		// Lines typed for a command in progress aren't worth recalling
+				shell_history_add (sh, sh->input);
+			sh->index = sh->cursor = 0;	// reset index for next time
+			sh->escape = 0;
+			sh->search = -1;
+			sh->history_pos = sh->history_head;
+			eol = 1;
+		}
+		else if (typing && (sh->index < SHELL_BUFFER_SIZE - 1))		// Buffer overflow protection : keep room for the null terminator
+		{
+			sh->input[sh->index++] = c;	// buffer the incoming byte and increment the buffer index
+			sh->cursor = sh->index;
+			sh->search = -1;
+			echo[n++] = c;
+		}
+		else
+		{
+			if (n > 0)
+				shell_tx_write (sh, echo, n);	// The editor writes directly : keep the order
+			n = 0;
+			shell_edit (sh, c);
+			room = shell_tx_free (sh);
+		}
+	}
+	__atomic_store_n (&sh->rx_tail, tail, __ATOMIC_RELEASE);	// Release the consumed bytes to the producer
+
+	if (n > 0)
+		shell_tx_write (sh, echo, n);	// echo everything that was consumed at once : it'll be coalesced with any pending output
+
+	// reception complete : transition to either the parser or the command in progress :
+	if (sh->binary != 0)
+	{
+		// The bytes following the escape are frames. Send a delimiter, so the other side can discard the echo and the
+		// prompt : everything it receives from now on is a response.
+		shell_tx_write (sh, "", 1);
+		sh->frame_len = 0;
+		sh->fp = shell_state_binary;
+	}
+	else if (eol != 0)
+		sh->fp = (sh->command_fp != 0) ? sh->command_fp : shell_state_parser;
+	else if (sh->redraw == 0)		// Nothing more to do until more bytes arrive, or until there's room to echo the ones already received
+		SHELL_WAIT ((tail == head) ? SHELL_EVENT_RX | SHELL_EVENT_LOG : SHELL_EVENT_TX)
 }
 
-// TO DO : I've improved the parser to also decode partial commands (i.e. "com" will match "command"),
-// but this doesn't work when the command line contains arguments. Fix that if it can be done inexpensively.
-// I think the problem is in the command functions using sscanf to parse the command line (they would be expecting the full command word)
-void shell_state_parser ()
+// The parser matches the first word of the command line against the command words of the current block, then the
+// system block, then the shell block. A command word matches an entry if it's equal to the entry's first word or if
+// it's the prefix of exactly one entry (i.e. "com" will match "command"). Arguments following the first word are
+// left in the input buffer for the command function to parse, unless the command has an argument schema : then the
+// parser splits the line into words (in place) and converts them once and for all (see shell_arguments).
+void shell_state_parser (t_shell_state *sh)
 {
+	sh->error = 0;
+
+	// Leading spaces would make an empty command word, which is the prefix of every entry
+	int skip = strspn (sh->input, " ");
+	if (skip > 0)
+		memmove (sh->input, sh->input + skip, strlen (sh->input + skip) + 1);
+
 	// If the command line is empty, return immediately to wait for a new one
-	if (strlen (shell_state.input) == 0)
+	if (strlen (sh->input) == 0)
 	{
-		shell_fp = shell_state_output;
+		sh->fp = shell_state_output;
 		return;
 	}
 
-	// Getting here means shell_state.command_fp must be zero, but for now let's just make sure
-	shell_state.command_fp = 0;	// No command is currently executing (or we wouldn't be here)
+	// Getting here means sh->command_fp must be zero, but for now let's just make sure
+	sh->command_fp = 0;	// No command is currently executing (or we wouldn't be here)
 
-	// Compute the length of the first word of the command line
-	int clen = strlen (shell_state.input);	// Start from the command line's length
-	int i;
-	for (i = 0; i < clen; i++)
-		if (shell_state.input[i] == 32)
-			clen = i;		// Will cause the loop to exit after the first match. If there's no match, clen remains unchanged.
-
-	// Look for a matching command within the current block :
-	int len = (int) shell_state.block[0].fp;	// The function pointer in a block's title entry holds number of commands in the block
-	// Note : a block with no command (len == 0) is not supported
-	for (int k = 1; k <= len; k++)	// Loop through the block. Skip the title entry
-	{
-		// Determine the index of the first space in the command label => can be optimized out
-		// int j = 0;
-		// while (shell_state.block[k].label[j] != 32) j++; // Note : the index of the first space is also the length of the first word.
-
-		// Compare the command line's start to the command label in the block entry
-		// if (strncmp(shell_state.input, shell_state.block[k].label, strlen(shell_state.block[k].label)) == 0)
-		// if (strncmp(shell_state.input, shell_state.block[k].label, j) == 0)
-		if (strncmp(shell_state.input, shell_state.block[k].label, clen) == 0)	// Use clen instead of j
+	// A command list ("a; b; c") runs as a script : each command goes through the parser in turn
+	if (sh->input[shell_script_split (sh->input)] != 0)
+	{
+		strcpy (sh->script_line, sh->input);
+		if (shell_script_push (sh, sh->script_line, 0, SHELL_SCRIPT_CONTINUE) != 0)
 		{
-			// Found a match ! Determine if it's a command or a sub-block
-			if (shell_state.block[k].fp != 0)	// then it's a command !
-			{
-				shell_fp = shell_state.block[k].fp;
-				shell_state.command_fp = shell_fp;	// Necessary for now, try to optimize-out in the future
-				return;
-			}
-			if (shell_state.block[k].cb != 0) // then it's a child block (cb) !
-			{
-				// Edit the path string
-				char *temp = shell_state.path + strlen (shell_state.path) - 1;	// Go to the last byte of the path string ('>'), which will be overwritten
-				sprintf (temp, "/%s>", shell_state.block[k].cb[0].label);	// Append a slash, the child block's label, and a fresh ">"
-				shell_state.block[k].cb->cb = shell_state.block;	// Initialize back-navigation pointer (cb of cb is actually parent block of cb, and that's the current block)
-				shell_state.block = shell_state.block[k].cb;  // update the current block to the child block
-				shell_fp = shell_state_output;	// transition back to prompt
-				return;
-			}
+			sprintf (sh->output, "\r\nscripts nested too deep");
+			COMMAND_FAIL
+			return;
+		}
+		sh->fp = shell_state_script;
+		return;
+	}
+
+	// A trailing "&" runs the command in the background
+	int background = 0;
+	int end = strlen (sh->input);
+	while ((end > 0) && (sh->input[end - 1] == ' '))
+		end--;
+	if ((end > 0) && (sh->input[end - 1] == '&'))
+	{
+		background = 1;
+		sh->input[end - 1] = 0;
+	}
+
+	// Compute the length of the first word of the command line
+	int clen = strcspn (sh->input, " ");
+
+	const t_shell_block_entry *match = 0;
+	int result = shell_command_find (sh, clen, &match);
+
+	if (result == SHELL_MATCH_AMBIGUOUS)
+	{
+		// Tell the user instead of picking one of the candidates
+		sprintf (sh->output, "\r\n%.*s : ambiguous command", (clen < 64) ? clen : 64, sh->input);
+		COMMAND_FAIL	// The output state will print the message, then end this pseudo-command
+		return;
+	}
+
+	if (result == SHELL_MATCH_NONE)
+	{
+		// No match has been found, go back to the prompt :
+		sh->error = 1;
+		sh->fp = shell_state_output;
+		return;
+	}
 
-			// Getting here means that the matching block contains two null pointers, which is illegal : transition to the error state
-			shell_fp = shell_state_error;
+	// Found a match ! Determine if it's a command or a sub-block
+	if (match->fp != 0)	// then it's a command !
+	{
+		sh->argc = 0;
+		if ((match->args != 0) && (shell_arguments (sh, match) != 0))
+		{
+			COMMAND_FAIL	// Invalid arguments : the command won't run, print the error message instead
+			return;
+		}
+		shell_command_start (sh, match->fp);
+		if ((background != 0) && (shell_job_start (sh, match) != 0))
+		{
+			// The command doesn't run at all, rather than taking over the console
+			sprintf (sh->output, "\r\n%s : can't run in the background (no free job slot?)", match->label);
+			COMMAND_FAIL
+		}
+		return;
+	}
+	if (match->cb != 0) // then it's a child block (cb) !
+	{
+		// update the current block to the child block, then transition back to prompt
+		if (shell_push_block (sh, match->cb) != 0)
+		{
+			sprintf (sh->output, "\r\n%s : path too deep", match->cb[0].label);
+			COMMAND_FAIL
 			return;
 		}
+		sh->fp = shell_state_output;
+		return;
+	}
+
+	// Getting here means that the matching block contains two null pointers, which is illegal : transition to the error state
+	sh->fp = shell_state_error;
+}
+
+// Look up the first word of the command line (wlen bytes) in the current block, then in the system block (application
+// commands available from any path), and finally in the shell block (native shell commands). The first block with a
+// match (or an ambiguity) wins. Returns one of the SHELL_MATCH_ values.
+int shell_command_find (t_shell_state *sh, int wlen, const t_shell_block_entry **match)
+{
+	int result = shell_index_lookup (sh->lookup, sh->block, sh->input, wlen, match);
+	if (result == SHELL_MATCH_NONE)
+		result = shell_index_lookup (shell_index_system, sh->system, sh->input, wlen, match);
+	if (result == SHELL_MATCH_NONE)
+		result = shell_index_lookup (shell_index_shell, sh->shell, sh->input, wlen, match);
+	return result;
+}
+
+// Start a command. The parser and binary mode both go through here, so that commands always start from a clean state.
+void shell_command_start (t_shell_state *sh, void (*fp)())
+{
+	sh->fp = fp;
+	sh->command_fp = fp;
+	sh->command_state = sh->command_index = 0;	// The command starts from its initial state
+	memset (sh->context, 0, sizeof (sh->context));
+#ifdef SHELL_STATS
+	shell_stats_run (fp);
+#endif
+}
+
+// Split the command line into words, in place : separators are replaced by null characters. Returns the number of words,
+// or -1 if there are more than SHELL_MAX_ARGS.
+static int shell_tokenize (t_shell_state *sh)
+{
+	char *p = sh->input;
+	int argc = 0;
+
+	while (1)
+	{
+		while (*p == ' ')
+			*p++ = 0;
+		if (*p == 0)
+			return argc;
+		if (argc == SHELL_MAX_ARGS)
+			return -1;
+
+		if (*p == '"')		// Quoted argument : runs until the closing quote
+		{
+			sh->argv[argc++] = ++p;
+			while ((*p != 0) && (*p != '"'))
+				p++;
+			if (*p != 0)
+				*p++ = 0;
+		}
+		else
+		{
+			sh->argv[argc++] = p;
+			while ((*p != 0) && (*p != ' '))
+				p++;
+		}
+	}
+}
+
+// Tokenize the command line and convert the arguments according to the entry's schema. On error, prints a message and
+// the command's label (i.e. its usage) to the output buffer and returns -1. Returns 0 otherwise.
+int shell_arguments (t_shell_state *sh, const t_shell_block_entry *entry)
+{
+	char *schema = entry->args;
+	int optional = 0;		// Set once the schema's '?' has been passed
+	int n;
+
+	sh->argc = shell_tokenize (sh);
+	if (sh->argc < 0)
+	{
+		sprintf (sh->output, "\r\n%.64s : too many arguments\r\nusage : %.128s", sh->argv[0], entry->label);
+		return -1;
 	}
 
-	// Getting here means the user's command wasn't found in the current block.
-	// Let's check the system block (application commands available from any path)
-	// This one is easier because it's flat (no sub-blocks)
-	len = (int) shell_state.system[0].fp;	// function pointer on a block's title entry holds number of commands in the block
-	// Note : a block with no command (len == 0) is supported : it is ignored
-	if (len > 0)
+	for (n = 1; n < sh->argc; n++)
 	{
-		for (int k = 1; k <= len; k++)	// skip the title entry
+		char *arg = sh->argv[n];
+		char *end = arg;
+
+		if (*schema == '?')
 		{
-			// Determine the index of the first space in the command label
-			int j = 0;
-			while (shell_state.system[k].label[j] != 32) j++; // Note : the index of the first space is also the length of the first word.
+			optional = 1;
+			schema++;
+		}
+		if (*schema == 0)	// More arguments than the schema allows
+			break;
+		if (*schema == '*')	// Extra arguments are strings, nothing to convert
+			return 0;
 
-			// Compare the command line's start to the command label in the block entry
-			// if (strncmp(shell_state.input, shell_state.block[k].label, strlen(shell_state.block[k].label)) == 0)
-			if (strncmp(shell_state.input, shell_state.system[k].label, j) == 0)
-			{
-				// Found a match ! It's a command, as there are no sub-blocks here
-				if (shell_state.system[k].fp != 0)	// then it's a command !
+		switch (*schema++)
+		{
+			case 'i':
+				sh->arg[n].i = strtol (arg, &end, 0);
+				break;
+			case 'x':
+				sh->arg[n].x = strtoul (arg, &end, 16);
+				break;
+			case 'f':
+				sh->arg[n].f = strtof (arg, &end);
+				break;
+			case 's':
+				sh->arg[n].s = arg;
+				end = arg + strlen (arg);
+				break;
+			case '{':		// Enumeration : compare the argument with each word of the list
+				sh->arg[n].e = 0;
+				while ((*schema != '}') && (*schema != 0))
 				{
-					shell_fp = shell_state.system[k].fp;
-					shell_state.command_fp = shell_fp;	// Necessary for now, try to optimize-out in the future
+					int len = strcspn (schema, "|}");
+					if (((int) strlen (arg) == len) && (strncmp (arg, schema, len) == 0))
+						end = arg + len;
+					schema += len;
+					if (*schema == '|')
+					{
+						schema++;
+						if (*end != 0)
+							sh->arg[n].e++;		// Not found yet : next word
+					}
 				}
-				return;	// job done
-			}
+				if (*schema == '}')
+					schema++;
+				break;
+		}
+
+		if ((*end != 0) || (end == arg))	// The argument wasn't entirely converted
+		{
+			sprintf (sh->output, "\r\n%.64s : invalid argument %d\r\nusage : %.128s", sh->argv[0], n, entry->label);
+			return -1;
 		}
 	}
 
-	// Getting here means the user's command wasn't found in the current or the system block.
-	// Let's check the shell block (native shell commands)
-	// This one is easier because it's flat (no sub-blocks)
-	// Because the shell block is not meant to be tailored to the application, safety checks are removed.
-	len = (int) shell_state.shell[0].fp;	// function pointer on a block's title entry holds number of commands in the block
-	// Note : a block with no command (len == 0) is not supported
-	for (int k = 1; k <= len; k++)	// skip the title entry
+	if (n < sh->argc)
+	{
+		sprintf (sh->output, "\r\n%.64s : too many arguments\r\nusage : %.128s", sh->argv[0], entry->label);
+		return -1;
+	}
+	if ((*schema != 0) && (*schema != '?') && (*schema != '*') && (optional == 0))
 	{
-		// Determine the index of the first space in the command label
-		int j = 0;
-		while (shell_state.shell[k].label[j] != 32) j++; // Note : the index of the first space is also the length of the first word.
+		sprintf (sh->output, "\r\n%.64s : missing argument\r\nusage : %.128s", sh->argv[0], entry->label);
+		return -1;
+	}
+	return 0;
+}
 
-		// Compare the command line's start to the command label in the block entry
-		// if (strncmp(shell_state.input, shell_state.block[k].label, strlen(shell_state.block[k].label)) == 0)
-		if (strncmp(shell_state.input, shell_state.shell[k].label, j) == 0)
-		{
-			// Found a match ! It's a command, as there are no sub-blocks here
-			shell_fp = shell_state.shell[k].fp;
-			shell_state.command_fp = shell_fp;	// Necessary for now, try to optimize-out in the future
-			return;	// job done
-		}
+// Put the words of the command line back together, from argv[first] : for commands that take another command line as
+// their argument. Words that contain spaces were quoted, they're quoted again.
+void shell_join (t_shell_state *sh, int first, char *buff, int size)
+{
+	int len = 0;
+
+	buff[0] = 0;
+	for (int n = first; (n < sh->argc) && (len < size - 1); n++)
+	{
+		char *quote = (strchr (sh->argv[n], ' ') != 0) ? "\"" : "";
+		len += snprintf (buff + len, size - len, "%s%s%s%s", (n > first) ? " " : "", quote, sh->argv[n], quote);
 	}
+}
+
+// ======= Reception =======
+
+// Commands that receive raw data (i.e. file transfers) read the reception ring directly, instead of going through the
+// idle state and the input buffer : no echo, no line editing, and no 256-byte limit.
 
-	// At the end of the parser, if no match has been found, go back to the prompt :
-	shell_fp = shell_state_output;
+// Number of bytes waiting in the reception ring
+int shell_rx_count (t_shell_state *sh)
+{
+	return __atomic_load_n (&sh->rx_head, __ATOMIC_ACQUIRE) - sh->rx_tail;
 }
 
-///////////////// PORTABILITY LAYER //////////////////////////////////////////////////////////
+// Move up to length bytes from the reception ring to buff (or drop them, if buff is zero). Returns the number of bytes
+// moved, which is less than length if the ring doesn't have that many.
+int shell_rx_read (t_shell_state *sh, char *buff, int length)
+{
+	unsigned int tail = sh->rx_tail;
+	int count = __atomic_load_n (&sh->rx_head, __ATOMIC_ACQUIRE) - tail;
+	if (length > count)
+		length = count;
 
-// Feed each byte received by the UART or VCP to this function
-// Should be called from the UART's "Rx Complete" callback or ISR
-// Definitive version : uses the library's own buffer
-// PROBLEM with the echo being too slow (but only cosmetic : input works fine). Look into it later.
-// Actually this whole process may need some hardening, but it'll work for now.
-void shell_in (char c)
+	if (buff != 0)
+	{
+		// At most two copies : up to the end of the ring, then from its start
+		unsigned int offset = tail & (SHELL_RX_SIZE - 1);
+		int first = (offset + length > SHELL_RX_SIZE) ? SHELL_RX_SIZE - offset : length;
+		memcpy (buff, sh->rx + offset, first);
+		memcpy (buff + first, sh->rx, length - first);
+	}
+	__atomic_store_n (&sh->rx_tail, tail + length, __ATOMIC_RELEASE);
+	return length;
+}
+
+// ======= Transmission =======
+
+// Copy bytes to the ring, as many as it has room for. Returns the number of bytes copied.
+static int shell_tx_copy (t_shell_state *sh, char *buff, int length)
+{
+	int room = SHELL_TX_SIZE - (sh->tx_head - __atomic_load_n (&sh->tx_tail, __ATOMIC_ACQUIRE));
+	if (length > room)
+		length = room;
+
+	unsigned int head = sh->tx_head;
+	for (int i = 0; i < length; i++)
+		sh->tx[head++ & (SHELL_TX_SIZE - 1)] = buff[i];
+	__atomic_store_n (&sh->tx_head, head, __ATOMIC_RELEASE);	// Publish the bytes after they've been written
+	return length;
+}
+
+// Same for the output of a background job : its number is inserted at the start of each line ("[2] "), so that its lines
+// can be told apart from the foreground's. Returns the number of bytes of buff copied.
+static int shell_tx_tagged (t_shell_state *sh, char *buff, int length)
+{
+	char tag[16];
+	int tlen = sprintf (tag, "[%d] ", sh->tag);
+	int done = 0;
+
+	while (done < length)
+	{
+		char *lf = memchr (buff + done, '\n', length - done);
+		if (lf == 0)
+			return done + shell_tx_copy (sh, buff + done, length - done);
+
+		int n = lf - (buff + done) + 1;		// Up to the line feed, included
+		int room = SHELL_TX_SIZE - (sh->tx_head - __atomic_load_n (&sh->tx_tail, __ATOMIC_ACQUIRE));
+		if (room < n + tlen)		// No room for the line feed and the tag : stop before the line feed
+			return done + shell_tx_copy (sh, buff + done, n - 1);
+		done += shell_tx_copy (sh, buff + done, n);
+		shell_tx_copy (sh, tag, tlen);
+	}
+	return done;
+}
+
+// Queue bytes for transmission. Never blocks : returns the number of bytes that fit in the ring, which may be less than
+// length. The bytes will be sent in the next transfer, along with anything else queued in the meantime.
+int shell_tx_write (t_shell_state *sh, char *buff, int length)
 {
-	// Only process bytes if the shell is in the "idle" state (which follows the start of the input process)
-	if (shell_fp == shell_state_idle)
+	if (sh->capture != 0)	// Output is being captured : store what fits, and pretend everything was sent so the writer doesn't wait
 	{
+		int n = sh->capture_size - sh->capture_len;
+		if (n > length)
+			n = length;
+		memcpy (sh->capture + sh->capture_len, buff, n);
+		sh->capture_len += n;
+		sh->capture_lost += length - n;
+		return length;
+	}
+
+	length = (sh->tag != 0) ? shell_tx_tagged (sh, buff, length) : shell_tx_copy (sh, buff, length);
+	shell_tx_flush (sh);
+	return length;
+}
+
+// Number of bytes that can be queued for transmission right now
+int shell_tx_free (t_shell_state *sh)
+{
+	if (sh->capture != 0)
+		return SHELL_TX_SIZE;	// Captured output never waits
+	int room = SHELL_TX_SIZE - (sh->tx_head - __atomic_load_n (&sh->tx_tail, __ATOMIC_ACQUIRE));
+	if (sh->tag != 0)		// Keep room for the tags of a few lines (see shell_tx_tagged)
+		room = (room > 32) ? room - 32 : 0;
+	return room;
+}
 
-		// if the character is a carriage return, echo the whole buffer and reset
-		// (this is only while debugging)
-		if (c == 13)
+// Start a transfer of the pending bytes if the interface isn't busy. A transfer can't wrap around the end of the ring,
+// so when the pending bytes do, the rest goes in the next transfer. Returns the number of bytes not sent yet.
+int shell_tx_flush (t_shell_state *sh)
+{
+	if (sh->busy == 0)
+	{
+		// Ports that clear "busy" themselves instead of calling shell_tx_done : account for the completed transfer here,
+		// and let whatever waits for room know about it
+		if (sh->tx_active != 0)
 		{
-			shell_state.input[shell_state.index++] = 0;		// Add null termination
-			shell_state.index = 0;	// reset index for next time
-			// reception complete : transition to either the parser or the command in progress :
-			shell_fp = (shell_state.command_fp != 0) ? shell_state.command_fp : shell_state_parser;
+			__atomic_store_n (&sh->tx_tail, sh->tx_tail + sh->tx_len, __ATOMIC_RELEASE);
+			sh->tx_len = 0;
+			sh->tx_active = 0;
+			shell_event (sh, SHELL_EVENT_TX);
 		}
-		else
+
+		unsigned int tail = sh->tx_tail;
+		unsigned int pending = __atomic_load_n (&sh->tx_head, __ATOMIC_ACQUIRE) - tail;
+		if (pending != 0)
 		{
-			shell_get_byte (&shell_state.c);	// start receiving the next byte (it's not over until I get a CR)
+			unsigned int offset = tail & (SHELL_TX_SIZE - 1);
+			unsigned int len = (offset + pending > SHELL_TX_SIZE) ? SHELL_TX_SIZE - offset : pending;
+			sh->tx_len = len;
+			sh->tx_active = 1;
+			sh->busy = 1;
+#ifdef SHELL_STATS
+			sh->tx_bytes += len;
+			sh->tx_start = shell_cycles ();
+#endif
+			shell_out (sh, sh->tx + offset, len);
+		}
+	}
+	return sh->tx_head - sh->tx_tail;
+}
 
-			// while (shell_state.busy != 0);	// Don't echo unless the interface is ready (this may be unnecessary here)
-			shell_out (&c, 1);	// echo this new byte. PROBLEM : too slow, on copy-paste to shell, not every character is echoed (but all are received successfully nonetheless)
+// Send a buffer from where it is (i.e. application memory) instead of copying it to the ring. This is only possible when
+// everything queued before has been sent : returns 0 if that's not the case yet (wait for SHELL_EVENT_TX and try again), or
+// length once the transfer has started. The buffer must stay untouched until the transfer completes, and be reachable by
+// the DMA. Bytes queued in the ring in the meantime are sent right after it.
+int shell_tx_direct (t_shell_state *sh, char *buff, int length)
+{
+	if ((shell_tx_flush (sh) != 0) || (sh->busy != 0))
+		return 0;
 
-			if (c != 127)				// not sure why, but PuTTY sends 127 for backspace. Should be 8 (ASCII)
-				shell_state.input[shell_state.index++] = c;	// buffer the incoming byte and increment the buffer index
-			else					// deal with backspace
-			{
-				if (shell_state.index > 0)	// Because you can't backspace before the first character
-					shell_state.index--;		// This effectively erases the last character that was buffered
-			}
+	sh->tx_len = 0;		// Nothing to release from the ring when this transfer completes
+	sh->tx_active = 1;
+	sh->busy = 1;
+#ifdef SHELL_STATS
+	sh->tx_bytes += length;
+	sh->tx_start = shell_cycles ();
+#endif
+	shell_out (sh, buff, length);
+	return length;
+}
+
+// Print a line for a coroutine command (see SHELL_YIELD_PRINT) : if the ring doesn't have room for it, returns -1 and
+// tells shell_poll to wait for a transfer, so the command can yield and try again. Returns 0 once the line is queued.
+int shell_yield_print (t_shell_state *sh, char *s)
+{
+	int len = strlen (s);
+	int room = shell_tx_free (sh);
+	if (len > room)
+	{
+		if (room < SHELL_TX_SIZE)
+		{
+			shell_tx_flush (sh);
+			SHELL_WAIT (SHELL_EVENT_TX)
+			return -1;
 		}
+		shell_print (sh, s);	// Larger than the whole ring : no choice but to wait for it to be sent
+		return 0;
+	}
+	shell_tx_write (sh, s, len);
+	return 0;
+}
+
+// Queue a string for transmission. If the ring is full, this waits for transfers to make room : state machine code should
+// rather check shell_tx_free and wait in a state of its own.
+void shell_print (t_shell_state *sh, char *s)
+{
+	int len = strlen (s);
+	while (len > 0)
+	{
+		int n = shell_tx_write (sh, s, len);
+		s += n;
+		len -= n;
+		if (len != 0)
+			shell_tx_flush (sh);
+	}
+}
+
+///////////////// PORTABILITY LAYER //////////////////////////////////////////////////////////
 
-		if (shell_state.index == SHELL_BUFFER_SIZE)	// Buffer overflow protection
-			shell_state.index--;
+// Feed each byte received by the UART or VCP to this function
+// Should be called from the UART's "Rx Complete" callback or ISR. It only stores the byte : the state machine
+// processes it later (see shell_state_idle). If the ring is full, the byte is dropped and counted.
+void shell_in (t_shell_state *sh, char c)
+{
+#ifdef SHELL_STATS
+	sh->rx_bytes++;
+#endif
+	unsigned int head = sh->rx_head;
+	if (head - __atomic_load_n (&sh->rx_tail, __ATOMIC_ACQUIRE) >= SHELL_RX_SIZE)
+	{
+		sh->rx_overflow++;
+		return;
+	}
+	sh->rx[head & (SHELL_RX_SIZE - 1)] = c;
+	__atomic_store_n (&sh->rx_head, head + 1, __ATOMIC_RELEASE);	// Publish the byte after it's been written
+	shell_event (sh, SHELL_EVENT_RX);
+}
+
+// Same as shell_in, for a whole burst of bytes (i.e. the contents of a DMA buffer). The ring's head is only published once.
+void shell_in_burst (t_shell_state *sh, char *buff, int length)
+{
+	if (length <= 0)
+		return;
+#ifdef SHELL_STATS
+	sh->rx_bytes += length;
+#endif
+	unsigned int head = sh->rx_head;
+	unsigned int space = SHELL_RX_SIZE - (head - __atomic_load_n (&sh->rx_tail, __ATOMIC_ACQUIRE));
+	if ((unsigned int) length > space)
+	{
+		sh->rx_overflow += length - space;
+		length = space;
 	}
+	for (int i = 0; i < length; i++)
+		sh->rx[head++ & (SHELL_RX_SIZE - 1)] = buff[i];
+	__atomic_store_n (&sh->rx_head, head, __ATOMIC_RELEASE);
+	shell_event (sh, SHELL_EVENT_RX);
+}
+
+// Circular DMA reception : call this from the DMA half-transfer and transfer-complete callbacks, and from the UART's
+// idle line callback, with pos being the DMA's current write position within its buffer (on STM32 : size - NDTR).
+// It forwards whatever the DMA wrote since the last call, taking care of the wrap-around.
+void shell_in_dma (t_shell_state *sh, char *buff, int size, int pos)
+{
+	int last = sh->rx_dma;
+	if ((pos == last) || (pos < 0) || (pos > size) || (last >= size))	// Nothing new, or a position that can't be right
+		return;
+	if (pos > last)
+		shell_in_burst (sh, buff + last, pos - last);
+	else
+	{
+		shell_in_burst (sh, buff + last, size - last);
+		shell_in_burst (sh, buff, pos);
+	}
+	sh->rx_dma = (pos == size) ? 0 : pos;
+}
+
+// Call this from the "Tx Complete" callback or ISR of the interface : it releases the bytes that were just sent and
+// immediately starts the next transfer if more bytes have been queued in the meantime.
+void shell_tx_done (t_shell_state *sh)
+{
+#ifdef SHELL_STATS
+	shell_stats_record (&shell_stats_tx, shell_cycles () - sh->tx_start);
+#endif
+	__atomic_store_n (&sh->tx_tail, sh->tx_tail + sh->tx_len, __ATOMIC_RELEASE);
+	sh->tx_len = 0;
+	sh->tx_active = 0;
+	sh->busy = 0;
+	shell_tx_flush (sh);
+	shell_event (sh, SHELL_EVENT_TX);
 }
 
 // This function must be overridden by the application to match the target platform
-__attribute__((weak)) void shell_out (char *buff, int length)
+__attribute__((weak)) void shell_out (t_shell_state *sh, char *buff, int length)
 {
-	// This function must transmit strlen(buff) bytes starting from buff*.
+	// This function must start the transmission of length bytes starting from buff*, i.e. by DMA, and return without
+	// waiting. When the transfer completes, call shell_tx_done (or at least clear sh->busy : shell_poll then accounts for
+	// the transfer and posts SHELL_EVENT_TX, provided the completion wakes the main loop up, as an interrupt does).
+	// The buffer is part of the transmission ring : it stays untouched until the transfer completes.
 }
 
 // This function must be overridden by the application to match the target platform
-// Its purpose is to read the next byte coming from the terminal and store it using the pointer argument
-__attribute__((weak)) void shell_get_byte (char *c)
+// Its purpose is to start reception from the terminal. It's called once, by shell_state_init.
+__attribute__((weak)) void shell_get_byte (t_shell_state *sh, char *c)
+{
+	// This function must start the reception of bytes from the communication interface, and every byte received must be
+	// passed to shell_in (or shell_in_burst / shell_in_dma). Two typical implementations :
+	// - interrupt-based, one byte at a time : request one byte into *c, and in the Rx callback, call shell_in (sh, *c) then
+	//   request the next byte.
+	// - circular DMA with idle line detection : start the DMA here, and call shell_in_dma from the DMA and idle callbacks.
+}
+
+// Override this function to wake up the shell when an event is posted, i.e. give a semaphore or signal the RTOS task that
+// runs shell_poll. It may be called from interrupt context. On bare metal, with a "WFI" main loop, nothing needs doing.
+__attribute__((weak)) void shell_wakeup (t_shell_state *sh)
+{
+
+}
+
+// Override this function to provide a time base for SHELL_SLEEP (i.e. return HAL_GetTick ()). Without it, timers never expire.
+__attribute__((weak)) unsigned long shell_ticks ()
+{
+	return 0;
+}
+
+// Override this function to provide a time source for the statistics (SHELL_STATS) : the finer, the better. On Cortex-M3
+// and above, the DWT cycle counter is ideal (enable it, then return DWT->CYCCNT). Without it, durations are all zero.
+__attribute__((weak)) unsigned long shell_cycles ()
 {
-	// This function must request one byte from the communication interface, i.e. using the target's interrupt-based reception API
+	return 0;
 }
 
 // This function is an error state : if the shell transitions to it, it means the library found
 // itself in an unrecoverable situation. Example : the PFS contains a command with two null pointers,
 // which is illegal. Override this function to implement application-specific handling of shell errors
-__attribute__((weak)) void shell_state_error ()
+__attribute__((weak)) void shell_state_error (t_shell_state *sh)
 {
 
 }
@@ -0,0 +1,359 @@
+/*
+ *  shell_binary.c
+ *
+ *  Binary mode : the same commands as the text shell, driven by framed requests instead of typed lines. Meant for test rigs
+ *  and scripts : no echo, no prompt, no parsing of command words or numbers, and several requests can be in flight.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Protocol :
+// - Sending SHELL_BINARY_ESCAPE (4 bytes by default : 0x00 0x02 'S' 'H') while the shell waits for a command line switches
+//   to binary mode. The shell answers with a single zero byte : anything received before it is text (echo, prompt) and
+//   can be discarded.
+// - Every frame, in both directions, is COBS-encoded and terminated by a zero byte. Empty frames are ignored.
+// - Request (decoded) : sequence number (1 byte), command ID (2 bytes), arguments, CRC (2 bytes).
+// - Response (decoded) : sequence number of the request (1 byte), status (1 byte, SHELL_BINARY_OK...), payload length
+//   (2 bytes), payload, CRC (2 bytes).
+// - Multi-byte fields are little-endian. The CRC is shell_crc16 with an initial value of 0xFFFF, over everything before it.
+// - Command IDs are the position of the block in the dispatch index times 256, plus the position of the entry in the
+//   block (see shell_index_entry). The ID of a block's title entry (position 0), or of a sub-block entry, returns the
+//   description of the block as payload : its title, then for each entry a type byte (0 : command, 1 : sub-block), its ID
+//   (the sub-block's title ID for a sub-block, 0xFFFF if it isn't indexed) and its label. Each string is null-terminated.
+//   Describing blocks 0, 1, 2... until SHELL_BINARY_UNKNOWN lists every command of the application.
+// - Arguments are encoded according to the command's schema : i and x are 4 bytes, f is a 4-byte IEEE float, s and each
+//   string of * are null-terminated, {...} is a single byte (position of the word in the list). Optional arguments are
+//   simply left out. For commands without a schema, the arguments are the text that would follow the command word.
+// - The payload of the response is the command's output, as it would have been printed. SHELL_BINARY_TRUNCATED tells
+//   the output didn't fit in the frame.
+// - Requests are processed in order, one at a time. They wait in the reception ring meanwhile, so a script can send the
+//   next ones without waiting for the responses, as long as the requests in flight fit in SHELL_RX_SIZE bytes.
+// - Request SHELL_BINARY_EXIT switches back to text mode, once its response has been sent.
+// Commands that wait for a line of input (through shell_state_input) can't be used in binary mode.
+
+#include "shell.h"
+
+#include <string.h>
+
+#if (SHELL_FRAME_SIZE < 8) || (SHELL_FRAME_SIZE + SHELL_FRAME_SIZE / 254 + 2 > SHELL_TX_SIZE)
+#error "SHELL_FRAME_SIZE must be at least 8, and an encoded frame must fit in the transmission ring (SHELL_TX_SIZE)"
+#endif
+
+#define SHELL_BINARY_HEADER		4		// Response header : sequence number, status, payload length
+
+// CRC-16-CCITT, four bits at a time : a 32-byte table, and two lookups per byte, so bulk transfers can keep up with the
+// link. Pass the initial value as crc (0xFFFF for binary mode, 0 for transfers), or the CRC of the previous bytes to
+// continue a computation.
+static const unsigned short shell_crc16_table[16] =
+{
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+unsigned short shell_crc16 (unsigned short crc, char *buff, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		unsigned char b = buff[i];
+		crc = (crc << 4) ^ shell_crc16_table[(crc >> 12) ^ (b >> 4)];
+		crc = (crc << 4) ^ shell_crc16_table[(crc >> 12) ^ (b & 0x0F)];
+	}
+	return crc;
+}
+
+// Decode a COBS frame (delimiter excluded) in place : the decoded frame is never longer than the encoded one.
+// Returns the decoded length, or -1 if the frame is malformed.
+static int shell_cobs_decode (char *buff, int length)
+{
+	int in = 0, out = 0;
+	while (in < length)
+	{
+		int code = (unsigned char) buff[in++];
+		if ((code == 0) || (in + code - 1 > length))
+			return -1;
+		for (int i = 1; i < code; i++)
+			buff[out++] = buff[in++];
+		if ((code < 0xFF) && (in < length))
+			buff[out++] = 0;	// Each block, except the last one and the full ones, stands for a zero byte
+	}
+	return out;
+}
+
+// COBS-encode a frame straight into the transmission ring, followed by its delimiter. The caller must make sure there's
+// room for it : length + length / 254 + 2 bytes.
+static void shell_cobs_write (t_shell_state *sh, char *buff, int length)
+{
+	int start = 0;
+	while (1)
+	{
+		int run = 0;		// Number of non-zero bytes from start
+		while ((start + run < length) && (buff[start + run] != 0) && (run < 254))
+			run++;
+		char code = run + 1;
+		shell_tx_write (sh, &code, 1);
+		shell_tx_write (sh, buff + start, run);
+		start += run;
+		if (start == length)
+			break;
+		if (run < 254)
+			start++;		// Skip the zero byte the code stands for
+	}
+	shell_tx_write (sh, "", 1);		// Delimiter
+}
+
+static unsigned short shell_binary_u16 (char *p)
+{
+	return (unsigned char) p[0] | (unsigned char) p[1] << 8;
+}
+
+static unsigned long shell_binary_u32 (char *p)
+{
+	return (unsigned long) (unsigned char) p[0] | (unsigned long) (unsigned char) p[1] << 8 |
+		(unsigned long) (unsigned char) p[2] << 16 | (unsigned long) (unsigned char) p[3] << 24;
+}
+
+// Decode the arguments of a request into sh->argc, sh->argv and sh->arg, like shell_arguments does for a command line.
+// The strings stay in the frame buffer, which isn't touched until the command is over. Numbers have no text form :
+// their argv is an empty string. Returns -1 if the arguments don't match the entry's schema.
+static int shell_binary_arguments (t_shell_state *sh, const t_shell_block_entry *entry, char *data, int length)
+{
+	char *end = data + length;
+
+	// argv[0] is the command word, which commands may print (i.e. in their error messages)
+	int wlen = strcspn (entry->label, " ");
+	if (wlen > SHELL_BUFFER_SIZE - 1)
+		wlen = SHELL_BUFFER_SIZE - 1;
+	memcpy (sh->input, entry->label, wlen);
+	sh->input[wlen] = 0;
+	sh->argv[0] = sh->input;
+	sh->argc = 1;
+
+	if (entry->args == 0)	// The command parses the input buffer itself : rebuild the command line
+	{
+		sh->argc = 0;
+		if (length == 0)
+			return 0;
+		if (wlen + 1 + length > SHELL_BUFFER_SIZE - 1)
+			return -1;
+		sh->input[wlen] = ' ';
+		memcpy (sh->input + wlen + 1, data, length);
+		sh->input[wlen + 1 + length] = 0;
+		return 0;
+	}
+
+	char *schema = entry->args;
+	int optional = 0;
+	while ((*schema != 0) && (data < end))
+	{
+		if (*schema == '?')
+		{
+			optional = 1;
+			schema++;
+			continue;
+		}
+		if (sh->argc == SHELL_MAX_ARGS)
+			return -1;
+
+		t_shell_arg *arg = &sh->arg[sh->argc];
+		sh->argv[sh->argc] = "";
+		switch (*schema)
+		{
+			case 's':
+			case '*':		// Any number of strings : the schema stays on '*'
+			{
+				char *zero = memchr (data, 0, end - data);
+				if (zero == 0)
+					return -1;
+				sh->argv[sh->argc] = arg->s = data;
+				data = zero + 1;
+				if (*schema == 's')
+					schema++;
+				break;
+			}
+			case 'i':
+			case 'x':
+			case 'f':
+			{
+				if (end - data < 4)
+					return -1;
+				unsigned long u = shell_binary_u32 (data);
+				if (*schema == 'i')
+					arg->i = (long) (int) u;	// Sign extension
+				else if (*schema == 'x')
+					arg->x = u;
+				else
+				{
+					unsigned int w = u;
+					memcpy (&arg->f, &w, sizeof (arg->f));
+				}
+				data += 4;
+				schema++;
+				break;
+			}
+			case '{':
+			{
+				int words = 1;
+				while ((*schema != '}') && (*schema != 0))
+					if (*schema++ == '|')
+						words++;
+				if (*schema == '}')
+					schema++;
+				arg->e = (unsigned char) *data++;
+				if (arg->e >= words)
+					return -1;
+				break;
+			}
+			default:
+				return -1;
+		}
+		sh->argc++;
+	}
+
+	if (data != end)		// Too many arguments
+		return -1;
+	if ((*schema != 0) && (*schema != '?') && (*schema != '*') && (optional == 0))
+		return -1;			// Missing arguments
+	return 0;
+}
+
+// Write the description of a block to the capture buffer (see the protocol above). Returns -1 if the block has no ID.
+static int shell_binary_describe (t_shell_state *sh, const t_shell_block_entry *block)
+{
+	int number = shell_index_number (block);
+	if (number < 0)
+		return -1;
+	shell_tx_write (sh, block[0].label, strlen (block[0].label) + 1);
+	for (int k = 1; k <= BLOCK_COUNT (block); k++)
+	{
+		char record[3];
+		int id;
+		if (block[k].fp != 0)
+		{
+			record[0] = 0;
+			id = (number << 8) | k;
+		}
+		else
+		{
+			record[0] = 1;
+			id = shell_index_number (block[k].cb);
+			id = (id < 0) ? 0xFFFF : id << 8;
+		}
+		record[1] = id;
+		record[2] = id >> 8;
+		shell_tx_write (sh, record, 3);
+		shell_tx_write (sh, block[k].label, strlen (block[k].label) + 1);
+	}
+	return 0;
+}
+
+// Handle a complete frame : check it, then either run the command or go straight to the response
+static void shell_binary_request (t_shell_state *sh)
+{
+	int len = (sh->frame_len < 0) ? -1 : shell_cobs_decode (sh->frame, sh->frame_len);
+	char *frame = sh->frame;
+
+	// From now on, output goes to the payload of the response
+	sh->capture = sh->reply + SHELL_BINARY_HEADER;
+	sh->capture_size = SHELL_FRAME_SIZE - SHELL_BINARY_HEADER - 2;
+	sh->capture_len = sh->capture_lost = 0;
+	sh->reply[0] = (len > 0) ? frame[0] : 0;
+	sh->reply[1] = SHELL_BINARY_OK;
+	sh->fp = shell_state_binary_reply;
+
+	if ((len < 5) || (shell_crc16 (0xFFFF, frame, len - 2) != shell_binary_u16 (frame + len - 2)))
+	{
+		sh->reply[1] = SHELL_BINARY_CRC;
+		return;
+	}
+
+	int id = shell_binary_u16 (frame + 1);
+	const t_shell_block_entry *entry = shell_index_entry (id);
+	if (id == SHELL_BINARY_EXIT)
+		sh->binary = 0;		// Back to text mode once the response is out
+	else if (entry == 0)
+		sh->reply[1] = SHELL_BINARY_UNKNOWN;
+	else if ((id & 0xFF) == 0)
+		shell_binary_describe (sh, entry);
+	else if ((entry->fp == 0) && (entry->cb == 0))
+		sh->reply[1] = SHELL_BINARY_UNKNOWN;
+	else if (entry->fp == 0)
+	{
+		if (shell_binary_describe (sh, entry->cb) != 0)
+			sh->reply[1] = SHELL_BINARY_UNKNOWN;
+	}
+	else if (shell_binary_arguments (sh, entry, frame + 3, len - 5) != 0)
+		sh->reply[1] = SHELL_BINARY_ARGS;
+	else
+	{
+		// Start the command as the parser would. When it ends, the output state sends the response.
+		shell_command_start (sh, entry->fp);
+	}
+}
+
+// Accumulate the bytes of a frame from the reception ring, up to its delimiter, then handle the request.
+// There's no echo : nothing limits how many bytes are consumed at once.
+void shell_state_binary (t_shell_state *sh)
+{
+	shell_tx_flush (sh);
+
+	int complete = 0;
+	unsigned int tail = sh->rx_tail;
+	unsigned int head = __atomic_load_n (&sh->rx_head, __ATOMIC_ACQUIRE);
+	while ((tail != head) && (complete == 0))
+	{
+		char c = sh->rx[tail++ & (SHELL_RX_SIZE - 1)];
+		if (c == 0)
+			complete = 1;
+		else if ((sh->frame_len >= 0) && (sh->frame_len < SHELL_FRAME_SIZE))
+			sh->frame[sh->frame_len++] = c;
+		else
+			sh->frame_len = -1;		// Too large : skip the rest of it, and report it when its delimiter arrives
+	}
+	__atomic_store_n (&sh->rx_tail, tail, __ATOMIC_RELEASE);
+
+	if (complete == 0)
+		SHELL_WAIT (SHELL_EVENT_RX)
+	else if (sh->frame_len != 0)	// Empty frames can be used to resynchronize : ignore them
+		shell_binary_request (sh);
+}
+
+// Complete the response (header and CRC) and queue it for transmission, once there's room for it
+void shell_state_binary_reply (t_shell_state *sh)
+{
+	if (sh->capture != 0)
+	{
+		int len = sh->capture_len;
+		sh->capture = 0;
+		if ((sh->capture_lost != 0) && (sh->reply[1] == SHELL_BINARY_OK))
+			sh->reply[1] = SHELL_BINARY_TRUNCATED;
+		sh->reply[2] = len;
+		sh->reply[3] = len >> 8;
+		len += SHELL_BINARY_HEADER;
+		unsigned short crc = shell_crc16 (0xFFFF, sh->reply, len);
+		sh->reply[len++] = crc;
+		sh->reply[len++] = crc >> 8;
+		sh->reply_len = len;
+	}
+
+	if (shell_tx_free (sh) < sh->reply_len + sh->reply_len / 254 + 2)
+	{
+		shell_tx_flush (sh);
+		SHELL_WAIT (SHELL_EVENT_TX)
+		return;
+	}
+	shell_cobs_write (sh, sh->reply, sh->reply_len);
+
+	sh->frame_len = 0;
+	sh->fp = (sh->binary != 0) ? shell_state_binary : shell_state_output;	// Next request, or the prompt
+}
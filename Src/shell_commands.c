@@ -27,94 +27,188 @@
 #include <stdio.h>
 
 
-
 // ========= Command Functions ==============================================================
 
 // Navigate to the current block's parent block ("cd..")
-void command_native_cddoubledot ()
+void command_native_cddoubledot (t_shell_state *sh)
 {
-	// If the current block is the root block, do nothing ! Otherwise, perform "cd.."
-	// if (shell_state.block != shell_state.root)
-	if (shell_state.block[0].cb != 0)	// Another way to check it. Root block will not have a pointer to a child block.
-	{
-		// Truncate the path string
-		int i = strlen (shell_state.path);
-		while (i--)	// move back towards the start of the path string
-			if (shell_state.path[i] == '/')	// find the last slash...
-			{
-				shell_state.path[i++] = '>';	// ... and terminate the string there
-				shell_state.path[i] = 0;
-				break;
-			}
-		// Update the current block pointer
-		shell_state.block = shell_state.block[0].cb;	// "cb" of title entry is parent block pointer
-	}
+	// If the current block is the root block, this does nothing
+	shell_pop_block (sh);
 
 	// In all cases, transition to the prompt
 	COMMAND_END
 }
 
-// List the contents of the current block ("ls")
-void command_native_list ()
+// Navigate along a path ("cd"), i.e. "cd motor/pid", "cd ../sensors", "cd /". Without argument, go back to the root.
+void command_native_cd (t_shell_state *sh)
+{
+	int result = shell_change_path (sh, (sh->argc > 1) ? sh->argv[1] : "/");
+	if (result != 0)
+	{
+		sprintf (sh->output, "\r\n%.64s : %s", sh->argv[1], (result == SHELL_PATH_TOO_DEEP) ? "path too deep" : "no such block");
+		COMMAND_FAIL
+		return;
+	}
+	COMMAND_END
+}
+
+// List the contents of the current block ("ls"), one line per step
+typedef struct
+{
+	int k;			// Entry being listed
+} t_list_context;
+
+void command_native_list (t_shell_state *sh)
 {
-	static int state = 0;
-	static int idx = 0;
-	char tag;		// Command entries get a "C" on their line, sub-blocks have a ">"
+	t_list_context *ctx = SHELL_CONTEXT (t_list_context);
 
-	switch (state)
+	SHELL_BEGIN
+	SHELL_YIELD_PRINTF ("\r\n == %s ==", sh->block[0].label);
+	for (ctx->k = 1; ctx->k <= BLOCK_COUNT (sh->block); ctx->k++)	// Command entries get a "C" on their line, sub-blocks have a ">"
+		SHELL_YIELD_PRINTF ("\r\n %c %s", (sh->block[ctx->k].fp != 0) ? 'C' : '>', sh->block[ctx->k].label);
+	SHELL_END
+}
+
+// Show or change the log level ("log")
+void command_native_log (t_shell_state *sh)
+{
+	static char *levels[] = { "error", "warning", "info", "debug" };
+
+	if (sh->argc > 1)
+		shell_log_level = sh->arg[1].e;		// The argument schema lists the levels in the same order
+	sprintf (sh->output, "\r\nlog level : %s, %lu messages dropped", levels[shell_log_level & 3], shell_log_dropped);
+	COMMAND_LAST_LINE
+}
+
+#ifdef SHELL_STATS
+// Print one row of the statistics to the output buffer
+static void command_native_stats_row (t_shell_state *sh, char *name, int length, t_shell_stats_row *row)
+{
+	int len = snprintf (sh->output, SHELL_BUFFER_SIZE, "\r\n %-10.*s %8lu %8lu %8lu %8lu ", length, name, row->runs, row->steps,
+		(row->steps != 0) ? (unsigned long) (row->cycles / row->steps) : 0, row->max);
+	for (int b = 0; (b < SHELL_STATS_BUCKETS) && (len < SHELL_BUFFER_SIZE); b++)
+		if (row->hist[b] != 0)
+			len += snprintf (sh->output + len, SHELL_BUFFER_SIZE - len, " %d:%lu", b, row->hist[b]);
+}
+
+// Show or clear the statistics ("stats"). The first line is the traffic of this instance, then there's a line for each
+// state and command that ran : number of runs (commands only), steps, average and longest step in shell_cycles units,
+// and the histogram of the steps' durations : "n:count" means count steps took less than 2^n cycles.
+void command_native_stats (t_shell_state *sh)
+{
+	int idx = sh->command_index;
+
+	if (sh->argc > 1)		// "stats reset"
 	{
-		case 0:		// wait for communication interface to be ready
-			if (shell_state.busy == 0) state = 1;
-			break;
-		case 1:		// print the title of the current block
-			// Print straight to the output buffer
-			sprintf (shell_state.output, "\r\n == %s ==", shell_state.block[idx++].label);
-			shell_fp = shell_state_output;	// transition to output state
-			state = 2;	// transition to local state 2.
-			break;
-		case 2:		// wait for communication interface to be ready
-			if (shell_state.busy == 0) state = 3;
-			break;
-		case 3:		// print a block entry
-			tag = (shell_state.block[idx].fp != 0) ? 'C' : '>';			// Start by determining the tag
-			sprintf (shell_state.output, "\r\n %c %s", tag, shell_state.block[idx++].label);
-			shell_fp = shell_state_output;	// transition to output state
-			// The local state transition depends on the value of idx
-			if (idx > (int) shell_state.block[0].fp)	// check against number of commands in the block
-				state = 4;	// End of block reached, command will complete on next call
-			else
-				state = 2;	// Loop to wait for DMA completion and transfer next entry
+		shell_stats_reset (sh);
+		sprintf (sh->output, "\r\nstatistics cleared");
+		COMMAND_LAST_LINE
+		return;
+	}
+
+	switch (sh->command_state)
+	{
+		case 0:		// Traffic
+			sprintf (sh->output, "\r\nrx %lu bytes, %u dropped - tx %lu bytes - log %lu dropped - %lu steps untracked",
+				sh->rx_bytes, sh->rx_overflow, sh->tx_bytes, shell_log_dropped, shell_stats_untracked);
+			sh->command_state = 1;
 			break;
-		case 4:	// end of command
-			COMMAND_END
-			state = idx = 0;		// reset this command's state before leaving
+		case 1:		// Column titles
+			sprintf (sh->output, "\r\n %-10s %8s %8s %8s %8s  histogram", "", "runs", "steps", "avg", "max");
+			sh->command_state = 2;
+			idx = 0;
 			break;
+		case 2:		// One row per call, until the first free row
+			if ((idx < SHELL_STATS_ROWS) && (shell_stats_table[idx].fp != 0))
+			{
+				int length;
+				char *name = shell_stats_name (shell_stats_table[idx].fp, &length);
+				command_native_stats_row (sh, name, length, &shell_stats_table[idx++]);
+				break;
+			}
+			command_native_stats_row (sh, "(transfer)", 10, &shell_stats_tx);	// Then the transfers, to finish
+			COMMAND_LAST_LINE
+			sh->command_index = idx;
+			return;
 	}
 
+	sh->fp = shell_state_output;
+	sh->command_index = idx;
 }
+#endif
 
-
-t_shell_block_entry shell_block[] =
+// Ends a command after its last line has been printed
+void command_native_end (t_shell_state *sh)
 {
-		{ "", BLOCK_LEN 2, 0 },			// Title shouldn't be necessary, removing it to save space.
-		{ "cd..", command_native_cddoubledot, 0},		// navigate towards the root
-		{ "ls", command_native_list, 0}			// list commands in the current block
-};
+	COMMAND_END
+}
+
+
+// The statistics command is optional : a macro, since there can't be an #ifdef in SHELL_BLOCK's arguments
+#ifdef SHELL_STATS
+#define SHELL_NATIVE_STATS SHELL_CMD ("stats [reset]", command_native_stats, "?{reset}")	// show or clear the statistics
+#else
+#define SHELL_NATIVE_STATS
+#endif
+
+// No title : the native commands are listed along with the current block's
+SHELL_BLOCK (shell_block, "",
+		SHELL_CMD ("cd..", command_native_cddoubledot),		// navigate towards the root
+		SHELL_CMD ("cd [path]", command_native_cd, "?s"),	// navigate along a path
+		SHELL_CMD ("ls", command_native_list),			// list commands in the current block
+		SHELL_CMD ("log [error|warning|info|debug]", command_native_log, "?{error|warning|info|debug}"),	// show or set the log level
+		SHELL_CMD ("download <region> [offset] [length]", command_native_download, "s?ii"),	// send a memory region
+		SHELL_CMD ("upload <region> [offset] [length]", command_native_upload, "s?ii"),		// receive into a memory region
+		SHELL_CMD ("jobs", command_native_jobs),			// list the background jobs
+		SHELL_CMD ("fg [job]", command_native_fg, "?i"),	// bring a job to the foreground
+		SHELL_CMD ("kill [job]", command_native_kill, "?i"),	// stop a job
+		SHELL_CMD ("watch <period> <command>", command_native_watch, "is*"),	// run a command periodically, showing what changes
+		SHELL_CMD ("get <variable>", command_native_get, "s"),			// print a variable
+		SHELL_CMD ("set <variable> <value>", command_native_set, "ss"),	// change a variable
+		SHELL_CMD ("trace [select|trigger|arm|stop|show] ...", command_native_trace, "?{select|trigger|arm|stop|show}*"),	// capture variables
+		SHELL_CMD ("run <macro> [stop|continue]", command_native_run, "s?{stop|continue}"),	// run a macro
+		SHELL_CMD ("macro [name] [commands]", command_native_macro, "?s*"),	// list, define or delete macros
+		SHELL_NATIVE_STATS);
 
 // Also declaring an empty system block to allow for compilation and operation even if the user doesn't declare their own
 #ifndef SHELL_SYSTEM_BLOCK
-t_shell_block_entry system_block[] =
+const t_shell_block_entry system_block[] =
 {
-		{ "", BLOCK_LEN 0, 0 }			// Zero length : the parser will skip this block
+		{ "", BLOCK_LEN 0, 0, 0 }		// Zero length : the parser will skip this block
 };
 #endif
 
 // Same for the application-specific command block
 #ifndef SHELL_ROOT_BLOCK
-t_shell_block_entry root_block[] =
+const t_shell_block_entry root_block[] =
 {
-		{"STM32", BLOCK_LEN 0, 0}	// Title block. Root, so no parent block. No function. Function pointer replaced by command count in the block
+		{"STM32", BLOCK_LEN 0, 0, 0}	// Title block. No function. Function pointer replaced by command count in the block
 };
 #endif
 
+// And for the memory regions of the transfer commands
+#ifndef SHELL_REGIONS
+const t_shell_region shell_regions[] =
+{
+		{ 0 }		// No regions : "download" and "upload" will report "no such region"
+};
+#endif
 
+// And for the macros, and the boot script
+#ifndef SHELL_MACROS
+const t_shell_macro shell_macros[] =
+{
+		{ 0 }		// No macros in flash : "run" only knows those defined with "macro"
+};
+#endif
+#ifndef SHELL_BOOT_SCRIPT
+const t_shell_macro shell_boot = { "boot", 0, SHELL_SCRIPT_STOP };	// No boot script
+#endif
+
+// And for the variables
+#ifndef SHELL_VARS
+const t_shell_var shell_vars[] =
+{
+		{ 0 }		// No variables : "get", "set" and "trace" will report "no such variable"
+};
+#endif
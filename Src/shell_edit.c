@@ -0,0 +1,434 @@
+/*
+ *  shell_edit.c
+ *
+ *  Line editing : cursor movements, insertion and deletion anywhere in the line, a history of the lines typed at the
+ *  prompt, and completion of command words. Everything happens on the target : the terminal only receives the few bytes
+ *  that update its display, and recalled lines don't travel over the link again.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// The idle state echoes plain typing at the end of the line itself, in batches. Every other byte comes here, from the
+// main loop as well, only when the transmission ring has room for SHELL_EDIT_ROOM bytes : enough to rewrite the line.
+// Keys :
+//   Left / Right, Home / End (or Ctrl-A / Ctrl-E)    move the cursor
+//   Backspace, Delete                                 erase a character
+//   Ctrl-K / Ctrl-U                                   erase the end of the line / the whole line
+//   Up / Down (or Ctrl-P / Ctrl-N)                    recall the previous / next line of the history
+//   Ctrl-R                                            recall the previous line containing the text typed so far. Again
+//                                                     for the one before, and so on. Any other key ends the search.
+//   Tab                                               complete the command word
+// The arrows and Home / End are decoded from VT100 / xterm escape sequences (ESC [ x, ESC O x, ESC [ n ~).
+
+#include "shell.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#if (SHELL_HISTORY_SIZE < SHELL_BUFFER_SIZE) || (SHELL_HISTORY_SIZE & (SHELL_HISTORY_SIZE - 1))
+#error "SHELL_HISTORY_SIZE must be a power of two, at least SHELL_BUFFER_SIZE"
+#endif
+
+// Progress in an escape sequence (sh->escape)
+#define SHELL_ESCAPE_NONE		0
+#define SHELL_ESCAPE_START		1		// ESC received
+#define SHELL_ESCAPE_CSI		2		// ESC [ : a numeric parameter may follow, then a final byte
+#define SHELL_ESCAPE_SS3		3		// ESC O : a final byte follows
+
+// Keys decoded from escape sequences. Other keys are their byte.
+#define SHELL_KEY_UP			0x100
+#define SHELL_KEY_DOWN			0x101
+#define SHELL_KEY_RIGHT			0x102
+#define SHELL_KEY_LEFT			0x103
+#define SHELL_KEY_HOME			0x104
+#define SHELL_KEY_END			0x105
+#define SHELL_KEY_DELETE		0x106
+
+// Maximum number of bytes of a completion list
+#define SHELL_EDIT_LIST			(SHELL_BUFFER_SIZE - 8)
+
+// ======= Terminal updates =======
+
+// Move the terminal's cursor between two positions of the line. A few characters are cheaper to go over (backspaces to
+// the left, the characters themselves to the right) than an escape sequence.
+void shell_edit_move (t_shell_state *sh, int from, int to)
+{
+	char seq[16];
+	int distance = (to > from) ? to - from : from - to;
+
+	if (distance == 0)
+		return;
+	if (distance > 4)
+		shell_tx_write (sh, seq, sprintf (seq, "\x1b[%d%c", distance, (to > from) ? 'C' : 'D'));
+	else if (to > from)
+		shell_tx_write (sh, sh->input + from, distance);
+	else
+		shell_tx_write (sh, "\b\b\b\b", distance);
+}
+
+// Insert characters at the cursor : the end of the line is printed again, shifted, then the cursor goes back
+static void shell_edit_insert (t_shell_state *sh, const char *s, int length)
+{
+	if (sh->index + length > SHELL_BUFFER_SIZE - 1)		// Keep room for the null terminator
+	{
+		shell_tx_write (sh, "\a", 1);
+		return;
+	}
+	memmove (sh->input + sh->cursor + length, sh->input + sh->cursor, sh->index - sh->cursor);
+	memcpy (sh->input + sh->cursor, s, length);
+	sh->index += length;
+	shell_tx_write (sh, sh->input + sh->cursor, sh->index - sh->cursor);
+	sh->cursor += length;
+	shell_edit_move (sh, sh->index, sh->cursor);
+}
+
+// Erase the character under the cursor : the end of the line is printed again, one column to the left, over a space
+static void shell_edit_delete (t_shell_state *sh)
+{
+	if (sh->cursor == sh->index)
+		return;
+	memmove (sh->input + sh->cursor, sh->input + sh->cursor + 1, sh->index - sh->cursor - 1);
+	sh->index--;
+	shell_tx_write (sh, sh->input + sh->cursor, sh->index - sh->cursor);
+	shell_tx_write (sh, " ", 1);
+	shell_edit_move (sh, sh->index + 1, sh->cursor);
+}
+
+// Replace the whole line (i.e. with a line of the history). Only the part that differs from the current line is sent.
+static void shell_edit_replace (t_shell_state *sh, const char *line, int length)
+{
+	int same = 0;
+	while ((same < length) && (same < sh->index) && (sh->input[same] == line[same]))
+		same++;
+
+	shell_edit_move (sh, sh->cursor, same);
+	memcpy (sh->input + same, line + same, length - same);
+	shell_tx_write (sh, sh->input + same, length - same);
+	if (length < sh->index)
+		shell_tx_write (sh, "\x1b[K", 3);	// Erase what's left of the longer line
+	sh->index = sh->cursor = length;
+}
+
+// ======= History =======
+
+// The history is a ring of bytes : each line is followed by a null character, so short lines take little room. The
+// oldest lines are dropped to make room for new ones. Positions are free-running indexes, like the other rings'.
+
+static char shell_history_at (t_shell_state *sh, unsigned int pos)
+{
+	return sh->history[pos & (SHELL_HISTORY_SIZE - 1)];
+}
+
+// Start of the line before the one at pos (which must not be the oldest)
+static unsigned int shell_history_prev (t_shell_state *sh, unsigned int pos)
+{
+	pos--;		// Null character of the previous line
+	while ((pos != sh->history_tail) && (shell_history_at (sh, pos - 1) != 0))
+		pos--;
+	return pos;
+}
+
+// Start of the line after the one at pos (which must not be history_head)
+static unsigned int shell_history_next (t_shell_state *sh, unsigned int pos)
+{
+	while (shell_history_at (sh, pos++) != 0)
+		;
+	return pos;
+}
+
+// Copy the line at pos to a buffer of SHELL_BUFFER_SIZE bytes. Returns its length.
+static int shell_history_get (t_shell_state *sh, unsigned int pos, char *line)
+{
+	int length = 0;
+	while ((line[length] = shell_history_at (sh, pos + length)) != 0)
+		length++;
+	return length;
+}
+
+// Store a line typed at the prompt. A line that's already in the history is moved to the most recent place instead of
+// being stored twice : the lines after it move down. Only called when a line is complete, not for each key.
+void shell_history_add (t_shell_state *sh, const char *line)
+{
+	int length = strlen (line);
+	if ((length == 0) || (length >= SHELL_BUFFER_SIZE))
+		return;
+
+	char entry[SHELL_BUFFER_SIZE];
+	for (unsigned int pos = sh->history_tail; pos != sh->history_head; pos = shell_history_next (sh, pos))
+		if ((shell_history_get (sh, pos, entry) == length) && (memcmp (entry, line, length) == 0))
+		{
+			for (unsigned int i = pos; i + length + 1 != sh->history_head; i++)
+				sh->history[i & (SHELL_HISTORY_SIZE - 1)] = shell_history_at (sh, i + length + 1);
+			sh->history_head -= length + 1;
+			break;
+		}
+
+	while (SHELL_HISTORY_SIZE - (sh->history_head - sh->history_tail) < (unsigned int) length + 1)
+		sh->history_tail = shell_history_next (sh, sh->history_tail);	// Drop the oldest line
+	for (int i = 0; i <= length; i++)
+		sh->history[sh->history_head++ & (SHELL_HISTORY_SIZE - 1)] = line[i];
+	sh->history_pos = sh->history_head;
+}
+
+// Recall the previous (direction < 0) or next line of the history
+static void shell_history_recall (t_shell_state *sh, int direction)
+{
+	char line[SHELL_BUFFER_SIZE];
+	unsigned int pos = sh->history_pos;
+
+	if (pos == ((direction < 0) ? sh->history_tail : sh->history_head))
+	{
+		shell_tx_write (sh, "\a", 1);
+		return;
+	}
+	pos = (direction < 0) ? shell_history_prev (sh, pos) : shell_history_next (sh, pos);
+	shell_edit_replace (sh, line, (pos == sh->history_head) ? 0 : shell_history_get (sh, pos, line));	// After the most recent line : an empty one
+	sh->history_pos = pos;
+}
+
+// Recall the previous line that contains the search pattern. The pattern is the line typed before the first Ctrl-R.
+static void shell_history_search (t_shell_state *sh)
+{
+	char line[SHELL_BUFFER_SIZE];
+
+	if (sh->search < 0)
+	{
+		sh->search = (sh->index < SHELL_SEARCH_SIZE) ? sh->index : SHELL_SEARCH_SIZE;
+		memcpy (sh->pattern, sh->input, sh->search);
+	}
+
+	for (unsigned int pos = sh->history_pos; pos != sh->history_tail; )
+	{
+		pos = shell_history_prev (sh, pos);
+		int length = shell_history_get (sh, pos, line);
+		for (int i = 0; i + sh->search <= length; i++)
+			if (memcmp (line + i, sh->pattern, sh->search) == 0)
+			{
+				shell_edit_replace (sh, line, length);
+				sh->history_pos = pos;
+				return;
+			}
+	}
+	shell_tx_write (sh, "\a", 1);
+}
+
+// ======= Completion =======
+
+// Find the next command word of the current, system and shell blocks that starts with the line typed so far, from
+// position *n (block number * 65536 + entry number). Returns the label, and the length of the word, or zero if there's none.
+static const char *shell_edit_candidate (t_shell_state *sh, int *n, int *length)
+{
+	const t_shell_block_entry *blocks[] = { sh->block, sh->system, sh->shell };
+
+	for ( ; (*n >> 16) < 3; *n = ((*n >> 16) + 1) << 16)
+	{
+		const t_shell_block_entry *block = blocks[*n >> 16];
+		if (block == 0)
+			continue;
+		while ((*n & 0xFFFF) < BLOCK_COUNT (block))
+		{
+			const char *label = block[++*n & 0xFFFF].label;
+			*length = strcspn (label, " ");
+			if ((*length >= sh->index) && (strncmp (label, sh->input, sh->index) == 0))
+				return label;
+		}
+	}
+	return 0;
+}
+
+// Complete the command word : the whole word if a single command matches, else as many characters as the matching
+// commands have in common. If that's none, list them, and let the idle state print the prompt and the line again.
+static void shell_edit_complete (t_shell_state *sh)
+{
+	if ((sh->command_fp != 0) || (sh->cursor != sh->index) || (memchr (sh->input, ' ', sh->index) != 0))
+	{
+		shell_tx_write (sh, "\a", 1);	// Only the command word, at the prompt
+		return;
+	}
+
+	int n = 0, length, first_length = 0, common = 0, others = 0;
+	const char *label, *first = shell_edit_candidate (sh, &n, &first_length);
+	if (first == 0)
+	{
+		shell_tx_write (sh, "\a", 1);
+		return;
+	}
+	common = first_length;
+	while ((label = shell_edit_candidate (sh, &n, &length)) != 0)
+	{
+		if ((length == first_length) && (strncmp (label, first, length) == 0))
+			continue;		// Same word in another block
+		others++;
+		int i = sh->index;
+		while ((i < common) && (i < length) && (label[i] == first[i]))
+			i++;
+		common = i;
+	}
+
+	if (others == 0)
+	{
+		shell_edit_insert (sh, first + sh->index, first_length - sh->index);
+		shell_edit_insert (sh, " ", 1);
+	}
+	else if (common > sh->index)
+		shell_edit_insert (sh, first + sh->index, common - sh->index);
+	else
+	{
+		int total = 0;
+		n = 0;
+		while ((label = shell_edit_candidate (sh, &n, &length)) != 0)
+		{
+			if (total + length + 2 > SHELL_EDIT_LIST)
+			{
+				shell_tx_write (sh, "  ...", 5);
+				break;
+			}
+			shell_tx_write (sh, total ? "  " : "\r\n", 2);
+			shell_tx_write (sh, (char *) label, length);
+			total += length + 2;
+		}
+		sh->redraw = 1;
+	}
+}
+
+// ======= Keys =======
+
+static int shell_edit_decode (char c, int param)
+{
+	switch (c)
+	{
+	case 'A': return SHELL_KEY_UP;
+	case 'B': return SHELL_KEY_DOWN;
+	case 'C': return SHELL_KEY_RIGHT;
+	case 'D': return SHELL_KEY_LEFT;
+	case 'H': return SHELL_KEY_HOME;
+	case 'F': return SHELL_KEY_END;
+	case '~':
+		if ((param == 1) || (param == 7))
+			return SHELL_KEY_HOME;
+		if ((param == 4) || (param == 8))
+			return SHELL_KEY_END;
+		if (param == 3)
+			return SHELL_KEY_DELETE;
+	}
+	return 0;		// Function keys and such : ignored
+}
+
+// Process a byte of input, other than plain typing at the end of the line and line endings (see shell_state_idle)
+void shell_edit (t_shell_state *sh, char c)
+{
+	int key = (unsigned char) c;
+
+	// Escape sequences. A control character interrupts a sequence, and is processed as usual.
+	if (sh->escape == SHELL_ESCAPE_START)
+	{
+		sh->escape = (c == '[') ? SHELL_ESCAPE_CSI : (c == 'O') ? SHELL_ESCAPE_SS3 : SHELL_ESCAPE_NONE;
+		sh->escape_param = 0;
+		if (sh->escape != SHELL_ESCAPE_NONE)
+			return;
+	}
+	else if (sh->escape != SHELL_ESCAPE_NONE)
+	{
+		if ((sh->escape == SHELL_ESCAPE_CSI) && (c >= '0') && (c <= '9'))
+		{
+			if (sh->escape_param < 1000)
+				sh->escape_param = sh->escape_param * 10 + c - '0';
+			return;
+		}
+		if ((sh->escape == SHELL_ESCAPE_CSI) && (key >= 0x20) && (key < 0x40))
+			return;		// Other parameters (i.e. modifiers : "ESC [ 1 ; 5 C") and intermediate bytes
+		sh->escape = SHELL_ESCAPE_NONE;
+		if (key >= 0x20)
+		{
+			key = shell_edit_decode (c, sh->escape_param);
+			if (key == 0)
+				return;
+		}
+	}
+	if (key == 27)
+	{
+		sh->escape = SHELL_ESCAPE_START;
+		return;
+	}
+
+	if (key != 18)
+		sh->search = -1;		// Any key but Ctrl-R ends the search, and leaves the line found for editing
+
+	switch (key)
+	{
+	case SHELL_KEY_LEFT:
+		if (sh->cursor > 0)
+		{
+			shell_edit_move (sh, sh->cursor, sh->cursor - 1);
+			sh->cursor--;
+		}
+		break;
+	case SHELL_KEY_RIGHT:
+	case 6:		// Ctrl-F
+		if (sh->cursor < sh->index)
+		{
+			shell_edit_move (sh, sh->cursor, sh->cursor + 1);
+			sh->cursor++;
+		}
+		break;
+	case SHELL_KEY_HOME:
+	case 1:		// Ctrl-A
+		shell_edit_move (sh, sh->cursor, 0);
+		sh->cursor = 0;
+		break;
+	case SHELL_KEY_END:
+	case 5:		// Ctrl-E
+		shell_edit_move (sh, sh->cursor, sh->index);
+		sh->cursor = sh->index;
+		break;
+	case 127:	// not sure why, but PuTTY sends 127 for backspace. Should be 8 (ASCII)
+	case 8:
+		if (sh->cursor > 0)		// Because you can't backspace before the first character
+		{
+			shell_edit_move (sh, sh->cursor, sh->cursor - 1);
+			sh->cursor--;
+			shell_edit_delete (sh);
+		}
+		break;
+	case SHELL_KEY_DELETE:
+		shell_edit_delete (sh);
+		break;
+	case 11:	// Ctrl-K
+		if (sh->cursor < sh->index)
+			shell_tx_write (sh, "\x1b[K", 3);
+		sh->index = sh->cursor;
+		break;
+	case 21:	// Ctrl-U
+		shell_edit_replace (sh, "", 0);
+		break;
+	case SHELL_KEY_UP:
+	case 16:	// Ctrl-P
+		shell_history_recall (sh, -1);
+		break;
+	case SHELL_KEY_DOWN:
+	case 14:	// Ctrl-N
+		shell_history_recall (sh, 1);
+		break;
+	case 18:	// Ctrl-R
+		shell_history_search (sh);
+		break;
+	case 9:		// Tab
+		shell_edit_complete (sh);
+		break;
+	default:
+		if (key >= 0x20)
+			shell_edit_insert (sh, &c, 1);	// Typing in the middle of the line, or on a full line (that rings the bell)
+		break;		// Other control characters are ignored : they'd shift the display
+	}
+}
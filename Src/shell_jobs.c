@@ -0,0 +1,261 @@
+/*
+ *  shell_jobs.c
+ *
+ *  Background jobs : a command line ending with "&" runs its command in a job slot, while the prompt stays available.
+ *  Jobs are scheduled round-robin with the foreground by shell_poll (see shell.c). Their output is tagged with their number.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shell.h"
+
+#include <string.h>
+#include <stdio.h>
+
+// A job runs on the instance's own fields : its execution state is swapped with the foreground's for each of its steps,
+// so commands don't need to know whether they run in the background. Swapping the buffer pointers (rather than copying
+// the buffers) keeps the arguments valid : they point to the input buffer.
+#define SHELL_SWAP(A, B) {__typeof__ (A) t = (A); (A) = (B); (B) = t;}
+
+static void shell_job_swap (t_shell_state *sh, t_shell_job *job)
+{
+	SHELL_SWAP (sh->fp, job->fp)
+	SHELL_SWAP (sh->command_fp, job->command_fp)
+	SHELL_SWAP (sh->command_state, job->command_state)
+	SHELL_SWAP (sh->command_index, job->command_index)
+	SHELL_SWAP (sh->argc, job->argc)
+	SHELL_SWAP (sh->input, job->input)
+	SHELL_SWAP (sh->output, job->output)
+	SHELL_SWAP (sh->wait, job->wait)
+	SHELL_SWAP (sh->wake_time, job->wake_time)
+	SHELL_SWAP (sh->error, job->error)		// A job's failure mustn't count against the foreground's script
+
+	for (int i = 0; i < SHELL_MAX_ARGS; i++)
+	{
+		SHELL_SWAP (sh->argv[i], job->argv[i])
+		SHELL_SWAP (sh->arg[i], job->arg[i])
+	}
+	for (int i = 0; i < (int) (sizeof (sh->context) / sizeof (sh->context[0])); i++)
+		SHELL_SWAP (sh->context[i], job->context[i])
+}
+
+// Transfers and watches use the link directly : they can't run in the background, and the jobs hold their output while
+// one runs. Neither can macros, which run in the foreground.
+static int shell_jobs_exclusive (void (*fp)())
+{
+	return (fp == command_native_download) || (fp == command_native_upload) || (fp == command_native_watch) ||
+		(fp == command_native_run);
+}
+
+// Jobs are held while they can't print : in binary mode, during a transfer or a watch, and while the output is captured
+static int shell_jobs_held (t_shell_state *sh)
+{
+	return (sh->binary != 0) || (sh->capture != 0) || (sh->watch.entry != 0) || shell_jobs_exclusive (sh->command_fp);
+}
+
+// Find a job by number. Zero picks the most recent one.
+static t_shell_job *shell_job_find (t_shell_state *sh, int id)
+{
+	t_shell_job *found = 0;
+	for (int i = 0; i < SHELL_JOBS; i++)
+	{
+		t_shell_job *job = &sh->jobs[i];
+		if ((job->fp != 0) && ((job->id == id) || ((id == 0) && ((found == 0) || (job->id > found->id)))))
+			found = job;
+	}
+	return found;
+}
+
+// Called by the parser once the command has been started in the foreground (see shell_command_start) : move it to a free
+// slot. The foreground prints the job's number, then goes back to the prompt.
+int shell_job_start (t_shell_state *sh, const t_shell_block_entry *entry)
+{
+	if (shell_jobs_exclusive (entry->fp))
+		return -1;
+
+	for (int i = 0; i < SHELL_JOBS; i++)
+	{
+		t_shell_job *job = &sh->jobs[i];
+		if (job->fp != 0)
+			continue;
+
+		job->error = 0;
+		shell_job_swap (sh, job);
+		job->error = 0;		// The job starts clean, and so does the foreground, whose command has just been started
+		job->id = ++sh->job_count;
+		job->entry = entry;
+		job->stopped = 0;
+		job->wait = 0;
+
+		sh->command_fp = 0;
+		sprintf (sh->output, "\r\n[%d] %s", job->id, entry->label);
+		COMMAND_LAST_LINE
+		return 0;
+	}
+	return -1;
+}
+
+void shell_jobs_wake (t_shell_state *sh, unsigned int events)
+{
+	for (int i = 0; i < SHELL_JOBS; i++)
+	{
+		t_shell_job *job = &sh->jobs[i];
+		if ((job->wait & SHELL_EVENT_TIMER) && ((long) (shell_ticks () - job->wake_time) >= 0))
+			events |= SHELL_EVENT_TIMER;
+		if (job->wait & events)
+			job->wait = 0;
+	}
+}
+
+int shell_jobs_ready (t_shell_state *sh)
+{
+	if (shell_jobs_held (sh))
+		return 0;
+	for (int i = 0; i < SHELL_JOBS; i++)
+		if ((sh->jobs[i].fp != 0) && (sh->jobs[i].wait == 0) && (sh->jobs[i].stopped == 0))
+			return 1;
+	return 0;
+}
+
+unsigned int shell_jobs_wait (t_shell_state *sh)
+{
+	unsigned int wait = 0;
+	if (shell_jobs_held (sh))
+		return 0;		// The foreground's events release them
+	for (int i = 0; i < SHELL_JOBS; i++)
+		if ((sh->jobs[i].fp != 0) && (sh->jobs[i].stopped == 0))
+			wait |= sh->jobs[i].wait;
+	return wait;
+}
+
+// Print a notice about a job, tagged with its number. Returns -1 (and makes the job wait) if there's no room for it yet.
+static int shell_job_notice (t_shell_state *sh, t_shell_job *job, char *notice)
+{
+	if (shell_tx_free (sh) < SHELL_BUFFER_SIZE)
+	{
+		job->wait = SHELL_EVENT_TX;
+		return -1;
+	}
+	sh->tag = job->id;
+	shell_tx_write (sh, "\r\n", 2);
+	shell_tx_write (sh, notice, strlen (notice));
+	sh->tag = 0;
+	return 0;
+}
+
+// Run a step of each job that's ready
+void shell_jobs_step (t_shell_state *sh)
+{
+	if (shell_jobs_held (sh))
+		return;
+
+	for (int i = 0; i < SHELL_JOBS; i++)
+	{
+		t_shell_job *job = &sh->jobs[i];
+		if ((job->fp == 0) || (job->wait != 0) || (job->stopped != 0))
+			continue;
+
+		unsigned int head = sh->tx_head;
+
+		if (job->command_fp == 0)		// The command has ended : it would go back to the prompt, free the slot instead
+		{
+			if (shell_job_notice (sh, job, "done") != 0)
+				continue;
+			job->fp = 0;
+		}
+		else if ((job->fp == shell_state_input) || (job->fp == shell_state_idle))	// Input goes to the foreground
+		{
+			if (shell_job_notice (sh, job, "stopped, waiting for input (fg to resume)") != 0)
+				continue;
+			job->stopped = 1;
+		}
+		else
+		{
+			shell_job_swap (sh, job);
+			sh->tag = job->id;
+			shell_step (sh);
+			sh->tag = 0;
+			shell_job_swap (sh, job);
+		}
+
+		// The job printed over the prompt : the idle state prints it again
+		if ((sh->tx_head != head) && (sh->command_fp == 0) && ((sh->fp == shell_state_input) || (sh->fp == shell_state_idle)))
+		{
+			sh->redraw = 1;
+			sh->wait = 0;
+		}
+	}
+}
+
+// List the jobs ("jobs")
+typedef struct
+{
+	int k;
+} t_jobs_context;
+
+void command_native_jobs (t_shell_state *sh)
+{
+	t_jobs_context *ctx = SHELL_CONTEXT (t_jobs_context);
+
+	SHELL_BEGIN
+	for (ctx->k = 0; ctx->k < SHELL_JOBS; ctx->k++)
+		if (sh->jobs[ctx->k].fp != 0)
+			SHELL_YIELD_PRINTF ("\r\n[%d] %-8s %s", sh->jobs[ctx->k].id, (sh->jobs[ctx->k].stopped != 0) ? "stopped" :
+				(sh->jobs[ctx->k].command_fp == 0) ? "done" : (sh->jobs[ctx->k].wait != 0) ? "waiting" : "running",
+				sh->jobs[ctx->k].entry->label);
+	SHELL_END
+}
+
+// Bring a job to the foreground ("fg [n]", the most recent job by default). The "fg" command is over as soon as the job
+// takes its place : the foreground resumes the job's command where it was.
+void command_native_fg (t_shell_state *sh)
+{
+	t_shell_job *job = shell_job_find (sh, (sh->argc > 1) ? sh->arg[1].i : 0);
+	if (job == 0)
+	{
+		sprintf (sh->output, "\r\nno such job");
+		COMMAND_FAIL
+		return;
+	}
+
+	int len = sprintf (sh->output, "\r\n%s", job->entry->label);
+	if (shell_tx_free (sh) < len)
+	{
+		SHELL_WAIT (SHELL_EVENT_TX)
+		return;
+	}
+	shell_tx_write (sh, sh->output, len);
+
+	shell_job_swap (sh, job);
+	job->fp = 0;		// Free the slot
+	if (sh->fp == shell_state_idle)
+		sh->fp = shell_state_input;
+}
+
+// Stop a job ("kill [n]", the most recent job by default). Its command is simply dropped, wherever it was.
+void command_native_kill (t_shell_state *sh)
+{
+	t_shell_job *job = shell_job_find (sh, (sh->argc > 1) ? sh->arg[1].i : 0);
+	if (job == 0)
+	{
+		sprintf (sh->output, "\r\nno such job");
+		sh->error = 1;
+	}
+	else
+	{
+		sprintf (sh->output, "\r\n[%d] killed", job->id);
+		job->fp = 0;
+	}
+	COMMAND_LAST_LINE
+}
@@ -0,0 +1,132 @@
+/*
+ *  shell_log.c
+ *
+ *  Deferred logging : log calls only store the format string, the arguments and a timestamp in a ring buffer. Formatting
+ *  and transmission happen later, when the log console's shell instance is idle.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shell.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#if (SHELL_LOG_SIZE & (SHELL_LOG_SIZE - 1))
+#error "SHELL_LOG_SIZE must be a power of two"
+#endif
+
+// The ring is multi-producer (any code, including interrupt handlers) and single-consumer (the log console).
+// A producer reserves a slot by advancing the head with a compare-and-swap, fills it, then marks it ready by setting its
+// sequence number to its position + 1. The consumer only reads slots that are marked ready, in order.
+static t_shell_log_entry shell_log_ring[SHELL_LOG_SIZE];
+static volatile unsigned int shell_log_head;	// Next slot to reserve (producers)
+static volatile unsigned int shell_log_tail;	// Next slot to print (consumer)
+static unsigned long shell_log_reported;		// Value of shell_log_dropped when the last drop notice was printed
+
+volatile int shell_log_level = SHELL_LOG_INFO;	// Messages less severe than this are discarded on the spot
+volatile unsigned long shell_log_dropped;		// Number of messages lost because the ring was full
+t_shell_state *shell_log_console = &shell_state;	// Shell instance the messages are printed on
+
+static char *shell_log_tags[] = { "E", "W", "I", "D" };
+
+// Store a message in the ring. Safe from interrupt context and from several threads : this costs a compare-and-swap
+// and a few stores, no formatting. The format string (and any string argument) must still exist when the message is
+// printed, i.e. use literals.
+void shell_log_write (int level, char *format, long *args)
+{
+	if (level > shell_log_level)
+		return;
+
+	// Reserve a slot
+	unsigned int head = __atomic_load_n (&shell_log_head, __ATOMIC_RELAXED);
+	do
+	{
+		if (head - __atomic_load_n (&shell_log_tail, __ATOMIC_ACQUIRE) >= SHELL_LOG_SIZE)
+		{
+			__atomic_fetch_add (&shell_log_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n (&shell_log_head, &head, head + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	// Fill it, then mark it ready
+	t_shell_log_entry *entry = &shell_log_ring[head & (SHELL_LOG_SIZE - 1)];
+	entry->format = format;
+	for (int i = 0; i < SHELL_LOG_ARGS; i++)
+		entry->arg[i] = args[i];
+	entry->time = shell_ticks ();
+	entry->level = level;
+	__atomic_store_n (&entry->seq, head + 1, __ATOMIC_RELEASE);
+
+	if (shell_log_console != 0)
+		shell_event (shell_log_console, SHELL_EVENT_LOG);
+}
+
+// Compatibility with the original logging function : the message is stored as an argument, so it must persist as well
+void shell_log (char *message)
+{
+	SHELL_LOG (SHELL_LOG_INFO, "%s", (long) message);
+}
+
+// Format and print the pending messages. Called by the idle state of the log console, so messages never get mixed with
+// command output. Once the messages are out, the idle state prints the prompt and the line being typed again.
+// Returns non-zero if messages are still pending because the transmission ring is full.
+void shell_log_reset (void)
+{
+	memset (shell_log_ring, 0, sizeof (shell_log_ring));
+	shell_log_head = shell_log_tail = 0;
+	shell_log_reported = shell_log_dropped = 0;
+	shell_log_level = SHELL_LOG_INFO;
+	shell_log_console = &shell_state;
+}
+
+int shell_log_print (t_shell_state *sh)
+{
+	if (sh != shell_log_console)
+		return 0;
+
+	char line[SHELL_BUFFER_SIZE];
+	while (1)
+	{
+		unsigned int tail = shell_log_tail;
+		t_shell_log_entry *entry = &shell_log_ring[tail & (SHELL_LOG_SIZE - 1)];
+		if (__atomic_load_n (&entry->seq, __ATOMIC_ACQUIRE) != tail + 1)
+			break;		// Ring empty, or the producer of the next message hasn't finished writing it
+
+		if (shell_tx_free (sh) < SHELL_BUFFER_SIZE)
+			return 1;
+
+		int len = snprintf (line, sizeof (line), "\r\n%lu %s ", entry->time, shell_log_tags[entry->level & 3]);
+		len += snprintf (line + len, sizeof (line) - len, entry->format, entry->arg[0], entry->arg[1], entry->arg[2], entry->arg[3]);
+		if (len > (int) sizeof (line) - 1)
+			len = sizeof (line) - 1;	// Truncated
+		__atomic_store_n (&shell_log_tail, tail + 1, __ATOMIC_RELEASE);		// Release the slot
+
+		shell_tx_write (sh, line, len);
+		sh->redraw = 1;
+	}
+
+	unsigned long dropped = shell_log_dropped;
+	if (dropped != shell_log_reported)
+	{
+		if (shell_tx_free (sh) < SHELL_BUFFER_SIZE)
+			return 1;
+		int len = snprintf (line, sizeof (line), "\r\n(%lu log messages dropped)", dropped - shell_log_reported);
+		shell_tx_write (sh, line, len);
+		shell_log_reported = dropped;
+		sh->redraw = 1;
+	}
+
+	return 0;
+}
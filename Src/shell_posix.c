@@ -0,0 +1,206 @@
+/*
+ *  shell_posix.c
+ *
+ *  Portability layer for POSIX hosts (Linux). Runs the shell off-target, on a pseudo-terminal or a pair of pipes, which
+ *  is handy to measure the library or to script it. Only compiled when SHELL_PORT_POSIX is defined, since it replaces
+ *  the weak functions of the portability layer.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef SHELL_PORT_POSIX
+
+#define _GNU_SOURCE		// For ptsname_r
+
+#include "shell_posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+int shell_posix_open (t_shell_state *sh, t_shell_posix *port, int in_fd, int out_fd)
+{
+	// Reads must not block : the shell's main loop polls the descriptor
+	int flags = fcntl (in_fd, F_GETFL);
+	if ((flags == -1) || (fcntl (in_fd, F_SETFL, flags | O_NONBLOCK) == -1))
+		return -1;
+
+	// Both ends of the wake-up pipe are non-blocking : when it's full, a wake-up is pending anyway
+	if (pipe (port->wake_fd) == -1)
+		return -1;
+	for (int i = 0; i < 2; i++)
+		fcntl (port->wake_fd[i], F_SETFL, fcntl (port->wake_fd[i], F_GETFL) | O_NONBLOCK);
+
+	port->in_fd = in_fd;
+	port->out_fd = out_fd;
+	port->rx_bytes = port->tx_bytes = 0;
+	port->waiting = 0;
+	sh->port = port;
+	return 0;
+}
+
+void shell_posix_close (t_shell_state *sh)
+{
+	t_shell_posix *port = (t_shell_posix *) sh->port;
+
+	close (port->wake_fd[0]);
+	close (port->wake_fd[1]);
+	port->wake_fd[0] = port->wake_fd[1] = -1;
+}
+
+int shell_posix_openpty (t_shell_state *sh, t_shell_posix *port, char *name, int size)
+{
+	int fd = posix_openpt (O_RDWR | O_NOCTTY);
+	if (fd == -1)
+		return -1;
+	if ((grantpt (fd) == -1) || (unlockpt (fd) == -1) || (ptsname_r (fd, name, size) != 0))
+	{
+		close (fd);
+		return -1;
+	}
+
+	// Raw mode : the shell does its own echo and line editing, the pty must pass bytes through untouched
+	struct termios tio;
+	if (tcgetattr (fd, &tio) == 0)
+	{
+		cfmakeraw (&tio);
+		tcsetattr (fd, TCSANOW, &tio);
+	}
+
+	if (shell_posix_open (sh, port, fd, fd) == -1)
+	{
+		close (fd);
+		return -1;
+	}
+	return 0;
+}
+
+int shell_posix_read (t_shell_state *sh)
+{
+	t_shell_posix *port = (t_shell_posix *) sh->port;
+
+	// Reception starts with the instance's initialization (which empties the ring), so don't read anything before that
+	if ((sh->fp == 0) || (sh->fp == shell_state_init))
+		return 0;
+
+	// Only read what the reception ring can hold : the rest stays in the kernel's buffer until the next call
+	char buff[SHELL_RX_SIZE];
+	int room = SHELL_RX_SIZE - (sh->rx_head - __atomic_load_n (&sh->rx_tail, __ATOMIC_ACQUIRE));
+	if (room == 0)
+		return 0;
+
+	int n = read (port->in_fd, buff, room);
+	if (n == 0)
+		return -1;		// End of file : the other side is gone
+	if (n < 0)
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR) || (errno == EIO)) ? 0 : -1;	// EIO : pty slave not opened yet
+
+	port->rx_bytes += n;
+	shell_in_burst (sh, buff, n);
+	return n;
+}
+
+void shell_posix_wait (t_shell_state *sh, unsigned int events)
+{
+	t_shell_posix *port = (t_shell_posix *) sh->port;
+
+	// Nothing to wait for if the instance can run, or if an event has already been posted. The flag is raised before
+	// the events are checked : an event posted after the check finds it, and writes to the pipe
+	__atomic_store_n (&port->waiting, 1, __ATOMIC_SEQ_CST);
+	if ((events == 0) || (__atomic_load_n (&sh->events, __ATOMIC_SEQ_CST) & events))
+	{
+		__atomic_store_n (&port->waiting, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	int timeout = -1;
+	if (events & SHELL_EVENT_TIMER)
+	{
+		long remaining = (long) (shell_wake_time (sh) - shell_ticks ());
+		timeout = (remaining > 0) ? (int) remaining : 0;
+	}
+
+	// The wake-up pipe comes first : input is only polled for if the instance waits for it
+	struct pollfd pfd[2] = { { port->wake_fd[0], POLLIN, 0 }, { port->in_fd, POLLIN, 0 } };
+	poll (pfd, (events & SHELL_EVENT_RX) ? 2 : 1, timeout);
+	__atomic_store_n (&port->waiting, 0, __ATOMIC_SEQ_CST);
+
+	char buff[64];
+	while (read (port->wake_fd[0], buff, sizeof (buff)) > 0)
+		;
+}
+
+///////////////// PORTABILITY LAYER //////////////////////////////////////////////////////////
+
+// Writes are synchronous : the transfer is complete when write returns, so the next one is chained right away
+void shell_out (t_shell_state *sh, char *buff, int length)
+{
+	t_shell_posix *port = (t_shell_posix *) sh->port;
+
+	while (length > 0)
+	{
+		int n = write (port->out_fd, buff, length);
+		if (n < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				continue;
+			break;		// The terminal is gone : drop the output rather than stalling the shell
+		}
+		port->tx_bytes += n;
+		buff += n;
+		length -= n;
+	}
+	shell_tx_done (sh);
+}
+
+// Milliseconds, from the monotonic clock
+unsigned long shell_ticks ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Nanoseconds, from the monotonic clock (the statistics' time source)
+unsigned long shell_cycles ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called by shell_event, possibly from another thread or a signal handler (write is async-signal-safe). Most events are
+// posted by the instance's own thread (reception, transfers) : the pipe is only written to when shell_posix_wait may block.
+void shell_wakeup (t_shell_state *sh)
+{
+	t_shell_posix *port = (t_shell_posix *) sh->port;
+
+	if ((port != 0) && __atomic_exchange_n (&port->waiting, 0, __ATOMIC_SEQ_CST))
+	{
+		char c = 0;
+		__attribute__((unused)) ssize_t n = write (port->wake_fd[1], &c, 1);	// Fails only if full : a wake-up is pending then
+	}
+}
+
+// Nothing to start : shell_posix_read polls the input descriptor
+void shell_get_byte (t_shell_state *sh, char *c)
+{
+}
+
+#endif /* SHELL_PORT_POSIX */
@@ -0,0 +1,275 @@
+/*
+ *  shell_script.c
+ *
+ *  Scripts : command lists typed at the prompt ("a; b; c"), macros ("run <name>") and the boot script. Their commands
+ *  are fed to the parser from memory, one after the other : no echo, no prompt, and no round trip over the link.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// When a command of a script ends, the output state goes to shell_state_script instead of printing the prompt. It checks
+// whether the command failed (sh->error, see COMMAND_FAIL), copies the next command to the input buffer and hands it to
+// the parser. A macro can run other macros : scripts are stacked, up to SHELL_SCRIPT_DEPTH. Once the outermost script
+// is over, macros print a summary : number of commands, failures, and time taken (in shell_ticks units).
+
+#include "shell.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#ifndef SHELL_MACRO_NAME
+#define SHELL_MACRO_NAME		16		// Maximum length of the name of a macro defined at run time, null terminator included
+#endif
+
+// Macros defined with the "macro" command. They're shared by the instances. A free slot has a zero name.
+static struct
+{
+	t_shell_macro macro;
+	char name[SHELL_MACRO_NAME];
+	char script[SHELL_BUFFER_SIZE];
+} shell_macros_ram[SHELL_MACROS_RAM];
+
+// Number of instances running a script : any of them may be reading a RAM macro, which can't change meanwhile
+static int shell_scripts_running;
+
+// Macros defined at run time hide those in flash with the same name
+static const t_shell_macro *shell_macro_find (char *name)
+{
+	for (int i = 0; i < SHELL_MACROS_RAM; i++)
+		if ((shell_macros_ram[i].macro.name != 0) && (strcmp (shell_macros_ram[i].name, name) == 0))
+			return &shell_macros_ram[i].macro;
+	for (const t_shell_macro *macro = shell_macros; macro->name != 0; macro++)
+		if (strcmp (macro->name, name) == 0)
+			return macro;
+	return 0;
+}
+
+// Length of the first command of a script : up to the first ';' or line feed that isn't between double quotes
+int shell_script_split (const char *script)
+{
+	int quoted = 0;
+	int len = 0;
+	for (; script[len] != 0; len++)
+	{
+		if (script[len] == '"')
+			quoted = !quoted;
+		else if ((quoted == 0) && ((script[len] == ';') || (script[len] == '\n') || (script[len] == '\r')))
+			break;
+	}
+	return len;
+}
+
+int shell_script_push (t_shell_state *sh, const char *script, const char *name, int on_error)
+{
+	if (sh->script_depth == SHELL_SCRIPT_DEPTH)
+		return -1;
+	if (sh->script_depth == 0)		// A new batch
+	{
+		__atomic_fetch_add (&shell_scripts_running, 1, __ATOMIC_ACQ_REL);
+		sh->script_start = shell_ticks ();
+		sh->script_count = sh->script_errors = 0;
+	}
+	t_shell_script *s = &sh->script[sh->script_depth++];
+	s->next = script;
+	s->name = name;
+	s->on_error = on_error;
+	return 0;
+}
+
+void shell_macros_reset (void)
+{
+	memset (shell_macros_ram, 0, sizeof (shell_macros_ram));
+	shell_scripts_running = 0;
+}
+
+void shell_script_abort (t_shell_state *sh)
+{
+	if (sh->script_depth != 0)
+		__atomic_fetch_sub (&shell_scripts_running, 1, __ATOMIC_ACQ_REL);
+	sh->script_depth = 0;
+}
+
+// The outermost script is over (or has been stopped) : back to the prompt, after the summary if it's a macro
+static void shell_script_end (t_shell_state *sh, int stopped)
+{
+	const char *name = sh->script[0].name;
+	shell_script_abort (sh);
+
+	if ((name == 0) && (stopped == 0))
+	{
+		sh->fp = shell_state_output;
+		return;
+	}
+	sprintf (sh->output, "\r\n%.32s : %s%d commands, %d failed, %lu ticks", (name != 0) ? name : "command list",
+		(stopped != 0) ? "stopped, " : "", sh->script_count, sh->script_errors, shell_ticks () - sh->script_start);
+	if (stopped != 0)
+		COMMAND_FAIL
+	else
+		COMMAND_LAST_LINE
+}
+
+void shell_state_script (t_shell_state *sh)
+{
+	t_shell_script *s = &sh->script[sh->script_depth - 1];
+
+	if (sh->error != 0)		// The last command failed
+	{
+		sh->error = 0;
+		sh->script_errors++;
+		if (s->on_error == SHELL_SCRIPT_STOP)
+		{
+			shell_script_end (sh, 1);
+			return;
+		}
+	}
+
+	while ((*s->next == ';') || (*s->next == '\n') || (*s->next == '\r') || (*s->next == ' '))
+		s->next++;
+	if (*s->next == 0)		// This script is over : back to the one that ran it, if any
+	{
+		if (--sh->script_depth == 0)
+		{
+			sh->script_depth = 1;		// For shell_script_end
+			shell_script_end (sh, 0);
+		}
+		return;
+	}
+
+	int len = shell_script_split (s->next);
+	sh->script_count++;
+	if (len > SHELL_BUFFER_SIZE - 1)
+	{
+		sprintf (sh->output, "\r\n%.32s... : command too long", s->next);
+		s->next += len;
+		COMMAND_FAIL
+		return;
+	}
+	memcpy (sh->input, s->next, len);
+	sh->input[len] = 0;
+	s->next += len;
+	sh->fp = shell_state_parser;
+}
+
+// Run a macro ("run <macro> [stop|continue]"). Without the second argument, failed commands stop the macro or not, as
+// declared. The macro starts once this command is over.
+void command_native_run (t_shell_state *sh)
+{
+	const t_shell_macro *macro = shell_macro_find (sh->argv[1]);
+
+	if (macro == 0)
+		sprintf (sh->output, "\r\n%.64s : no such macro", sh->argv[1]);
+	else if (sh->binary != 0)
+		sprintf (sh->output, "\r\nnot available in binary mode");
+	else if (shell_script_push (sh, macro->script, macro->name, (sh->argc > 2) ? sh->arg[2].e : macro->on_error) != 0)
+		sprintf (sh->output, "\r\nscripts nested too deep");
+	else
+	{
+		COMMAND_END
+		return;
+	}
+	COMMAND_FAIL
+}
+
+// Print a macro on a single line : its commands are shown separated by "; "
+static void shell_macro_print (t_shell_state *sh, const t_shell_macro *macro, char *where)
+{
+	int len = snprintf (sh->output, SHELL_BUFFER_SIZE, "\r\n %-16s%s ", macro->name, where);
+	for (const char *c = macro->script; (*c != 0) && (len < SHELL_BUFFER_SIZE - 3); c++)
+		if ((*c != '\n') && (*c != '\r'))
+			sh->output[len++] = *c;
+		else if ((c[1] != 0) && (c[1] != '\n'))
+		{
+			sh->output[len++] = ';';
+			sh->output[len++] = ' ';
+		}
+	sh->output[len] = 0;
+}
+
+typedef struct
+{
+	int k;			// Macro being listed : RAM slots first, then the flash table
+} t_macro_context;
+
+// List the macros ("macro"), define one ("macro <name> <commands>", quote the commands if there are several) or delete
+// one defined at run time ("macro <name>"). A macro in RAM can't be replaced or deleted while a script runs, on any
+// instance : it may be the one being read.
+void command_native_macro (t_shell_state *sh)
+{
+	t_macro_context *ctx = SHELL_CONTEXT (t_macro_context);
+
+	if (sh->argc == 2)		// Delete
+	{
+		const t_shell_macro *macro = shell_macro_find (sh->argv[1]);
+		for (int i = 0; i < SHELL_MACROS_RAM; i++)
+			if (macro == &shell_macros_ram[i].macro)
+			{
+				if (__atomic_load_n (&shell_scripts_running, __ATOMIC_ACQUIRE) != 0)
+				{
+					sprintf (sh->output, "\r\nmacro : can't be deleted while a script runs");
+					COMMAND_FAIL
+					return;
+				}
+				shell_macros_ram[i].macro.name = 0;
+				COMMAND_END
+				return;
+			}
+		sprintf (sh->output, "\r\n%.64s : no such macro%s", sh->argv[1], (macro != 0) ? " in RAM" : "");
+		COMMAND_FAIL
+		return;
+	}
+
+	if (sh->argc > 2)		// Define, or replace
+	{
+		int slot = -1;		// The macro's slot if it exists, otherwise a free one
+		for (int i = 0; i < SHELL_MACROS_RAM; i++)
+			if ((shell_macros_ram[i].macro.name != 0) && (strcmp (shell_macros_ram[i].name, sh->argv[1]) == 0))
+				slot = i;
+		for (int i = 0; (i < SHELL_MACROS_RAM) && (slot < 0); i++)
+			if (shell_macros_ram[i].macro.name == 0)
+				slot = i;
+		int replace = (slot >= 0) && (shell_macros_ram[slot].macro.name != 0);
+		int running = replace && (__atomic_load_n (&shell_scripts_running, __ATOMIC_ACQUIRE) != 0);
+		if (((int) strlen (sh->argv[1]) > SHELL_MACRO_NAME - 1) || (slot < 0) || (sh->script_depth != 0) || running)
+		{
+			sprintf (sh->output, "\r\nmacro : %s", (slot < 0) ? "no free slot" : (sh->script_depth != 0) ?
+				"can't be defined by a script" : running ? "can't be replaced while a script runs" : "name too long");
+			COMMAND_FAIL
+			return;
+		}
+		strcpy (shell_macros_ram[slot].name, sh->argv[1]);
+		if (sh->argc == 3)		// The commands, quoted : as they are
+			strcpy (shell_macros_ram[slot].script, sh->argv[2]);
+		else
+			shell_join (sh, 2, shell_macros_ram[slot].script, SHELL_BUFFER_SIZE);
+		shell_macros_ram[slot].macro.script = shell_macros_ram[slot].script;
+		shell_macros_ram[slot].macro.on_error = SHELL_SCRIPT_STOP;
+		shell_macros_ram[slot].macro.name = shell_macros_ram[slot].name;
+		COMMAND_END
+		return;
+	}
+
+	SHELL_BEGIN
+	for (ctx->k = 0; ctx->k < SHELL_MACROS_RAM; ctx->k++)
+		if (shell_macros_ram[ctx->k].macro.name != 0)
+		{
+			shell_macro_print (sh, &shell_macros_ram[ctx->k].macro, "(RAM)");
+			SHELL_YIELD_PRINT (sh->output)
+		}
+	for (ctx->k = 0; shell_macros[ctx->k].name != 0; ctx->k++)
+	{
+		shell_macro_print (sh, &shell_macros[ctx->k], "");
+		SHELL_YIELD_PRINT (sh->output)
+	}
+	SHELL_END
+}
@@ -0,0 +1,129 @@
+/*
+ *  shell_stats.c
+ *
+ *  Statistics : how often each state and each command runs, and how long its steps take (log2 histograms), to find out
+ *  what the shell spends its time on. Only compiled when SHELL_STATS is defined.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef SHELL_STATS
+
+#include "shell.h"
+
+#include <string.h>
+
+// The table is filled on the fly : a state or command gets a row the first time it runs. It's shared by the instances,
+// which are expected to run from the same thread. Transfers are recorded from interrupt context, in a row of their own.
+t_shell_stats_row shell_stats_table[SHELL_STATS_ROWS];
+t_shell_stats_row shell_stats_tx;
+unsigned long shell_stats_untracked;
+
+// Names of the shell's own states. Commands are named after their entry in the block tables.
+static const struct
+{
+	void (*fp)();
+	char *name;
+} shell_stats_states[] =
+{
+	{ shell_state_init, "(init)" },
+	{ shell_state_output, "(output)" },
+	{ shell_state_input, "(input)" },
+	{ shell_state_idle, "(idle)" },
+	{ shell_state_parser, "(parser)" },
+	{ shell_state_binary, "(binary)" },
+	{ shell_state_binary_reply, "(reply)" },
+	{ shell_state_watch, "(watch)" },
+	{ shell_state_script, "(script)" },
+	{ command_native_end, "(end)" },
+};
+
+// Find the row of a function, or give it a free one. Returns zero if the table is full.
+static t_shell_stats_row *shell_stats_row (void (*fp)())
+{
+	for (int i = 0; i < SHELL_STATS_ROWS; i++)
+	{
+		if (shell_stats_table[i].fp == fp)
+			return &shell_stats_table[i];
+		if (shell_stats_table[i].fp == 0)
+		{
+			shell_stats_table[i].fp = fp;
+			return &shell_stats_table[i];
+		}
+	}
+	shell_stats_untracked++;
+	return 0;
+}
+
+void shell_stats_record (t_shell_stats_row *row, unsigned long cycles)
+{
+	int bucket = 0;		// Number of significant bits of the duration
+	while (((cycles >> bucket) != 0) && (bucket < SHELL_STATS_BUCKETS - 1))
+		bucket++;
+
+	row->steps++;
+	row->cycles += cycles;
+	if (cycles > row->max)
+		row->max = cycles;
+	row->hist[bucket]++;
+}
+
+void shell_stats_step (void (*fp)(), unsigned long cycles)
+{
+	t_shell_stats_row *row = shell_stats_row (fp);
+	if (row != 0)
+		shell_stats_record (row, cycles);
+}
+
+void shell_stats_run (void (*fp)())
+{
+	t_shell_stats_row *row = shell_stats_row (fp);
+	if (row != 0)
+		row->runs++;
+}
+
+void shell_stats_reset (t_shell_state *sh)
+{
+	memset (shell_stats_table, 0, sizeof (shell_stats_table));
+	memset (&shell_stats_tx, 0, sizeof (shell_stats_tx));
+	shell_stats_untracked = 0;
+	sh->rx_bytes = sh->tx_bytes = 0;
+	sh->rx_overflow = 0;
+}
+
+// Returns the name of a row, and its length (command labels are cut after the command word). Only called when printing
+// the statistics, so it's fine to search the block tables.
+char *shell_stats_name (void (*fp)(), int *length)
+{
+	for (int i = 0; i < (int) (sizeof (shell_stats_states) / sizeof (shell_stats_states[0])); i++)
+		if (shell_stats_states[i].fp == fp)
+		{
+			*length = strlen (shell_stats_states[i].name);
+			return shell_stats_states[i].name;
+		}
+
+	const t_shell_block_entry *block;
+	for (int number = 0; (block = shell_index_entry (number << 8)) != 0; number++)
+		for (int k = 1; k <= BLOCK_COUNT (block); k++)
+			if (block[k].fp == fp)
+			{
+				*length = strcspn (block[k].label, " ");
+				return block[k].label;
+			}
+
+	*length = 1;	// A command of a block that isn't indexed
+	return "?";
+}
+
+#endif /* SHELL_STATS */
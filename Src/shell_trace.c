@@ -0,0 +1,566 @@
+/*
+ *  shell_trace.c
+ *
+ *  Variables and traces : firmware variables declared in a table can be read and written by name ("get", "set"), and
+ *  sampled at a fixed rate from a timer interrupt into a RAM ring ("trace"), around a trigger condition. The capture is
+ *  printed or downloaded once complete, so sampling never waits for the link.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Traces :
+// - "trace select <variable> [variable...]" chooses the variables to sample (up to SHELL_TRACE_VARS).
+// - "trace trigger <variable> <rise|fall|above|below> <level>" sets the trigger condition, "trace trigger none" removes it.
+//   The trigger variable doesn't have to be one of the sampled ones.
+// - "trace arm [pre] [post] [divider]" starts sampling : each call to shell_trace_sample (the divider-th call, if a
+//   divider is given) stores a record, a 32-bit word per variable. The trigger is checked once pre records have been
+//   stored, and the capture is complete post records after the record that met it : the capture holds pre + 1 + post
+//   records. Without a trigger, the capture starts with the first record.
+// - "trace show" waits for the capture to complete (any key stops it early), then prints a record per line : its
+//   position relative to the trigger, then the values. "download trace" sends the raw records instead. Until the capture
+//   is complete, only the instance that armed it can show it : it's the one the end of the capture wakes up.
+// - "trace stop" stops the capture early, "trace" shows its status.
+// A sample costs the same whatever happens : a word copy per variable, and the trigger check.
+
+#include "shell.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Lookup index : the first SHELL_VARS_INDEXED entries of shell_vars, sorted by name. Built on first use.
+static const t_shell_var *shell_var_index[SHELL_VARS_INDEXED];
+static int shell_var_count = -1;	// Number of indexed variables, -1 until the index is built
+
+static void shell_var_build (void)
+{
+	shell_var_count = 0;
+	for (const t_shell_var *var = shell_vars; (var->name != 0) && (shell_var_count < SHELL_VARS_INDEXED); var++)
+	{
+		int i = shell_var_count++;		// Insertion sort : the table is small, and it's only done once
+		while ((i > 0) && (strcmp (shell_var_index[i - 1]->name, var->name) > 0))
+		{
+			shell_var_index[i] = shell_var_index[i - 1];
+			i--;
+		}
+		shell_var_index[i] = var;
+	}
+}
+
+// Binary search in the index, then linear search in the entries that didn't fit
+const t_shell_var *shell_var_find (char *name)
+{
+	if (shell_var_count < 0)
+		shell_var_build ();
+
+	int low = 0;
+	int high = shell_var_count - 1;
+	while (low <= high)
+	{
+		int mid = (low + high) / 2;
+		int cmp = strcmp (name, shell_var_index[mid]->name);
+		if (cmp == 0)
+			return shell_var_index[mid];
+		if (cmp < 0)
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+
+	for (const t_shell_var *var = shell_vars + shell_var_count; var->name != 0; var++)
+		if (strcmp (name, var->name) == 0)
+			return var;
+	return 0;
+}
+
+// Variables are accessed as raw 32-bit words : the type only matters for conversions
+static unsigned int shell_var_read (const t_shell_var *var)
+{
+	switch (var->size)
+	{
+		case 1:
+			return *(volatile unsigned char *) var->addr;
+		case 2:
+			return *(volatile unsigned short *) var->addr;
+		default:
+			return *(volatile unsigned int *) var->addr;
+	}
+}
+
+static void shell_var_write (const t_shell_var *var, unsigned int raw)
+{
+	switch (var->size)
+	{
+		case 1:
+			*(volatile unsigned char *) var->addr = raw;
+			break;
+		case 2:
+			*(volatile unsigned short *) var->addr = raw;
+			break;
+		default:
+			*(volatile unsigned int *) var->addr = raw;
+			break;
+	}
+}
+
+static long shell_var_signed (const t_shell_var *var, unsigned int raw)
+{
+	return (var->size == 1) ? (signed char) raw : (var->size == 2) ? (short) raw : (int) raw;
+}
+
+static float shell_var_float (const t_shell_var *var, unsigned int raw)
+{
+	float f;
+	if (var->type == 'f')
+	{
+		memcpy (&f, &raw, sizeof (f));
+		return f;
+	}
+	return (var->type == 'i') ? (float) shell_var_signed (var, raw) : (float) raw;
+}
+
+// Format a value. Returns the number of characters written, like snprintf.
+static int shell_var_format (char *buff, int size, const t_shell_var *var, unsigned int raw)
+{
+	switch (var->type)
+	{
+		case 'f':
+			return snprintf (buff, size, "%g", shell_var_float (var, raw));
+		case 'i':
+			return snprintf (buff, size, "%ld", shell_var_signed (var, raw));
+		case 'x':
+			return snprintf (buff, size, "0x%x", raw);
+		default:
+			return snprintf (buff, size, "%u", raw);
+	}
+}
+
+// Look a variable up for a command. Returns zero, with an error message in the output buffer, if there's no such
+// variable, or if its size isn't one the accesses above handle (a table not built with SHELL_VAR, i.e. a 64-bit variable).
+static const t_shell_var *shell_var_lookup (t_shell_state *sh, char *name)
+{
+	const t_shell_var *var = shell_var_find (name);
+	if (var == 0)
+		sprintf (sh->output, "\r\n%.64s : no such variable", name);
+	else if ((var->size != 1) && (var->size != 2) && (var->size != 4))
+	{
+		sprintf (sh->output, "\r\n%s : unsupported size (%d bytes)", var->name, var->size);
+		var = 0;
+	}
+	return var;
+}
+
+// Print a variable ("get <variable>")
+void command_native_get (t_shell_state *sh)
+{
+	const t_shell_var *var = shell_var_lookup (sh, sh->argv[1]);
+	if (var == 0)
+		sh->error = 1;
+	else
+	{
+		int len = sprintf (sh->output, "\r\n%s = ", var->name);
+		shell_var_format (sh->output + len, SHELL_BUFFER_SIZE - len, var, shell_var_read (var));
+	}
+	COMMAND_LAST_LINE
+}
+
+// Change a variable ("set <variable> <value>"). The value is converted according to the variable's type.
+void command_native_set (t_shell_state *sh)
+{
+	const t_shell_var *var = shell_var_lookup (sh, sh->argv[1]);
+	char *arg = sh->argv[2];
+	char *end = arg;
+	unsigned int raw = 0;
+
+	if (var == 0)
+	{
+		COMMAND_FAIL
+		return;
+	}
+
+	if (var->type == 'f')
+	{
+		float f = strtof (arg, &end);
+		memcpy (&raw, &f, sizeof (raw));
+	}
+	else if (var->type == 'i')
+		raw = strtol (arg, &end, 0);
+	else
+		raw = strtoul (arg, &end, (var->type == 'x') ? 16 : 0);
+
+	if ((*end != 0) || (end == arg))
+	{
+		sprintf (sh->output, "\r\n%.64s : invalid value", arg);
+		sh->error = 1;
+	}
+	else
+	{
+		shell_var_write (var, raw);
+		int len = sprintf (sh->output, "\r\n%s = ", var->name);
+		shell_var_format (sh->output + len, SHELL_BUFFER_SIZE - len, var, shell_var_read (var));
+	}
+	COMMAND_LAST_LINE
+}
+
+// ======= Traces =======
+
+#define SHELL_TRACE_IDLE		0		// Nothing captured
+#define SHELL_TRACE_ARMED		1		// Sampling, waiting for the trigger
+#define SHELL_TRACE_TRIGGERED	2		// Sampling, the trigger has been met
+#define SHELL_TRACE_DONE		3		// Capture complete
+
+// Trigger conditions, in the order of the command's list
+#define SHELL_TRACE_RISE		0		// The variable goes from below the level to the level or above
+#define SHELL_TRACE_FALL		1		// The other way
+#define SHELL_TRACE_ABOVE		2		// The variable is above the level
+#define SHELL_TRACE_BELOW		3		// The variable is below the level
+
+// Subcommands, in the order of the command's schema
+#define SHELL_TRACE_SELECT		0
+#define SHELL_TRACE_TRIGGER		1
+#define SHELL_TRACE_ARM			2
+#define SHELL_TRACE_STOP		3
+#define SHELL_TRACE_SHOW		4
+
+// The ring holds capacity records of vars words. Record n (counting from arming) is in slot n % capacity.
+// The sampling interrupt writes everything below state, the main loop only reads it once the capture is complete.
+static unsigned int shell_trace_ring[SHELL_TRACE_SIZE];
+
+static struct
+{
+	volatile int state;
+	const t_shell_var *var[SHELL_TRACE_VARS];	// Variables sampled
+	int vars;
+	const t_shell_var *trigger;		// Trigger variable, zero if there's no trigger
+	int condition;
+	float level;
+	float previous;					// Value of the trigger variable at the previous sample (rise and fall conditions)
+	int primed;						// Set once previous is valid
+	int pre;						// Records kept before the trigger...
+	int post;						// ... and after it
+	int divider;					// Calls to shell_trace_sample per record
+	int tick;
+	int capacity;					// Number of records the ring holds
+	int slot;						// Slot of the next record
+	unsigned long count;			// Number of records stored since the trace was armed
+	unsigned long trigger_at;		// Record that met the trigger, or -1
+	unsigned long start;			// First record of the capture, once complete
+	unsigned long length;			// Number of records of the capture
+	int linear;						// Set once the capture has been moved to the start of the ring
+	t_shell_state *sh;				// Instance to notify when the capture is complete
+	t_shell_region region;			// The capture, for "download trace"
+} shell_trace;
+
+// Take a sample : called from a timer interrupt, at the sampling rate. The trace must not be reconfigured while it runs.
+void shell_trace_sample (void)
+{
+	int loaded = __atomic_load_n (&shell_trace.state, __ATOMIC_ACQUIRE);
+	int state = loaded;
+	if ((state != SHELL_TRACE_ARMED) && (state != SHELL_TRACE_TRIGGERED))
+		return;
+	if (++shell_trace.tick < shell_trace.divider)
+		return;
+	shell_trace.tick = 0;
+
+	unsigned int *record = &shell_trace_ring[shell_trace.slot * shell_trace.vars];
+	for (int i = 0; i < shell_trace.vars; i++)
+		record[i] = shell_var_read (shell_trace.var[i]);
+	if (++shell_trace.slot == shell_trace.capacity)
+		shell_trace.slot = 0;
+	unsigned long n = shell_trace.count++;
+
+	if (state == SHELL_TRACE_ARMED)
+	{
+		int met = 1;
+		if (shell_trace.trigger != 0)
+		{
+			float v = shell_var_float (shell_trace.trigger, shell_var_read (shell_trace.trigger));
+			switch (shell_trace.condition)
+			{
+				case SHELL_TRACE_RISE:
+					met = shell_trace.primed && (shell_trace.previous < shell_trace.level) && (v >= shell_trace.level);
+					break;
+				case SHELL_TRACE_FALL:
+					met = shell_trace.primed && (shell_trace.previous > shell_trace.level) && (v <= shell_trace.level);
+					break;
+				case SHELL_TRACE_ABOVE:
+					met = (v > shell_trace.level);
+					break;
+				default:
+					met = (v < shell_trace.level);
+					break;
+			}
+			shell_trace.previous = v;
+			shell_trace.primed = 1;
+		}
+		if (met && (n >= (unsigned long) shell_trace.pre))		// The trigger only counts once the pre-trigger records are there
+		{
+			shell_trace.trigger_at = n;
+			state = SHELL_TRACE_TRIGGERED;
+		}
+	}
+
+	// Publish the new state from the one loaded : if "trace stop" got there first, it's left alone
+	int next = ((state == SHELL_TRACE_TRIGGERED) && (n >= shell_trace.trigger_at + shell_trace.post)) ? SHELL_TRACE_DONE : state;
+	if ((next != loaded) &&
+		__atomic_compare_exchange_n (&shell_trace.state, &loaded, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+		(next == SHELL_TRACE_DONE))
+		shell_event (shell_trace.sh, SHELL_EVENT_YIELD);
+}
+
+// Stop sampling, if it's in progress. The capture holds what has been recorded so far.
+static void shell_trace_stop (void)
+{
+	int state = SHELL_TRACE_ARMED;
+	if (!__atomic_compare_exchange_n (&shell_trace.state, &state, SHELL_TRACE_DONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		state = SHELL_TRACE_TRIGGERED;
+		__atomic_compare_exchange_n (&shell_trace.state, &state, SHELL_TRACE_DONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void shell_trace_reverse (unsigned int *a, unsigned int *b)
+{
+	while (a < --b)
+	{
+		unsigned int t = *a;
+		*a++ = *b;
+		*b = t;
+	}
+}
+
+// Once the capture is complete : locate it in the ring, and move it to the start of the ring (in place, by rotating the
+// ring) so it can be read, or downloaded, in one piece.
+static void shell_trace_finish (void)
+{
+	if (shell_trace.linear != 0)
+		return;
+
+	unsigned long end = shell_trace.count;
+	if (shell_trace.trigger_at != (unsigned long) -1)
+		shell_trace.start = shell_trace.trigger_at - shell_trace.pre;
+	else		// Stopped before the trigger : keep the last records
+		shell_trace.start = (end > (unsigned long) shell_trace.capacity) ? end - shell_trace.capacity : 0;
+	shell_trace.length = end - shell_trace.start;
+
+	int words = shell_trace.capacity * shell_trace.vars;
+	int first = (shell_trace.start % shell_trace.capacity) * shell_trace.vars;
+	shell_trace_reverse (shell_trace_ring, shell_trace_ring + first);
+	shell_trace_reverse (shell_trace_ring + first, shell_trace_ring + words);
+	shell_trace_reverse (shell_trace_ring, shell_trace_ring + words);
+
+	shell_trace.region.name = "trace";
+	shell_trace.region.base = (char *) shell_trace_ring;
+	shell_trace.region.size = shell_trace.length * shell_trace.vars * sizeof (shell_trace_ring[0]);
+	shell_trace.region.writable = 0;
+	shell_trace.linear = 1;
+}
+
+void shell_trace_reset (void)
+{
+	memset (&shell_trace, 0, sizeof (shell_trace));		// SHELL_TRACE_IDLE, nothing selected
+	memset (shell_trace_ring, 0, sizeof (shell_trace_ring));
+	shell_var_count = -1;		// The index is built again on the next lookup
+}
+
+const t_shell_region *shell_trace_region (char *name)
+{
+	if ((strcmp (name, "trace") != 0) || (shell_trace.state != SHELL_TRACE_DONE))
+		return 0;
+	shell_trace_finish ();
+	return &shell_trace.region;
+}
+
+// Convert a number of "trace arm", entirely, like shell_arguments does. Returns -1 if it isn't one.
+static int shell_trace_number (char *arg, long *value)
+{
+	char *end;
+	*value = strtol (arg, &end, 0);
+	return ((*end != 0) || (end == arg)) ? -1 : 0;
+}
+
+// Subcommands that configure the trace. Returns with a message in the output buffer, and -1 on error.
+static int shell_trace_configure (t_shell_state *sh)
+{
+	static char *conditions[] = { "rise", "fall", "above", "below" };
+	int running = (shell_trace.state == SHELL_TRACE_ARMED) || (shell_trace.state == SHELL_TRACE_TRIGGERED);
+
+	if (sh->arg[1].e == SHELL_TRACE_STOP)
+	{
+		shell_trace_stop ();
+		sprintf (sh->output, "\r\ntrace stopped");
+		return 0;
+	}
+	if (running)
+	{
+		sprintf (sh->output, "\r\ntrace : stop it first");
+		return -1;
+	}
+
+	if (sh->arg[1].e == SHELL_TRACE_SELECT)
+	{
+		if ((sh->argc < 3) || (sh->argc - 2 > SHELL_TRACE_VARS))
+		{
+			sprintf (sh->output, "\r\ntrace : select 1 to %d variables", SHELL_TRACE_VARS);
+			return -1;
+		}
+		for (int n = 2; n < sh->argc; n++)
+			if (shell_var_lookup (sh, sh->argv[n]) == 0)
+				return -1;
+		shell_trace.vars = sh->argc - 2;
+		for (int n = 2; n < sh->argc; n++)
+			shell_trace.var[n - 2] = shell_var_find (sh->argv[n]);
+		sprintf (sh->output, "\r\n%d variables, %d records", shell_trace.vars, SHELL_TRACE_SIZE / shell_trace.vars);
+	}
+	else if (sh->arg[1].e == SHELL_TRACE_TRIGGER)
+	{
+		char *end = 0;
+		int c = 0;
+		if ((sh->argc == 3) && (strcmp (sh->argv[2], "none") == 0))
+		{
+			shell_trace.trigger = 0;
+			sprintf (sh->output, "\r\nno trigger");
+			return 0;
+		}
+		if (sh->argc == 5)
+		{
+			shell_trace.level = strtof (sh->argv[4], &end);
+			while ((c < 4) && (strcmp (sh->argv[3], conditions[c]) != 0))
+				c++;
+		}
+		const t_shell_var *var = 0;
+		if ((sh->argc == 5) && ((var = shell_var_lookup (sh, sh->argv[2])) == 0))
+			return -1;
+		if ((var == 0) || (c == 4) || (*end != 0) || (end == sh->argv[4]))
+		{
+			sprintf (sh->output, "\r\ntrace trigger <variable> <rise|fall|above|below> <level>, or trace trigger none");
+			return -1;
+		}
+		shell_trace.trigger = var;
+		shell_trace.condition = c;
+		sprintf (sh->output, "\r\ntrigger : %s %s %g", var->name, conditions[c], shell_trace.level);
+	}
+	else	// Arm
+	{
+		if (shell_trace.vars == 0)
+		{
+			sprintf (sh->output, "\r\ntrace : select variables first");
+			return -1;
+		}
+		int capacity = SHELL_TRACE_SIZE / shell_trace.vars;
+		int invalid = (sh->argc > 5);
+		long pre = (shell_trace.trigger != 0) ? capacity / 4 : 0;
+		if (sh->argc > 2)
+			invalid |= shell_trace_number (sh->argv[2], &pre);
+		long post = capacity - pre - 1;
+		if (sh->argc > 3)
+			invalid |= shell_trace_number (sh->argv[3], &post);
+		long divider = 1;
+		if (sh->argc > 4)
+			invalid |= shell_trace_number (sh->argv[4], &divider);
+		if (invalid != 0)
+		{
+			sprintf (sh->output, "\r\ntrace arm [pre] [post] [divider] : invalid argument");
+			return -1;
+		}
+		if ((pre < 0) || (post < 0) || (pre + post + 1 > capacity) || (divider < 1))
+		{
+			sprintf (sh->output, "\r\ntrace arm [pre] [post] [divider] : pre + post must be less than %d", capacity);
+			return -1;
+		}
+
+		shell_trace.capacity = capacity;
+		shell_trace.pre = pre;
+		shell_trace.post = post;
+		shell_trace.divider = divider;
+		shell_trace.tick = shell_trace.slot = shell_trace.primed = shell_trace.linear = 0;
+		shell_trace.count = 0;
+		shell_trace.trigger_at = -1;
+		shell_trace.sh = sh;
+		__atomic_store_n (&shell_trace.state, SHELL_TRACE_ARMED, __ATOMIC_RELEASE);	// Sampling starts here
+		sprintf (sh->output, "\r\ntrace armed : %ld + 1 + %ld records", pre, post);
+	}
+	return 0;
+}
+
+// Print the capture : a line per record, with its position relative to the trigger
+typedef struct
+{
+	unsigned long k;
+} t_trace_context;
+
+static void shell_trace_show (t_shell_state *sh)
+{
+	t_trace_context *ctx = SHELL_CONTEXT (t_trace_context);
+
+	SHELL_BEGIN
+	if (shell_trace.state == SHELL_TRACE_IDLE)
+	{
+		sprintf (sh->output, "\r\ntrace : nothing captured");
+		COMMAND_FAIL
+		return;
+	}
+	if ((shell_trace.state != SHELL_TRACE_DONE) && (shell_trace.sh != sh))	// Only that instance is woken up at the end
+	{
+		sprintf (sh->output, "\r\ntrace : in progress, show it from the console that armed it");
+		COMMAND_FAIL
+		return;
+	}
+
+	SHELL_AWAIT (SHELL_EVENT_YIELD | SHELL_EVENT_RX, (shell_trace.state == SHELL_TRACE_DONE) || (shell_rx_count (sh) > 0))
+	shell_rx_read (sh, 0, shell_rx_count (sh));		// A key stops the capture early
+	shell_trace_stop ();
+	shell_trace_finish ();
+
+	SHELL_YIELD_PRINTF ("\r\n%lu records", shell_trace.length);
+	for (ctx->k = 0; ctx->k < shell_trace.length; ctx->k++)
+	{
+		long t = (shell_trace.trigger_at != (unsigned long) -1) ? (long) ctx->k - shell_trace.pre : (long) ctx->k;
+		int len = snprintf (sh->output, SHELL_BUFFER_SIZE, "\r\n%ld", t);
+		for (int i = 0; (i < shell_trace.vars) && (len < SHELL_BUFFER_SIZE - 1); i++)
+		{
+			sh->output[len++] = ',';
+			len += shell_var_format (sh->output + len, SHELL_BUFFER_SIZE - len, shell_trace.var[i],
+				shell_trace_ring[ctx->k * shell_trace.vars + i]);
+		}
+		SHELL_YIELD_PRINT (sh->output)
+	}
+	SHELL_END
+}
+
+// "trace [select|trigger|arm|stop|show] ...", see above
+void command_native_trace (t_shell_state *sh)
+{
+	static char *states[] = { "idle", "armed", "triggered", "done" };
+
+	if ((sh->argc > 1) && (sh->arg[1].e == SHELL_TRACE_SHOW))
+	{
+		shell_trace_show (sh);
+		return;
+	}
+	if ((sh->argc > 1) && (shell_trace_configure (sh) != 0))
+	{
+		COMMAND_FAIL
+		return;
+	}
+	if (sh->argc == 1)
+	{
+		int len = sprintf (sh->output, "\r\ntrace %s, %lu records :", states[shell_trace.state & 3], shell_trace.count);
+		for (int i = 0; i < shell_trace.vars; i++)
+			len += sprintf (sh->output + len, " %.32s", shell_trace.var[i]->name);
+		if (shell_trace.trigger != 0)
+			sprintf (sh->output + len, ", trigger on %.32s", shell_trace.trigger->name);
+	}
+	COMMAND_LAST_LINE
+}
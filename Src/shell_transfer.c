@@ -0,0 +1,464 @@
+/*
+ *  shell_transfer.c
+ *
+ *  Bulk transfers : the "download" and "upload" native commands move the contents of memory regions over the link, as
+ *  fast as it goes. Downloads are sent straight from the region by DMA, uploads are copied straight from the reception
+ *  ring to the region : the output buffer, sprintf and the line-by-line state machine round trips are out of the way.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Protocol (YMODEM-like, with a sliding window) :
+// - Commands : "download <region> [offset] [length]" and "upload <region> [offset] [length]". The command prints a line,
+//   then the receiver (the terminal for a download, the shell for an upload) sends 'C' to start the transfer.
+// - Data packet : STX, sequence number, its complement, data length (2 bytes, little-endian, 1 to SHELL_TRANSFER_BLOCK),
+//   data, CRC of the data (shell_crc16 with an initial value of 0, 2 bytes, most significant first, as in XMODEM).
+// - End of transmission : EOT, sequence number, its complement. Sequence numbers start at 1 and wrap around.
+// - The receiver answers each packet with ACK or NAK, followed by a sequence number. "ACK n" acknowledges packet n and
+//   the ones before it. "NAK n" asks for packet n again, and the ones after it (go-back-N) : it's sent when a packet is
+//   corrupted, or when one is missing. Packets that aren't the one expected are skipped.
+// - The sender keeps up to SHELL_TRANSFER_WINDOW packets in flight. If nothing is acknowledged for SHELL_TRANSFER_TIMEOUT,
+//   it goes back to the first packet not acknowledged. After SHELL_TRANSFER_RETRIES timeouts or rejections in a row,
+//   or two CAN bytes from the other side, the transfer is aborted (and two CAN bytes are sent).
+// An upload writes the region as packets arrive : if it's aborted, the region holds part of the data.
+
+#include "shell.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#if (SHELL_TRANSFER_WINDOW < 1) || (SHELL_TRANSFER_WINDOW > 255) || (SHELL_TRANSFER_BLOCK > 0xFFFF)
+#error "SHELL_TRANSFER_WINDOW must be between 1 and 255, and SHELL_TRANSFER_BLOCK must fit in 16 bits"
+#endif
+
+#define SHELL_TRANSFER_STX		0x02	// Data packet
+#define SHELL_TRANSFER_EOT		0x04	// End of transmission
+#define SHELL_TRANSFER_ACK		0x06
+#define SHELL_TRANSFER_NAK		0x15
+#define SHELL_TRANSFER_CAN		0x18	// Cancel, twice in a row
+
+// Resolve the arguments of both commands : region name, and optional offset and length. Returns -1, with an error
+// message in the output buffer, if they're invalid.
+static int shell_transfer_open (t_shell_state *sh, int upload)
+{
+	t_shell_transfer *t = &sh->transfer;
+
+	if (sh->binary != 0)
+	{
+		sprintf (sh->output, "\r\nnot available in binary mode");
+		return -1;
+	}
+
+	const t_shell_region *region = shell_regions;
+	while ((region->name != 0) && (strcmp (region->name, sh->argv[1]) != 0))
+		region++;
+	if (region->name == 0)
+		region = shell_trace_region (sh->argv[1]);		// The last trace can be downloaded as well
+	if (region == 0)
+	{
+		sprintf (sh->output, "\r\n%.64s : no such region", sh->argv[1]);
+		return -1;
+	}
+	if ((upload != 0) && (region->writable == 0))
+	{
+		sprintf (sh->output, "\r\n%s : read-only region", region->name);
+		return -1;
+	}
+
+	long offset = (sh->argc > 2) ? sh->arg[2].i : 0;
+	if ((offset < 0) || ((unsigned long) offset > region->size))
+	{
+		sprintf (sh->output, "\r\n%s : offset out of range (size %lu)", region->name, region->size);
+		return -1;
+	}
+
+	memset (t, 0, sizeof (t_shell_transfer));
+	t->data = region->base + offset;
+	t->length = region->size - offset;
+	if ((sh->argc > 3) && (sh->arg[3].i >= 0) && ((unsigned long) sh->arg[3].i < t->length))
+		t->length = sh->arg[3].i;
+	t->deadline = shell_ticks () + SHELL_TRANSFER_TIMEOUT;
+	return 0;
+}
+
+// Returns non-zero if c is the second cancel byte in a row
+static int shell_transfer_cancelled (t_shell_transfer *t, char c)
+{
+	if (c != SHELL_TRANSFER_CAN)
+		t->cancel = 0;
+	else if (++t->cancel >= 2)
+		return 1;
+	return 0;
+}
+
+static int shell_transfer_expired (t_shell_transfer *t)
+{
+	return (long) (shell_ticks () - t->deadline) >= 0;
+}
+
+// Wait for events, or for the next timeout
+static void shell_transfer_wait (t_shell_state *sh, unsigned int events)
+{
+	sh->wake_time = sh->transfer.deadline;
+	SHELL_WAIT (events | SHELL_EVENT_TIMER)
+}
+
+// Send ACK or NAK, and a sequence number
+static void shell_transfer_reply (t_shell_state *sh, char code, unsigned char seq)
+{
+	char reply[2] = { code, seq };
+	shell_tx_write (sh, reply, 2);
+}
+
+// End the command : tell the other side if it's an error, and drop whatever it still sends
+static void shell_transfer_close (t_shell_state *sh, char *error)
+{
+	if (error != 0)
+	{
+		shell_tx_write (sh, "\x18\x18", 2);
+		sprintf (sh->output, "\r\ntransfer aborted : %s", error);
+		sh->error = 1;
+	}
+	shell_rx_read (sh, 0, shell_rx_count (sh));
+	COMMAND_LAST_LINE
+}
+
+// ========= Download =======================================================================
+
+// One step of a download, once the receiver has started it. Packet n (from 0) has sequence number n + 1, and the last
+// one (packets - 1) is the end of transmission.
+static void shell_transfer_send (t_shell_state *sh)
+{
+	t_shell_transfer *t = &sh->transfer;
+
+	if (t->stage == 1)	// The header of packet "next" is queued : send its data from the region, then its CRC
+	{
+		char *data = t->data + (unsigned long) t->next * SHELL_TRANSFER_BLOCK;
+		if (shell_tx_direct (sh, data, t->size) == 0)
+		{
+			SHELL_WAIT (SHELL_EVENT_TX)	// The header (and whatever was queued before it) isn't out yet
+			return;
+		}
+		unsigned short crc = shell_crc16 (0, data, t->size);	// Computed while the data is being sent
+		char trailer[2] = { crc >> 8, crc };
+		shell_tx_write (sh, trailer, 2);	// Sent after the data
+		t->stage = 0;
+		t->next++;
+		return;
+	}
+
+	// Acknowledgements
+	char c;
+	while (shell_rx_read (sh, &c, 1) == 1)
+	{
+		if (shell_transfer_cancelled (t, c))
+		{
+			shell_transfer_close (sh, "cancelled by the receiver");
+			return;
+		}
+		if (t->control == 0)
+		{
+			if ((c == SHELL_TRANSFER_ACK) || (c == SHELL_TRANSFER_NAK))
+				t->control = c;		// Its sequence number follows
+			continue;
+		}
+
+		int n = t->acked + (unsigned char) (c - (t->acked + 1));	// Packet with this sequence number, within the window
+		if (n < t->next)			// Ignore packets that haven't been sent
+		{
+			if (t->control == SHELL_TRANSFER_ACK)
+			{
+				t->acked = n + 1;
+				t->retries = 0;
+			}
+			else
+			{
+				t->acked = t->next = n;		// Go back to the packet rejected
+				if (++t->retries > SHELL_TRANSFER_RETRIES)
+				{
+					shell_transfer_close (sh, "too many errors");
+					return;
+				}
+			}
+			t->deadline = shell_ticks () + SHELL_TRANSFER_TIMEOUT;
+		}
+		t->control = 0;
+	}
+
+	if (t->acked == t->packets)		// Everything has been received, end of transmission included
+	{
+		sprintf (sh->output, "\r\n%lu bytes sent", t->length);
+		shell_transfer_close (sh, 0);
+		return;
+	}
+
+	if ((t->acked < t->next) && shell_transfer_expired (t))	// Nothing acknowledged for a while : go back
+	{
+		if (++t->retries > SHELL_TRANSFER_RETRIES)
+		{
+			shell_transfer_close (sh, "timed out");
+			return;
+		}
+		t->next = t->acked;
+		t->deadline = shell_ticks () + SHELL_TRANSFER_TIMEOUT;
+	}
+
+	// Send the next packet if the window allows it
+	if ((t->next < t->packets) && (t->next < t->acked + SHELL_TRANSFER_WINDOW))
+	{
+		if (shell_tx_free (sh) < 5)
+		{
+			SHELL_WAIT (SHELL_EVENT_TX)
+			return;
+		}
+		if (t->acked == t->next)	// The window was empty : the timeout runs from now
+			t->deadline = shell_ticks () + SHELL_TRANSFER_TIMEOUT;
+
+		unsigned char seq = t->next + 1;
+		if (t->next == t->packets - 1)
+		{
+			char eot[3] = { SHELL_TRANSFER_EOT, seq, ~seq };
+			shell_tx_write (sh, eot, 3);
+			t->next++;
+			return;
+		}
+
+		unsigned long offset = (unsigned long) t->next * SHELL_TRANSFER_BLOCK;
+		t->size = (t->length - offset > SHELL_TRANSFER_BLOCK) ? SHELL_TRANSFER_BLOCK : t->length - offset;
+		char header[5] = { SHELL_TRANSFER_STX, seq, ~seq, t->size, t->size >> 8 };
+		shell_tx_write (sh, header, 5);
+		t->stage = 1;
+		return;
+	}
+
+	shell_transfer_wait (sh, SHELL_EVENT_RX);
+}
+
+// Send a memory region ("download <region> [offset] [length]")
+void command_native_download (t_shell_state *sh)
+{
+	t_shell_transfer *t = &sh->transfer;
+	char c;
+
+	switch (sh->command_state)
+	{
+		case 0:
+			if (shell_transfer_open (sh, 0) != 0)
+			{
+				COMMAND_FAIL
+				return;
+			}
+			t->packets = (t->length + SHELL_TRANSFER_BLOCK - 1) / SHELL_TRANSFER_BLOCK + 1;	// Data, then end of transmission
+			sprintf (sh->output, "\r\nsending %lu bytes, start the receiver", t->length);
+			sh->command_state = 1;
+			sh->fp = shell_state_output;
+			break;
+		case 1:		// Wait for the receiver's 'C'
+			while (shell_rx_read (sh, &c, 1) == 1)
+			{
+				if (shell_transfer_cancelled (t, c))
+				{
+					shell_transfer_close (sh, "cancelled by the receiver");
+					return;
+				}
+				if (c == 'C')
+				{
+					sh->command_state = 2;
+					t->retries = 0;
+					return;
+				}
+			}
+			if (shell_transfer_expired (t))
+			{
+				if (++t->retries > SHELL_TRANSFER_RETRIES)
+				{
+					shell_transfer_close (sh, "no receiver");
+					return;
+				}
+				t->deadline = shell_ticks () + SHELL_TRANSFER_TIMEOUT;
+			}
+			shell_transfer_wait (sh, SHELL_EVENT_RX);
+			break;
+		case 2:
+			shell_transfer_send (sh);
+			break;
+	}
+}
+
+// ========= Upload =========================================================================
+
+// Process the bytes received. Returns 1 if there may be more to do right away, 0 to wait for more bytes, -1 if the
+// command is over.
+static int shell_transfer_receive (t_shell_state *sh)
+{
+	t_shell_transfer *t = &sh->transfer;
+	char buff[4];
+
+	switch (t->stage)
+	{
+		case 0:		// Start of a packet
+			if (shell_rx_read (sh, buff, 1) == 0)
+				return 0;
+			if (shell_transfer_cancelled (t, buff[0]))
+			{
+				shell_transfer_close (sh, "cancelled by the sender");
+				return -1;
+			}
+			if ((buff[0] == SHELL_TRANSFER_STX) || (buff[0] == SHELL_TRANSFER_EOT))
+			{
+				t->size = buff[0];		// Remember the packet type until the header is complete
+				t->stage = 1;
+			}
+			return 1;		// Anything else is noise
+
+		case 1:		// Header : sequence number, its complement, and the data length (data packets only)
+		{
+			int eot = (t->size == SHELL_TRANSFER_EOT);
+			if (shell_rx_count (sh) < (eot ? 2 : 4))
+				return 0;
+			if (shell_tx_free (sh) < 2)		// Room to answer
+				return 0;
+			shell_rx_read (sh, buff, eot ? 2 : 4);
+			t->started = 1;
+			t->stage = 0;
+
+			unsigned char seq = buff[0];
+			int size = eot ? 0 : (unsigned char) buff[2] | (unsigned char) buff[3] << 8;
+			if (((unsigned char) (buff[0] ^ buff[1]) != 0xFF) || (size > SHELL_TRANSFER_BLOCK) || ((eot == 0) && (size == 0)))
+			{
+				shell_transfer_reply (sh, SHELL_TRANSFER_NAK, t->seq);		// Corrupted header
+				t->control = 1;
+				return 1;
+			}
+
+			if (seq != t->seq)		// Not the packet expected : skip it
+			{
+				if (seq == (unsigned char) (t->seq - 1))
+					shell_transfer_reply (sh, SHELL_TRANSFER_ACK, seq);	// Sent again : the acknowledgement was lost
+				else if (t->control == 0)
+				{
+					shell_transfer_reply (sh, SHELL_TRANSFER_NAK, t->seq);	// Sent after a lost packet, ask for it once
+					t->control = 1;
+				}
+				t->count = eot ? 0 : size + 2;
+				t->stage = 3;
+				return 1;
+			}
+
+			if (eot)
+			{
+				shell_transfer_reply (sh, SHELL_TRANSFER_ACK, seq);
+				sprintf (sh->output, "\r\n%lu bytes received", t->done);
+				shell_transfer_close (sh, 0);
+				return -1;
+			}
+			if ((unsigned long) size > t->length - t->done)
+			{
+				shell_transfer_close (sh, "region full");
+				return -1;
+			}
+			t->size = t->count = size;
+			t->crc = 0;
+			t->stage = 2;
+			return 1;
+		}
+
+		case 2:		// Data, straight from the ring to the region
+		{
+			char *p = t->data + t->done + (t->size - t->count);
+			int n = shell_rx_read (sh, p, t->count);
+			if (n == 0)
+				return 0;
+			t->crc = shell_crc16 (t->crc, p, n);
+			t->count -= n;
+			if (t->count == 0)
+				t->stage = 4;
+			return 1;
+		}
+
+		case 3:		// Skip the rest of a packet
+			t->count -= shell_rx_read (sh, 0, t->count);
+			if (t->count != 0)
+				return 0;
+			t->stage = 0;
+			return 1;
+
+		case 4:		// CRC
+			if ((shell_rx_count (sh) < 2) || (shell_tx_free (sh) < 2))
+				return 0;
+			shell_rx_read (sh, buff, 2);
+			t->stage = 0;
+			t->deadline = shell_ticks () + SHELL_TRANSFER_TIMEOUT;
+			if ((unsigned short) ((unsigned char) buff[0] << 8 | (unsigned char) buff[1]) != t->crc)
+			{
+				shell_transfer_reply (sh, SHELL_TRANSFER_NAK, t->seq);
+				t->control = 1;
+				return 1;
+			}
+			t->done += t->size;
+			shell_transfer_reply (sh, SHELL_TRANSFER_ACK, t->seq++);
+			t->control = 0;		// NAK sent for the packet expected now
+			t->retries = 0;
+			return 1;
+	}
+	return 0;
+}
+
+// Receive into a memory region ("upload <region> [offset] [length]")
+void command_native_upload (t_shell_state *sh)
+{
+	t_shell_transfer *t = &sh->transfer;
+	int result;
+
+	switch (sh->command_state)
+	{
+		case 0:
+			if (shell_transfer_open (sh, 1) != 0)
+			{
+				COMMAND_FAIL
+				return;
+			}
+			t->seq = 1;
+			sprintf (sh->output, "\r\nreceiving up to %lu bytes, start the sender", t->length);
+			sh->command_state = 1;
+			sh->fp = shell_state_output;
+			break;
+		case 1:		// Tell the sender to start
+			shell_tx_write (sh, "C", 1);
+			t->deadline = shell_ticks () + SHELL_TRANSFER_TIMEOUT;
+			sh->command_state = 2;
+			break;
+		case 2:
+			while ((result = shell_transfer_receive (sh)) > 0)
+				;
+			if (result < 0)
+				return;
+
+			if (shell_transfer_expired (t))
+			{
+				if (++t->retries > SHELL_TRANSFER_RETRIES)
+				{
+					shell_transfer_close (sh, "timed out");
+					return;
+				}
+				if (t->started == 0)
+					shell_tx_write (sh, "C", 1);	// The sender may have missed it
+				else
+					shell_transfer_reply (sh, SHELL_TRANSFER_NAK, t->seq);
+				t->deadline = shell_ticks () + SHELL_TRANSFER_TIMEOUT;
+			}
+			shell_transfer_wait (sh, (shell_tx_free (sh) < 2) ? SHELL_EVENT_RX | SHELL_EVENT_TX : SHELL_EVENT_RX);
+			break;
+	}
+}
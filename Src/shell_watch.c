@@ -0,0 +1,241 @@
+/*
+ *  shell_watch.c
+ *
+ *  "watch <period> <command>" : run a command periodically and update its output in place. The command is looked up
+ *  once, its output is captured and compared with the previous run's, and only the parts that changed are sent, with
+ *  ANSI cursor movements. Any key stops the watch.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shell.h"
+
+#include <string.h>
+#include <stdio.h>
+
+// Stages of shell_state_watch
+#define SHELL_WATCH_RUN			0		// Start a run of the command
+#define SHELL_WATCH_COMPARE		1		// Compare its output with the previous one, a line per step
+#define SHELL_WATCH_SLEEP		2		// Wait for the next run, or for a key
+
+// Lines are compared and drawn one at a time : each step needs room for a line and the escape sequences around it.
+// Longer lines are cut.
+#define SHELL_WATCH_LINE		(SHELL_BUFFER_SIZE - 1)
+#define SHELL_WATCH_ROOM		(SHELL_WATCH_LINE + 32)
+
+// Start the watch ("watch <period> <command>"). The words of the command were split by the parser : put the line back
+// together, then look the command up.
+void command_native_watch (t_shell_state *sh)
+{
+	t_shell_watch *w = &sh->watch;
+
+	shell_join (sh, 2, w->line, sizeof (w->line));
+	strcpy (sh->input, w->line);
+	const t_shell_block_entry *match = 0;
+	if ((shell_command_find (sh, strcspn (sh->input, " "), &match) != SHELL_MATCH_FOUND) || (match->fp == 0))
+		sprintf (sh->output, "\r\n%.64s : no such command", sh->argv[2]);
+	else if ((match->fp == command_native_watch) || (match->fp == command_native_download) || (match->fp == command_native_upload))
+		sprintf (sh->output, "\r\n%.64s : can't be watched", sh->argv[2]);
+	else if ((sh->binary != 0) || (sh->arg[1].i <= 0))
+		sprintf (sh->output, "\r\nwatch : %s", (sh->binary != 0) ? "not available in binary mode" : "invalid period");
+	else
+	{
+		w->entry = match;
+		w->period = sh->arg[1].i;
+		w->next = shell_ticks ();
+		w->shadow_len = w->shadow_lines = 0;
+		w->cursor = -1;
+		w->cursor_col = 0;
+		w->runs = w->sent = w->full = 0;
+		w->stage = SHELL_WATCH_RUN;
+		sh->command_fp = 0;
+		sh->fp = shell_state_watch;
+		return;
+	}
+	COMMAND_FAIL
+}
+
+// Returns the next line of an output, from *pos, and its length (carriage returns excluded), or -1 after the last line.
+// Lines are separated by line feeds. The line feed commands print first doesn't start an empty line.
+static int shell_watch_line (char *buff, int length, int *pos, char **line)
+{
+	if ((*pos == 0) && (length >= 2) && (buff[0] == '\r') && (buff[1] == '\n'))
+		*pos = 2;
+	else if ((*pos == 0) && (length >= 1) && (buff[0] == '\n'))
+		*pos = 1;
+	if (*pos >= length)
+		return -1;
+
+	char *start = buff + *pos;
+	char *lf = memchr (start, '\n', length - *pos);
+	int len = (lf != 0) ? lf - start : length - *pos;
+	*pos += len + ((lf != 0) ? 1 : 0);
+
+	while ((len > 0) && (start[len - 1] == '\r'))
+		len--;
+	*line = start;
+	return (len > SHELL_WATCH_LINE) ? SHELL_WATCH_LINE : len;
+}
+
+// Append the cursor movement from the current line to another one to buff. Returns the number of bytes appended.
+static int shell_watch_move (t_shell_watch *w, char *buff, int row)
+{
+	int len = 0;
+	if (row < w->cursor)
+		len = sprintf (buff, "\x1b[%dA", w->cursor - row);
+	else if (row > w->cursor)
+		len = sprintf (buff, "\x1b[%dB", row - w->cursor);
+	w->cursor = row;
+	return len;
+}
+
+// Compare a line of the current output with the same line of the previous one, and queue what it takes to update it.
+// Returns zero once every line has been compared.
+static int shell_watch_compare (t_shell_state *sh)
+{
+	t_shell_watch *w = &sh->watch;
+	char buff[SHELL_WATCH_ROOM];
+	char *old = 0, *new = 0;
+	int len = 0;
+	int more = 1;
+
+	int olen = shell_watch_line (w->shadow, w->shadow_len, &w->shadow_pos, &old);
+	int nlen = shell_watch_line (w->output, w->output_len, &w->output_pos, &new);
+
+	if ((nlen < 0) && (olen < 0))		// Done : leave the cursor at the end of the last line
+	{
+		len = shell_watch_move (w, buff, w->row - 1);
+		if (w->row > 0)
+			len += sprintf (buff + len, "\x1b[%dG", w->cursor_col + 1);
+		w->shadow_lines = w->row;
+		more = 0;
+	}
+	else if (nlen < 0)		// The output is shorter than the previous one : erase the lines left
+	{
+		len = shell_watch_move (w, buff, w->row);
+		len += sprintf (buff + len, "\r\x1b[J");
+		w->shadow_pos = w->shadow_len;
+	}
+	else if (olen < 0)		// New line : print it below the last one
+	{
+		len = shell_watch_move (w, buff, w->row - 1);
+		len += sprintf (buff + len, "\r\n");
+		memcpy (buff + len, new, nlen);
+		len += nlen;
+		w->cursor = w->row++;
+		w->cursor_col = nlen;
+	}
+	else	// Same line in both : only send the part that changed, from the first difference to the last one
+	{
+		int first = 0;
+		while ((first < olen) && (first < nlen) && (old[first] == new[first]))
+			first++;
+		int last = nlen;		// End of the part to send
+		if (olen == nlen)
+			while ((last > first) && (old[last - 1] == new[last - 1]))
+				last--;
+
+		if ((first < last) || (nlen < olen))
+		{
+			len = shell_watch_move (w, buff, w->row);
+			len += sprintf (buff + len, "\x1b[%dG", first + 1);
+			memcpy (buff + len, new + first, last - first);
+			len += last - first;
+			if (nlen < olen)
+				len += sprintf (buff + len, "\x1b[K");
+		}
+		w->row++;
+		w->cursor_col = nlen;
+	}
+
+	if (len > 0)
+	{
+		shell_tx_write (sh, buff, len);
+		w->sent += len;
+	}
+	return more;
+}
+
+// Run the watched command periodically. Its output is captured, then compared with the previous one line by line, so a
+// run that changes a single field only costs a few bytes. Every run starts from the command line as typed : the command
+// may modify its input buffer, and its arguments are converted again.
+void shell_state_watch (t_shell_state *sh)
+{
+	t_shell_watch *w = &sh->watch;
+
+	switch (w->stage)
+	{
+		case SHELL_WATCH_RUN:
+			strcpy (sh->input, w->line);
+			sh->argc = 0;
+			if ((w->entry->args != 0) && (shell_arguments (sh, w->entry) != 0))
+			{
+				w->entry = 0;		// Invalid arguments : print the error message instead
+				COMMAND_FAIL
+				return;
+			}
+			sh->capture = w->output;
+			sh->capture_size = SHELL_WATCH_SIZE;
+			sh->capture_len = sh->capture_lost = 0;
+			w->stage = SHELL_WATCH_COMPARE;
+			w->row = w->shadow_pos = w->output_pos = -1;	// Not started
+			shell_command_start (sh, w->entry->fp);		// The output state brings the watch back when the run is over
+			return;
+
+		case SHELL_WATCH_COMPARE:
+			if (w->row < 0)		// The run is over : stop capturing
+			{
+				w->output_len = sh->capture_len;
+				sh->capture = 0;
+				w->runs++;
+				w->full += w->output_len;
+				w->row = w->shadow_pos = w->output_pos = 0;
+			}
+			while (shell_tx_free (sh) >= SHELL_WATCH_ROOM)
+				if (shell_watch_compare (sh) == 0)
+				{
+					memcpy (w->shadow, w->output, w->output_len);
+					w->shadow_len = w->output_len;
+					w->next += w->period;
+					if ((long) (shell_ticks () - w->next) >= 0)
+						w->next = shell_ticks () + w->period;	// Late (slow command, or a busy link) : skip the missed runs
+					w->stage = SHELL_WATCH_SLEEP;
+					break;
+				}
+			if (w->stage == SHELL_WATCH_COMPARE)
+			{
+				SHELL_WAIT (SHELL_EVENT_TX)
+				return;
+			}
+			// Fall through
+
+		case SHELL_WATCH_SLEEP:
+			if (shell_rx_count (sh) > 0)	// Any key stops the watch
+			{
+				shell_rx_read (sh, 0, shell_rx_count (sh));
+				w->entry = 0;
+				sprintf (sh->output, "\r\nwatch : %lu runs, %lu bytes sent, %lu without deltas", w->runs, w->sent, w->full);
+				COMMAND_LAST_LINE
+				return;
+			}
+			if ((long) (shell_ticks () - w->next) >= 0)
+			{
+				w->stage = SHELL_WATCH_RUN;
+				return;
+			}
+			sh->wake_time = w->next;
+			SHELL_WAIT (SHELL_EVENT_RX | SHELL_EVENT_TIMER)
+			return;
+	}
+}
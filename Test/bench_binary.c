@@ -0,0 +1,159 @@
+/*
+ *  bench_binary.c
+ *
+ *  Benchmark of binary mode against the text shell, for scripted use : the same commands are sent as typed lines, then
+ *  as binary requests, as fast as the shell takes them. Prints CSV ("metric,value,unit") : commands per second, and
+ *  bytes per command in each direction. Exits non-zero if a command gets the wrong arguments or a response is missing.
+ *
+ *    shell_bench_binary [-q]
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "harness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static volatile unsigned long bench_runs;		// Number of runs of the benchmark commands
+static volatile unsigned long bench_errors;		// Number of runs with unexpected arguments
+static volatile unsigned long bench_frames;		// Number of zero bytes (frame delimiters) in the output
+
+static SHELL_COMMAND (command_nop)
+{
+	bench_runs++;
+	COMMAND_END
+}
+
+// Always called with "12 0x1f on" : anything else is a decoding error
+static SHELL_COMMAND (command_args)
+{
+	bench_runs++;
+	if ((sh->argc != 4) || (sh->arg[1].i != 12) || (sh->arg[2].x != 0x1f) || (sh->arg[3].e != 0))
+		bench_errors++;
+	sprintf (sh->output, "\r\n%ld", sh->arg[1].i + (long) sh->arg[2].x);
+	COMMAND_LAST_LINE
+}
+
+SHELL_BLOCK (root_block, "bench",
+	SHELL_CMD ("nop", command_nop),
+	SHELL_CMD ("args <n> <x> <on|off>", command_args, "ix{on|off}"));
+
+// The output is read by the harness's thread : count the frames of the responses
+static void bench_output (const char *buff, int length)
+{
+	for (int i = 0; i < length; i++)
+		if (buff[i] == 0)
+			bench_frames++;
+}
+
+// COBS-encode a request (sequence number, command ID, arguments, CRC), delimiter included. Returns its length.
+static int bench_request (char *out, int sequence, int id, const char *args, int length)
+{
+	char frame[SHELL_FRAME_SIZE];
+	int len = 0;
+	frame[len++] = sequence;
+	frame[len++] = id;
+	frame[len++] = id >> 8;
+	memcpy (frame + len, args, length);
+	len += length;
+	unsigned short crc = shell_crc16 (0xFFFF, frame, len);
+	frame[len++] = crc;
+	frame[len++] = crc >> 8;
+
+	int o = 1, code = 0;		// Position of the code of the current block, which counts its bytes
+	for (int i = 0; i < len; i++)
+	{
+		if (frame[i] != 0)
+			out[o++] = frame[i];
+		if ((frame[i] == 0) || (o - code == 0xFF))
+		{
+			out[code] = o - code;
+			code = o++;
+		}
+	}
+	out[code] = o - code;
+	out[o++] = 0;
+	return o;
+}
+
+// Send n copies of a stream as fast as the shell takes them, and report the rate and the bytes per command
+static int bench_stream (const char *name, const char *one, int length, int n)
+{
+	char *stream = malloc (length * n);
+	for (int i = 0; i < n; i++)
+		memcpy (stream + i * length, one, length);
+
+	unsigned long runs = bench_runs;
+	unsigned long sent = harness_port.tx_bytes;
+	unsigned long start = shell_cycles ();
+	harness_feed (stream, length * n);
+	harness_settle ();		// Rather than waiting for n runs : a rejected request would never run
+	unsigned long elapsed = shell_cycles () - start;
+	free (stream);
+
+	printf ("%s_rate,%.0f,commands/s\n", name, n * 1e9 / elapsed);
+	printf ("%s_input,%d,bytes/command\n", name, length);
+	printf ("%s_output,%lu,bytes/command\n", name, (harness_port.tx_bytes - sent) / n);
+	if (bench_runs - runs == (unsigned long) n)
+		return 0;
+	fprintf (stderr, "%s : %lu runs out of %d\n", name, bench_runs - runs, n);
+	return -1;
+}
+
+// Wait for the drain thread to have seen a number of frames
+static int bench_frames_wait (unsigned long frames)
+{
+	unsigned long start = shell_ticks ();
+	while (bench_frames < frames)
+		if (shell_ticks () - start > 5000)
+		{
+			fprintf (stderr, "%lu responses out of %lu\n", bench_frames, frames);
+			return -1;
+		}
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	int quick = (argc > 1) && (strcmp (argv[1], "-q") == 0);
+	int n = quick ? 1000 : 200000;
+	int errors = 0;
+
+	if (harness_open ("shell_bench_binary", bench_output, 1) != 0)
+		return 1;
+
+	printf ("metric,value,unit\n");
+	errors += bench_stream ("text_nop", "nop\r", 4, n);
+	errors += bench_stream ("text_args", "args 12 0x1f on\r", 16, n);
+
+	// Switch to binary mode : the shell answers with a delimiter
+	harness_feed (SHELL_BINARY_ESCAPE, SHELL_BINARY_ESCAPE_LEN);
+	harness_settle ();
+	errors += bench_frames_wait (1);
+
+	// Command IDs : root_block's position in the index, and the entries' positions in the block
+	int block = shell_index_number (root_block) << 8;
+	char nop[16], args[32];
+	int nop_len = bench_request (nop, 1, block | 1, "", 0);
+	int args_len = bench_request (args, 2, block | 2, "\x0c\0\0\0\x1f\0\0\0\0", 9);
+	errors += bench_stream ("binary_nop", nop, nop_len, n);
+	errors += bench_stream ("binary_args", args, args_len, n);
+	errors += bench_frames_wait (1 + 2 * (unsigned long) n);
+
+	if (bench_errors != 0)
+		fprintf (stderr, "%lu commands got the wrong arguments\n", bench_errors);
+	return (errors != 0) || (bench_errors != 0) || (harness_errors != 0);
+}
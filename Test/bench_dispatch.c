@@ -0,0 +1,148 @@
+/*
+ *  bench_dispatch.c
+ *
+ *  Benchmark of command word lookups, for blocks of 10, 100 and 1000 entries. Prints CSV : lookups per second with the
+ *  dispatch index, with the linear search used for blocks that aren't indexed (same results : exact and unique-prefix
+ *  matches, ambiguities reported), and with the first-match strncmp scan the parser used before the index.
+ *
+ *    shell_bench_dispatch [-q]
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shell.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (SHELL_INDEX_ENTRIES < 1200)
+#error "Build with SHELL_INDEX_ENTRIES large enough to index every block of the benchmark"
+#endif
+
+#define BENCH_BLOCKS			3
+#define BENCH_WORD				8		// Length of the command words
+
+static const int bench_sizes[BENCH_BLOCKS] = { 10, 100, 1000 };
+
+static SHELL_COMMAND (command_nop)
+{
+	COMMAND_END
+}
+
+// Filled at run time, before the index is built
+static t_shell_block_entry bench_block[BENCH_BLOCKS][1000 + 1];
+static char bench_labels[BENCH_BLOCKS][1000][BENCH_WORD + 8];
+
+SHELL_BLOCK (root_block, "bench",
+	SHELL_SUB ("b10", bench_block[0]),
+	SHELL_SUB ("b100", bench_block[1]),
+	SHELL_SUB ("b1000", bench_block[2]));
+
+// The parser's scan before the dispatch index : the first entry the command word is a prefix of
+static const t_shell_block_entry *bench_first_match (const t_shell_block_entry *block, char *word, int wlen)
+{
+	for (int k = 1; k <= BLOCK_COUNT (block); k++)
+		if (strncmp (word, block[k].label, wlen) == 0)
+			return &block[k];
+	return 0;
+}
+
+static unsigned long bench_seed = 1;
+
+static int bench_random (int n)
+{
+	bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (int) ((bench_seed >> 33) % n);
+}
+
+int main (int argc, char **argv)
+{
+	int quick = (argc > 1) && (strcmp (argv[1], "-q") == 0);
+	long total = quick ? 20000 : 5000000;		// Lookups per measure
+
+	// Random words, distinct within a block
+	for (int b = 0; b < BENCH_BLOCKS; b++)
+	{
+		bench_block[b][0].label = "block";
+		bench_block[b][0].fp = BLOCK_LEN (long) bench_sizes[b];
+		for (int k = 1; k <= bench_sizes[b]; k++)
+		{
+			char *label = bench_labels[b][k - 1];
+			int unique;
+			do
+			{
+				for (int i = 0; i < BENCH_WORD; i++)
+					label[i] = 'a' + bench_random (26);
+				strcpy (label + BENCH_WORD, " <arg>");
+				unique = 1;
+				for (int j = 1; j < k; j++)
+					if (strncmp (label, bench_block[b][j].label, BENCH_WORD) == 0)
+						unique = 0;
+			} while (unique == 0);
+			bench_block[b][k].label = label;
+			bench_block[b][k].fp = command_nop;
+		}
+	}
+	shell_index_build ();
+
+	printf ("entries,method,lookups_per_sec\n");
+	for (int b = 0; b < BENCH_BLOCKS; b++)
+	{
+		const t_shell_block_entry *block = bench_block[b];
+		t_shell_index *index = shell_index_find (block);
+		int n = bench_sizes[b];
+		if (index == 0)
+		{
+			fprintf (stderr, "block of %d entries not indexed\n", n);
+			return 1;
+		}
+
+		// Words to look up, in random order
+		char (*words)[BENCH_WORD + 1] = malloc (total * sizeof (*words));
+		int *expected = malloc (total * sizeof (int));
+		for (long i = 0; i < total; i++)
+		{
+			expected[i] = 1 + bench_random (n);
+			memcpy (words[i], block[expected[i]].label, BENCH_WORD);
+			words[i][BENCH_WORD] = 0;
+		}
+
+		for (int method = 0; method < 3; method++)
+		{
+			static const char *names[] = { "index", "linear", "first_match" };
+			unsigned long start = shell_cycles ();
+			long errors = 0;
+			for (long i = 0; i < total; i++)
+			{
+				const t_shell_block_entry *match = 0;
+				if (method == 2)
+					match = bench_first_match (block, words[i], BENCH_WORD);
+				else if (shell_index_lookup ((method == 0) ? index : 0, block, words[i], BENCH_WORD, &match) != SHELL_MATCH_FOUND)
+					match = 0;
+				errors += (match != &block[expected[i]]);
+			}
+			unsigned long elapsed = shell_cycles () - start;
+			if (errors != 0)
+			{
+				fprintf (stderr, "%s : %ld wrong matches in a block of %d entries\n", names[method], errors, n);
+				return 1;
+			}
+			printf ("%d,%s,%.0f\n", n, names[method], total * 1e9 / elapsed);
+		}
+		free (words);
+		free (expected);
+	}
+	return 0;
+}
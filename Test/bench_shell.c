@@ -0,0 +1,228 @@
+/*
+ *  bench_shell.c
+ *
+ *  Benchmark driver for the POSIX port : runs the default instance on a pair of pipes, replays keystroke streams and
+ *  prints CSV ("metric,value,unit") to stdout, so results can be compared from one build to the next.
+ *
+ *    shell_bench [-q] [script]
+ *
+ *  -q runs fewer iterations (a smoke test). A script file, if given, is replayed as a keystroke stream as well.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "harness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_BIG_ENTRIES		1000	// Entries of the block "ls" lists
+
+static volatile unsigned long bench_runs;	// Number of runs of the benchmark commands...
+static volatile unsigned long bench_time;	// ... and shell_cycles () when the last one started
+
+static SHELL_COMMAND (command_nop)
+{
+	bench_time = shell_cycles ();
+	bench_runs++;
+	COMMAND_END
+}
+
+// Filled at run time, before the instance is initialized (and the block indexed)
+static t_shell_block_entry big_block[BENCH_BIG_ENTRIES + 1];
+static char big_labels[BENCH_BIG_ENTRIES][32];
+
+SHELL_BLOCK (root_block, "bench",
+	SHELL_CMD ("nop", command_nop),
+	SHELL_CMD ("args <n> <x> <on|off>", command_nop, "ix{on|off}"),
+	SHELL_SUB ("big", big_block));
+
+static int bench_compare (const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+	return (x > y) - (x < y);
+}
+
+// Print the average, median, 99th percentile and maximum of a set of latencies (nanoseconds)
+static void bench_report (const char *name, unsigned long *samples, int n)
+{
+	unsigned long long sum = 0;
+	for (int i = 0; i < n; i++)
+		sum += samples[i];
+	qsort (samples, n, sizeof (samples[0]), bench_compare);
+	printf ("%s_avg,%llu,ns\n", name, sum / n);
+	printf ("%s_p50,%lu,ns\n", name, samples[n / 2]);
+	printf ("%s_p99,%lu,ns\n", name, samples[n * 99 / 100]);
+	printf ("%s_max,%lu,ns\n", name, samples[n - 1]);
+}
+
+// Keystroke to echo : from the byte being written to the pipe to the echo being written by the port
+static void bench_echo (unsigned long *samples, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		if ((i % 64) == 0)
+		{
+			harness_feed ("\x15", 1);		// Ctrl-U : start over before the line is full
+			harness_settle ();
+		}
+		unsigned long sent = harness_port.tx_bytes;
+		unsigned long start = shell_cycles ();
+		harness_feed ("a", 1);
+		HARNESS_UNTIL (harness_port.tx_bytes != sent)
+		samples[i] = shell_cycles () - start;
+	}
+	harness_feed ("\x15", 1);
+	harness_settle ();
+	bench_report ("echo_latency", samples, n);
+}
+
+// Editing keys : from the key being written to the first byte of the update being written by the port. The line is
+// typed first (unmeasured), and dropped afterwards, with an empty line to leave the history where it was.
+static void bench_key (const char *name, const char *setup, const char *key, unsigned long *samples, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		harness_feed (setup, strlen (setup));
+		harness_settle ();
+		unsigned long sent = harness_port.tx_bytes;
+		unsigned long start = shell_cycles ();
+		harness_feed (key, strlen (key));
+		HARNESS_UNTIL (harness_port.tx_bytes != sent)
+		samples[i] = shell_cycles () - start;
+		harness_feed ("\x15\r", 2);
+		harness_settle ();
+	}
+	bench_report (name, samples, n);
+}
+
+// Dispatch : from the carriage return being written to the command function being called
+static void bench_dispatch (const char *name, const char *line, unsigned long *samples, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		harness_feed (line, strlen (line));
+		harness_settle ();
+		unsigned long runs = bench_runs;
+		unsigned long start = shell_cycles ();
+		harness_feed ("\r", 1);
+		HARNESS_UNTIL (bench_runs != runs)
+		samples[i] = bench_time - start;
+		harness_settle ();
+	}
+	bench_report (name, samples, n);
+}
+
+// Commands per second : a stream of command lines, as fast as the shell takes them
+static void bench_throughput (const char *name, const char *line, int n)
+{
+	int length = strlen (line);
+	char *stream = malloc (length * n);
+	for (int i = 0; i < n; i++)
+		memcpy (stream + i * length, line, length);
+
+	unsigned long runs = bench_runs;
+	unsigned long start = shell_cycles ();
+	harness_feed (stream, length * n);
+	HARNESS_UNTIL (bench_runs - runs >= (unsigned long) n)
+	unsigned long elapsed = shell_cycles () - start;
+	harness_settle ();
+	free (stream);
+	printf ("%s,%.0f,commands/s\n", name, n * 1e9 / elapsed);
+}
+
+// Output rate of "ls" on a large block
+static void bench_list (int n)
+{
+	harness_feed ("cd big\r", 7);
+	harness_settle ();
+	unsigned long sent = harness_port.tx_bytes;
+	unsigned long start = shell_cycles ();
+	for (int i = 0; i < n; i++)
+	{
+		harness_feed ("ls\r", 3);
+		harness_settle ();
+	}
+	unsigned long elapsed = shell_cycles () - start;
+	printf ("ls_bytes,%lu,bytes\n", (harness_port.tx_bytes - sent) / n);
+	printf ("ls_rate,%.0f,bytes/s\n", (harness_port.tx_bytes - sent) * 1e9 / elapsed);
+	harness_feed ("cd..\r", 5);
+	harness_settle ();
+}
+
+// Replay a script file as a keystroke stream
+static int bench_replay (const char *file)
+{
+	FILE *f = fopen (file, "rb");
+	if (f == 0)
+	{
+		perror (file);
+		return -1;
+	}
+	static char stream[1 << 20];
+	int length = fread (stream, 1, sizeof (stream), f);
+	fclose (f);
+
+	unsigned long received = harness_port.rx_bytes;
+	unsigned long sent = harness_port.tx_bytes;
+	unsigned long start = shell_cycles ();
+	harness_feed (stream, length);
+	harness_settle ();
+	unsigned long elapsed = shell_cycles () - start;
+	printf ("replay_input,%lu,bytes\n", harness_port.rx_bytes - received);
+	printf ("replay_output,%lu,bytes\n", harness_port.tx_bytes - sent);
+	printf ("replay_rate,%.0f,bytes/s\n", (harness_port.rx_bytes - received) * 1e9 / elapsed);
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	int quick = (argc > 1) && (strcmp (argv[1], "-q") == 0);
+	char *script = (argc > 1 + quick) ? argv[1 + quick] : 0;
+	int n = quick ? 200 : 20000;
+
+	big_block[0].label = "big";
+	big_block[0].fp = BLOCK_LEN BENCH_BIG_ENTRIES;
+	for (int i = 0; i < BENCH_BIG_ENTRIES; i++)
+	{
+		snprintf (big_labels[i], sizeof (big_labels[i]), "command%04d <argument>", i);
+		big_block[i + 1].label = big_labels[i];
+		big_block[i + 1].fp = command_nop;
+	}
+
+	if (harness_open ("shell_bench", 0, 1) != 0)		// The output is thrown away by a thread
+		return 1;
+
+	unsigned long *samples = malloc (n * sizeof (unsigned long));
+	printf ("metric,value,unit\n");
+	bench_echo (samples, n);
+	bench_dispatch ("dispatch_latency", "nop", samples, n);
+	bench_dispatch ("dispatch_args_latency", "args 12 0x1f on", samples, n);
+	bench_key ("key_insert_latency", "args 12 0x1f on\x1b[H", "a", samples, n);
+	bench_key ("key_left_latency", "args 12 0x1f on", "\x1b[D", samples, n);
+	bench_key ("key_home_latency", "args 12 0x1f on", "\x1b[H", samples, n);
+	bench_key ("key_backspace_latency", "args 12 0x1f on\x1b[D\x1b[D", "\x7f", samples, n);
+	bench_key ("key_history_latency", "", "\x1b[A", samples, n);
+	bench_key ("key_search_latency", "0x1f", "\x12", samples, n);
+	bench_key ("key_complete_latency", "ar", "\t", samples, n);
+	bench_throughput ("commands_rate", "nop\r", n * 5);
+	bench_throughput ("commands_args_rate", "args 12 0x1f on\r", n * 5);
+	bench_list (quick ? 2 : 50);
+	free (samples);
+
+	if ((script != 0) && (bench_replay (script) != 0))
+		return 1;
+	return (harness_errors != 0);
+}
@@ -0,0 +1,137 @@
+/*
+ *  bench_watch.c
+ *
+ *  Byte counts of "watch" : a status command is watched for a number of runs, in scenarios where its output changes more
+ *  or less, and the bytes sent are compared with what printing the whole output every time would take. The output goes
+ *  through a model of the terminal (cursor movements, erasures), whose screen must show the last run's output when the
+ *  watch stops. Prints CSV : scenario, runs, bytes sent, bytes without deltas, and their ratio. Exits non-zero if the
+ *  screen is wrong, or if the shell gets stuck.
+ *
+ *    shell_bench_watch [-q]
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "harness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_LINES				8		// Lines of the status command's output
+
+// Scenarios : which lines of the status output change from one run to the next
+enum { BENCH_STATIC, BENCH_COUNTER, BENCH_ALL, BENCH_GROW, BENCH_SCENARIOS };
+static const char *bench_names[BENCH_SCENARIOS] = { "static", "counter", "all", "grow" };
+
+static int bench_scenario;
+static unsigned long bench_run;			// Runs of the status command
+static char bench_lines[BENCH_LINES + 1][64];	// Its last output, line by line
+static int bench_count;					// Number of lines in it
+
+// Fill the lines of a run of the status command
+static void bench_status (void)
+{
+	unsigned long n = bench_run++;
+	bench_count = BENCH_LINES;
+	sprintf (bench_lines[0], "board      : rev C, serial 0042");
+	sprintf (bench_lines[1], "uptime     : %8lu s", (bench_scenario == BENCH_STATIC) ? 0 : n);
+	for (int i = 2; i < BENCH_LINES; i++)
+		if (bench_scenario == BENCH_ALL)
+			sprintf (bench_lines[i], "channel %d  : %5lu.%02lu V, %6lu mA", i, (n * 7 + i) % 100000, (n * 13) % 100,
+				(n * 31 + i) % 1000000);
+		else
+			sprintf (bench_lines[i], "channel %d  : %5d.%02d V, %6d mA", i, 3 + i, 30, 120 * i);
+	if ((bench_scenario == BENCH_GROW) && ((n % 4) == 3))
+		sprintf (bench_lines[bench_count++], "warning    : over temperature");
+	else if ((bench_scenario == BENCH_GROW) && ((n % 4) == 1))
+		bench_count -= 2;
+}
+
+typedef struct { int k; } t_status_context;
+
+static SHELL_COMMAND (command_status)
+{
+	t_status_context *ctx = SHELL_CONTEXT (t_status_context);
+
+	SHELL_BEGIN
+	bench_status ();
+	for (ctx->k = 0; ctx->k < bench_count; ctx->k++)
+		SHELL_YIELD_PRINTF ("\r\n%s", bench_lines[ctx->k]);
+	SHELL_END
+}
+
+SHELL_BLOCK (root_block, "bench",
+	SHELL_CMD ("status", command_status));
+
+// Check that the screen shows the last run's output, below the command line. Returns the number of errors.
+static int bench_check (int scenario, long top)
+{
+	int errors = 0;
+	for (int k = 0; k <= bench_count; k++)
+	{
+		const char *expected = (k < bench_count) ? bench_lines[k] : "";		// Nothing left below the output
+		if (harness_shows (top + 1 + k, expected, strlen (expected)) == 0)
+		{
+			if (errors++ == 0)
+				fprintf (stderr, "%s, run %lu : line %d is \"%.40s\", expected \"%s\"\n", bench_names[scenario], bench_run, k,
+					harness_line (top + 1 + k), expected);
+		}
+	}
+	return errors;
+}
+
+// Watch the status command for a number of runs, checking the screen after each of them. Returns the number of errors.
+static int bench_watch (int scenario, unsigned long runs)
+{
+	bench_scenario = scenario;
+	bench_run = 0;
+	harness_feed ("watch 1 status", 14);
+	harness_settle ();
+	long top = harness_row;		// The command line : the output is drawn below it
+	harness_feed ("\r", 1);
+
+	int errors = 0;
+	for (unsigned long run = 1; run <= runs; run++)
+	{
+		// Up to the end of the run (the watch sleeps until the next one) : its output is on the screen
+		HARNESS_UNTIL ((shell_state.watch.runs >= run) && (shell_state.fp == shell_state_watch) &&
+			(shell_state.watch.stage == 2))
+		if (harness_errors != 0)
+			break;
+		errors += bench_check (scenario, top);
+	}
+	unsigned long sent = shell_state.watch.sent;
+	unsigned long full = shell_state.watch.full;
+
+	harness_feed ("q", 1);		// Any key stops the watch
+	harness_settle ();
+	printf ("%s,%lu,%lu,%lu,%.3f\n", bench_names[scenario], runs, sent, full, (double) sent / full);
+	return errors;
+}
+
+int main (int argc, char **argv)
+{
+	int quick = (argc > 1) && (strcmp (argv[1], "-q") == 0);
+	unsigned long runs = quick ? 20 : 500;		// One per millisecond
+
+	if (harness_open ("shell_bench_watch", harness_terminal, 0) != 0)
+		return 1;
+
+	int errors = 0;
+	printf ("scenario,runs,bytes_sent,bytes_full,ratio\n");
+	for (int scenario = 0; scenario < BENCH_SCENARIOS; scenario++)
+		errors += bench_watch (scenario, runs);
+	return (errors != 0) || (harness_errors != 0);
+}
@@ -0,0 +1,155 @@
+/*
+ *  check_stats.c
+ *
+ *  Check of the statistics (SHELL_STATS) : a command runs a number of times, then "stats" must show the traffic, a row
+ *  for it with the right number of runs, and steps that add up in its histogram. After "stats reset", the counts start
+ *  over. The driver is its own port : the output is kept in a buffer, and shell_cycles is a counter that moves by a fixed
+ *  amount per call, so the durations are known. Exits non-zero if the output isn't as expected.
+ *
+ *    shell_check_stats
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shell.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_RUNS				7		// Runs of the command before "stats"
+#define CHECK_TICK				100		// Cycles counted by each call to shell_cycles
+
+static SHELL_COMMAND (command_nop)
+{
+	COMMAND_END
+}
+
+SHELL_BLOCK (root_block, "check",
+	SHELL_CMD ("nop", command_nop));
+
+// ========= Port ===========================================================================
+
+static char check_output[1 << 16];
+static int check_length;
+
+void shell_out (t_shell_state *sh, char *buff, int length)
+{
+	if (check_length + length < (int) sizeof (check_output))
+	{
+		memcpy (check_output + check_length, buff, length);
+		check_length += length;
+		check_output[check_length] = 0;
+	}
+	shell_tx_done (sh);
+}
+
+void shell_get_byte (t_shell_state *sh, char *c)
+{
+}
+
+unsigned long shell_cycles ()
+{
+	static unsigned long cycles;
+	return cycles += CHECK_TICK;
+}
+
+// ========= Checks =========================================================================
+
+static int check_errors;
+
+// Type a line, run the shell until it's back at the prompt, and return what it printed
+static char *check_run (const char *line)
+{
+	check_length = 0;
+	check_output[0] = 0;
+	shell_in_burst (&shell_state, (char *) line, strlen (line));
+	for (int i = 0; i < 1000; i++)
+		shell_poll (&shell_state);
+	if ((shell_state.fp != shell_state_idle) || (shell_state.command_fp != 0))
+	{
+		fprintf (stderr, "\"%.*s\" : the shell isn't back at the prompt\n", (int) strlen (line) - 1, line);
+		check_errors++;
+	}
+	return check_output;
+}
+
+static void check (int ok, const char *what, const char *output)
+{
+	if (!ok)
+	{
+		fprintf (stderr, "%s, in :\n%s\n", what, output);
+		check_errors++;
+	}
+}
+
+// The row of a command in the output of "stats" : runs, steps, average, maximum, and the sum of the histogram's counts.
+// Returns -1 if there's no such row.
+static int check_row (const char *output, const char *name, unsigned long *runs, unsigned long *steps, unsigned long *avg,
+	unsigned long *max, unsigned long *hist)
+{
+	char key[32];
+	int len = sprintf (key, "\r\n %-10s ", name);
+	const char *row = strstr (output, key);
+	if ((row == 0) || (sscanf (row + len, "%lu %lu %lu %lu", runs, steps, avg, max) != 4))
+		return -1;
+
+	*hist = 0;
+	const char *end = strstr (row + 2, "\r\n");
+	const char *p = row + len;
+	for (int i = 0; i < 4; i++)		// Past the four numbers
+		p += strspn (p, " "), p += strcspn (p, " ");
+	int bucket, n;
+	unsigned long count;
+	while ((end == 0 || p < end) && (sscanf (p, " %d:%lu%n", &bucket, &count, &n) == 2))
+	{
+		*hist += count;
+		p += n;
+	}
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	unsigned long runs, steps, avg, max, hist;
+	char *out;
+
+	check_run ("");		// Up to the first prompt
+
+	for (int i = 0; i < CHECK_RUNS; i++)
+		check_run ("nop\r");
+
+	out = check_run ("stats\r");
+	check (strstr (out, "\r\nrx ") != 0, "no traffic line", out);
+	check (strstr (out, "runs") != 0, "no column titles", out);
+	check (check_row (out, "nop", &runs, &steps, &avg, &max, &hist) == 0, "no row for nop", out);
+	check (runs == CHECK_RUNS, "nop : wrong number of runs", out);
+	check ((steps >= runs) && (hist == steps), "nop : the histogram doesn't add up to the steps", out);
+	check ((avg >= CHECK_TICK) && (max >= avg) && ((max % CHECK_TICK) == 0), "nop : wrong durations", out);
+	check (check_row (out, "(idle)", &runs, &steps, &avg, &max, &hist) == 0, "no row for the idle state", out);
+	check (check_row (out, "(transfer)", &runs, &steps, &avg, &max, &hist) == 0, "no row for the transfers", out);
+	check ((steps != 0) && (hist == steps), "transfers : the histogram doesn't add up to the steps", out);
+	printf ("%s\n", out);
+
+	out = check_run ("stats reset\r");
+	check (strstr (out, "statistics cleared") != 0, "stats reset : no confirmation", out);
+
+	out = check_run ("stats\r");
+	check (check_row (out, "nop", &runs, &steps, &avg, &max, &hist) != 0, "nop still counted after the reset", out);
+	check (check_row (out, "stats", &runs, &steps, &avg, &max, &hist) == 0, "no row for stats after the reset", out);
+	check (runs == 1, "stats : wrong number of runs after the reset", out);
+	printf ("%s\n", out);
+
+	return (check_errors != 0);
+}
@@ -0,0 +1,247 @@
+/*
+ *  fuzz_shell.c
+ *
+ *  Fuzz entry point : the bytes of an input are fed to the default instance as they would arrive from the link, in
+ *  bursts (shell_in_burst), with shell_poll steps in between. Everything the input can reach is reached : line editing,
+ *  the parser and argument conversions, native commands (variables, trace, macros, transfers), jobs and binary mode.
+ *  Build it with the sanitizers : each input must run without a memory error or undefined behavior.
+ *
+ *  Each input starts from the state the library has at start-up (shell_reset) : what an input leaves behind (macros,
+ *  trace, log level and messages) doesn't change how the next one runs, so a crash replays from its input alone. The
+ *  command tree, variables and regions are the fixed tables below : inputs reach every parser path through them, but
+ *  never a tree of another shape (deeper nesting, other schemas, a different number of entries).
+ *
+ *  With libFuzzer (clang -fsanitize=fuzzer), define SHELL_FUZZ_LIBFUZZER : only LLVMFuzzerTestOneInput is compiled.
+ *  Otherwise it's a standalone program :
+ *
+ *    shell_fuzz [file...]           runs each file as an input, or stdin if there's none (for AFL)
+ *    shell_fuzz -r <count> [seed]   runs random inputs, built from the shell's vocabulary and random bytes
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shell_posix.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FUZZ_BURST				16		// Bytes fed at once...
+#define FUZZ_STEPS				8		// ... then calls to shell_poll
+#define FUZZ_DRAIN				256		// Calls to shell_poll once the input has been fed
+#define FUZZ_INPUT				(1 << 16)	// Largest input of the standalone program
+
+// ========= Application side : a bit of everything the parser and the native commands handle ==========================
+
+typedef struct { int k; } t_fuzz_context;
+
+static SHELL_COMMAND (command_args)
+{
+	snprintf (sh->output, SHELL_BUFFER_SIZE, "\r\n%d arguments, %.32s", sh->argc, (sh->argc > 1) ? sh->argv[1] : "");
+	COMMAND_LAST_LINE
+}
+
+static SHELL_COMMAND (command_lines)
+{
+	t_fuzz_context *ctx = SHELL_CONTEXT (t_fuzz_context);
+
+	SHELL_BEGIN
+	for (ctx->k = 0; ctx->k < ((sh->argc > 1) ? sh->arg[1].i % 64 : 8); ctx->k++)
+		SHELL_YIELD_PRINTF ("\r\nline %d", ctx->k);
+	SHELL_END
+}
+
+static SHELL_COMMAND (command_ask)
+{
+	SHELL_BEGIN
+	SHELL_YIELD_PRINT ("\r\nanswer ?")
+	SHELL_AWAIT_INPUT
+	SHELL_YIELD_PRINTF ("\r\n%.32s", sh->input)
+	SHELL_END
+}
+
+static SHELL_COMMAND (command_nap)
+{
+	SHELL_BEGIN
+	SHELL_SLEEP (1)
+	SHELL_YIELD
+	SHELL_END
+}
+
+SHELL_BLOCK (motor_block, "motor",
+	SHELL_CMD ("speed <rpm>", command_args, "f"),
+	SHELL_CMD ("mode <on|off|auto>", command_args, "{on|off|auto}"),
+	SHELL_CMD ("raw ...", command_args));
+SHELL_BLOCK (root_block, "fuzz",
+	SHELL_CMD ("args <n> <x> [s] ...", command_args, "ix?s*"),
+	SHELL_CMD ("lines [n]", command_lines, "?i"),
+	SHELL_CMD ("ask", command_ask),
+	SHELL_CMD ("nap", command_nap),
+	SHELL_SUB ("motor", motor_block));
+
+static unsigned char fuzz_u8;
+static short fuzz_s16;
+static unsigned int fuzz_x32;
+static float fuzz_f32;
+static char fuzz_region[4096];
+
+const t_shell_var shell_vars[] =
+{
+	SHELL_VAR ("u8", fuzz_u8, 'u'),
+	SHELL_VAR ("s16", fuzz_s16, 'i'),
+	SHELL_VAR ("x32", fuzz_x32, 'x'),
+	SHELL_VAR ("f32", fuzz_f32, 'f'),
+	{ 0 }
+};
+
+const t_shell_region shell_regions[] =
+{
+	{ "ram", fuzz_region, sizeof (fuzz_region), 1 },
+	{ "rom", fuzz_region, 64, 0 },
+	{ 0 }
+};
+
+// ========= Entry point ====================================================================
+
+static t_shell_posix fuzz_port;
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+	t_shell_state *sh = &shell_state;
+
+	// Output goes to /dev/null. Input isn't read from the port : it's fed straight to the instance.
+	if (sh->port == 0)
+	{
+		int in = open ("/dev/null", O_RDONLY);
+		int out = open ("/dev/null", O_WRONLY);
+		if ((in == -1) || (out == -1) || (shell_posix_open (sh, &fuzz_port, in, out) == -1))
+		{
+			perror ("shell_fuzz");
+			exit (1);
+		}
+	}
+
+	shell_reset ();					// Every input starts from a fresh library...
+	sh->fp = shell_state_init;		// ... and a fresh instance
+	shell_poll (sh);
+
+	for (size_t i = 0; i < size; i += FUZZ_BURST)
+	{
+		int n = (size - i < FUZZ_BURST) ? size - i : FUZZ_BURST;
+		shell_in_burst (sh, (char *) data + i, n);
+		shell_trace_sample ();		// As the timer interrupt would
+		for (int k = 0; k < FUZZ_STEPS; k++)
+			shell_poll (sh);
+	}
+	for (int k = 0; k < FUZZ_DRAIN; k++)
+		shell_poll (sh);
+	return 0;
+}
+
+#ifndef SHELL_FUZZ_LIBFUZZER
+
+// ========= Standalone program =============================================================
+
+static const char *fuzz_words[] =
+{
+	"args", "lines", "ask", "nap", "motor", "speed", "mode", "raw", "on", "off", "auto", "cd", "cd..", "cd /", "cd motor",
+	"ls", "log", "debug", "error", "jobs", "fg", "kill", "watch 5", "get", "set", "trace", "select", "trigger", "arm",
+	"stop", "show", "run", "macro", "stats", "reset", "download ram", "upload ram", "download rom", "upload rom",
+	"u8", "s16", "x32", "f32", "none", "rise", "above", "1", "-7", "0x1f", "1.5e3", "1x", "\"a b\"", "\"", ";", "&", " ",
+	"  ", "/", "..", "C", "\x18\x18", "\x02SH", "\r", "\n", "\r\n", "\t", "\x7f", "\b", "\x15", "\x0b", "\x01", "\x05",
+	"\x12", "\x03", "\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D", "\x1b[H", "\x1b[F", "\x1b[3~", "\x1bOH", "\x1b[1;5C", "\x1b",
+};
+
+static unsigned long fuzz_seed = 1;
+
+static unsigned int fuzz_random (unsigned int n)
+{
+	fuzz_seed = fuzz_seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (unsigned int) (fuzz_seed >> 33) % n;
+}
+
+// A random input : mostly words of the vocabulary, some random bytes
+static size_t fuzz_generate (uint8_t *data, size_t size)
+{
+	size_t length = 0;
+	size_t target = 1 + fuzz_random (size);
+	while (length < target)
+	{
+		const char *word = fuzz_words[fuzz_random (sizeof (fuzz_words) / sizeof (fuzz_words[0]))];
+		size_t n = strlen (word);
+		if (fuzz_random (8) == 0)		// Random bytes
+		{
+			n = 1 + fuzz_random (32);
+			for (size_t i = 0; (i < n) && (length < size); i++)
+				data[length++] = fuzz_random (256);
+			continue;
+		}
+		if (length + n + 2 > size)
+			break;
+		if (word[0] == 0x02)		// The binary mode escape, whose zero byte can't be part of a word
+			data[length++] = 0;
+		memcpy (data + length, word, n);
+		length += n;
+		if (fuzz_random (3) == 0)
+			data[length++] = (fuzz_random (2) == 0) ? ' ' : '\r';
+	}
+	return length;
+}
+
+static int fuzz_file (const char *name, uint8_t *data)
+{
+	FILE *f = (name != 0) ? fopen (name, "rb") : stdin;
+	if (f == 0)
+	{
+		perror (name);
+		return -1;
+	}
+	size_t size = fread (data, 1, FUZZ_INPUT, f);
+	if (name != 0)
+		fclose (f);
+	LLVMFuzzerTestOneInput (data, size);
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	static uint8_t data[FUZZ_INPUT];
+
+	if ((argc > 2) && (strcmp (argv[1], "-r") == 0))
+	{
+		long count = atol (argv[2]);
+		fuzz_seed = (argc > 3) ? strtoul (argv[3], 0, 0) : 1;
+		unsigned long start = shell_cycles (), bytes = 0;
+		for (long i = 0; i < count; i++)
+		{
+			size_t size = fuzz_generate (data, 2048);
+			bytes += size;
+			LLVMFuzzerTestOneInput (data, size);
+		}
+		printf ("%ld inputs, %lu bytes, %.1f s\n", count, bytes, (shell_cycles () - start) / 1e9);
+		return 0;
+	}
+
+	if (argc == 1)
+		return (fuzz_file (0, data) != 0);
+	for (int i = 1; i < argc; i++)
+		if (fuzz_file (argv[i], data) != 0)
+			return 1;
+	return 0;
+}
+
+#endif /* SHELL_FUZZ_LIBFUZZER */
@@ -0,0 +1,236 @@
+/*
+ *  harness.c
+ *
+ *  Helpers shared by the drivers : pipes, steps, waits and the terminal model. See harness.h.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "harness.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+t_shell_posix harness_port;
+int harness_errors;
+
+static void harness_erase (long row, int col);
+
+static int harness_in;		// Write end of the shell's input
+static int harness_out;		// Read end of the shell's output, when it's read after each step
+static t_harness_output harness_output;
+
+// The output is read by a thread of its own : the port's writes are synchronous, and a large output would fill the pipe
+static void *harness_drain (void *arg)
+{
+	static char buff[65536];
+	int fd = (int) (long) arg;
+	int n;
+	while ((n = read (fd, buff, sizeof (buff))) > 0)
+		if (harness_output != 0)
+			harness_output (buff, n);
+	return 0;
+}
+
+int harness_open (const char *name, t_harness_output output, int thread)
+{
+	int in[2], out[2];
+	if ((pipe (in) == -1) || (pipe (out) == -1) || (shell_posix_open (&shell_state, &harness_port, in[0], out[1]) == -1))
+	{
+		perror (name);
+		return -1;
+	}
+	harness_in = in[1];
+	harness_output = output;
+	for (long r = 0; r < HARNESS_ROWS; r++)		// A blank screen, for the terminal model
+		harness_erase (r, 0);
+	fcntl (harness_in, F_SETFL, fcntl (harness_in, F_GETFL) | O_NONBLOCK);
+	if (thread)
+	{
+		harness_out = -1;
+		pthread_t drain;
+		if (pthread_create (&drain, 0, harness_drain, (void *) (long) out[0]) != 0)
+		{
+			perror (name);
+			return -1;
+		}
+	}
+	else
+	{
+		harness_out = out[0];
+		fcntl (harness_out, F_SETFL, fcntl (harness_out, F_GETFL) | O_NONBLOCK);	// Whatever there is after each step
+	}
+
+	HARNESS_UNTIL (harness_port.tx_bytes != 0)		// Up to the first prompt
+	if (harness_settle () != 0)
+	{
+		fprintf (stderr, "%s : no prompt\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+int harness_step (void)
+{
+	char buff[4096];
+	int n;
+
+	int received = shell_posix_read (&shell_state);
+	shell_poll (&shell_state);
+	if (harness_out != -1)
+		while ((n = read (harness_out, buff, sizeof (buff))) > 0)
+			if (harness_output != 0)
+				harness_output (buff, n);
+	return received;
+}
+
+void harness_feed (const char *s, int length)
+{
+	while (length > 0)
+	{
+		int n = write (harness_in, s, length);
+		if (n > 0)
+		{
+			s += n;
+			length -= n;
+		}
+		harness_step ();
+	}
+}
+
+int harness_settle (void)
+{
+	for (long steps = 0; harness_stuck (steps) == 0; steps++)
+	{
+		int n = harness_step ();
+		if ((n == 0) && ((shell_state.fp == shell_state_idle) || (shell_state.fp == shell_state_binary)) &&
+			(shell_state.command_fp == 0) && (shell_state.rx_head == shell_state.rx_tail))
+			return 0;
+	}
+	return -1;
+}
+
+int harness_stuck (long steps)
+{
+	if (steps < HARNESS_STEPS)
+		return 0;
+	if (harness_errors++ == 0)
+		fprintf (stderr, "the shell is stuck : still busy after %d steps\n", HARNESS_STEPS);
+	return 1;
+}
+
+// ========= Terminal model =================================================================
+
+static char harness_screen[HARNESS_ROWS][HARNESS_COLS + 1];
+static long harness_bottom;		// Last row printed : the bottom of the screen
+static int harness_escape;		// Position in an escape sequence : 0 if none, 1 after ESC, 2 in its parameters
+static int harness_param;
+
+long harness_row;
+int harness_col;
+
+static void harness_erase (long row, int col)
+{
+	memset (&harness_screen[row % HARNESS_ROWS][col], ' ', HARNESS_COLS - col);
+	harness_screen[row % HARNESS_ROWS][HARNESS_COLS] = 0;
+}
+
+static void harness_sequence (char c)
+{
+	long top = (harness_bottom >= HARNESS_ROWS) ? harness_bottom - HARNESS_ROWS + 1 : 0;
+	int n = (harness_param == 0) ? 1 : harness_param;
+
+	if (c == 'A')
+		harness_row = (harness_row - n > top) ? harness_row - n : top;
+	else if (c == 'B')
+		harness_row = (harness_row + n < harness_bottom) ? harness_row + n : harness_bottom;
+	else if (c == 'C')
+		harness_col = (harness_col + n < HARNESS_COLS) ? harness_col + n : HARNESS_COLS - 1;
+	else if (c == 'D')
+		harness_col = (harness_col > n) ? harness_col - n : 0;
+	else if (c == 'G')
+		harness_col = (n <= HARNESS_COLS) ? n - 1 : HARNESS_COLS - 1;
+	else if (c == 'K')
+		harness_erase (harness_row, harness_col);
+	else if (c == 'J')
+	{
+		harness_erase (harness_row, harness_col);
+		for (long r = harness_row + 1; r <= harness_bottom; r++)
+			harness_erase (r, 0);
+	}
+	else if (harness_errors++ == 0)
+		fprintf (stderr, "unexpected escape sequence ending with '%c'\n", c);
+}
+
+static void harness_char (char c)
+{
+	if (harness_escape == 1)
+	{
+		harness_escape = (c == '[') ? 2 : 0;
+		harness_param = 0;
+		return;
+	}
+	if (harness_escape == 2)
+	{
+		if ((c >= '0') && (c <= '9'))
+			harness_param = harness_param * 10 + c - '0';
+		else if (c == ';')
+			harness_param = 0;
+		else
+		{
+			harness_sequence (c);
+			harness_escape = 0;
+		}
+		return;
+	}
+
+	if (c == 0x1b)
+		harness_escape = 1;
+	else if (c == '\r')
+		harness_col = 0;
+	else if (c == '\n')
+	{
+		if (harness_row++ == harness_bottom)		// A new row at the bottom : nothing on it yet
+			harness_erase (++harness_bottom, 0);
+	}
+	else if (c == '\b')
+		harness_col = (harness_col > 0) ? harness_col - 1 : 0;
+	else if ((c >= ' ') && (harness_col < HARNESS_COLS))
+		harness_screen[harness_row % HARNESS_ROWS][harness_col++] = c;
+}
+
+void harness_terminal (const char *buff, int length)
+{
+	for (int i = 0; i < length; i++)
+		harness_char (buff[i]);
+}
+
+const char *harness_line (long row)
+{
+	return harness_screen[row % HARNESS_ROWS];
+}
+
+int harness_shows (long row, const char *text, int length)
+{
+	const char *line = harness_line (row);
+	if (memcmp (line, text, length) != 0)
+		return 0;
+	for (int c = length; c < HARNESS_COLS; c++)
+		if (line[c] != ' ')
+			return 0;
+	return 1;
+}
@@ -0,0 +1,75 @@
+/*
+ *  harness.h
+ *
+ *  Helpers shared by the drivers : the default instance runs on a pair of pipes, the driver writes keystrokes to one and
+ *  the output of the other is read either by a thread or after each step. Every wait on the shell is capped, so a stuck
+ *  shell makes the driver fail rather than hang. The terminal model follows the cursor movements and erasures the shell
+ *  sends, for the drivers that check what the screen shows.
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_HARNESS_H_
+#define TEST_HARNESS_H_
+
+#include "shell_posix.h"
+
+#define HARNESS_STEPS			10000000	// Steps of a wait before the shell is declared stuck
+#define HARNESS_ROWS			256		// Rows the terminal model keeps : the last ones printed
+#define HARNESS_COLS			1024	// Width of the terminal model : more than the prompt and a full line
+
+extern t_shell_posix harness_port;		// Port of the default instance : its byte counts
+extern int harness_errors;				// Waits that hit the cap, and unexpected output of the terminal model
+
+// Output handler : called with whatever the shell wrote, from the output thread or after each step
+typedef void (*t_harness_output) (const char *buff, int length);
+
+// Open the default instance on a pair of pipes, and run it up to the first prompt. The output goes to the handler (or
+// is thrown away if it's 0), read by a thread of its own if thread is set, else after each step. Returns 0, or -1 on error.
+int harness_open (const char *name, t_harness_output output, int thread);
+
+// Run the shell a step. Returns the number of bytes read from its input.
+int harness_step (void);
+
+// Write a keystroke stream, running the shell meanwhile : the pipe only holds so much
+void harness_feed (const char *s, int length);
+
+// Run the shell until it waits for the next command line (or binary request), with all its input consumed. Returns -1
+// if it doesn't get there.
+int harness_settle (void);
+
+// Counts a wait that went on for too long. Returns non-zero once it has : see HARNESS_UNTIL.
+int harness_stuck (long steps);
+
+// Run the shell a step at a time until a condition holds, or until it's declared stuck
+#define HARNESS_UNTIL(COND) \
+	for (long harness_steps = 0; !(COND) && (harness_stuck (harness_steps++) == 0); ) \
+		harness_step ();
+
+// ========= Terminal model =================================================================
+
+// Rows are numbered from the start of the session : the model keeps the last HARNESS_ROWS of them
+extern long harness_row;
+extern int harness_col;
+
+// Output handler that passes the output to the terminal model
+void harness_terminal (const char *buff, int length);
+
+// A row of the terminal model, HARNESS_COLS characters padded with spaces
+const char *harness_line (long row);
+
+// Does the row show this text, and only it ?
+int harness_shows (long row, const char *text, int length);
+
+#endif /* TEST_HARNESS_H_ */
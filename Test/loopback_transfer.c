@@ -0,0 +1,319 @@
+/*
+ *  loopback_transfer.c
+ *
+ *  Loopback test of the bulk transfers : the shell runs the usual POSIX main loop on a thread of its own, and the other
+ *  end of its pipes plays the terminal's side of "download" and "upload" (see the protocol in "shell_transfer.c"). The
+ *  data must come through intact, in both directions, with and without packets to send again. Prints CSV
+ *  ("metric,value,unit") : bytes per second for each direction. Exits non-zero if a transfer fails or corrupts the data.
+ *
+ *    shell_loopback_transfer [-q]
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shell_posix.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOOP_SIZE				(1 << 20)	// Size of the region, in bytes
+#define LOOP_ERROR_PERIOD		50			// In the runs with errors, one packet out of this many is rejected once
+
+static char loop_region[LOOP_SIZE];
+static char loop_source[LOOP_SIZE];			// What the region should hold
+
+SHELL_BLOCK (root_block, "loop");
+
+const t_shell_region shell_regions[] =
+{
+	{ "buffer", loop_region, sizeof (loop_region), 1 },
+	{ 0 }
+};
+
+static t_shell_posix loop_port;
+static int loop_in;			// Write end of the shell's input
+static int loop_out;		// Read end of the shell's output
+
+// The shell's thread : the typical main loop of the port, until the input is closed
+static void *loop_shell (void *arg)
+{
+	while (shell_posix_read (&shell_state) >= 0)
+		shell_posix_wait (&shell_state, shell_poll (&shell_state));
+	return 0;
+}
+
+// ========= Terminal side ==================================================================
+
+static char loop_buff[65536];
+static int loop_head, loop_tail;
+
+// Next byte from the shell, or -1 if nothing comes for a while
+static int loop_byte (void)
+{
+	if (loop_tail == loop_head)
+	{
+		struct pollfd pfd = { loop_out, POLLIN, 0 };
+		if (poll (&pfd, 1, 5000) != 1)
+			return -1;
+		loop_head = read (loop_out, loop_buff, sizeof (loop_buff));
+		loop_tail = 0;
+		if (loop_head <= 0)
+			return -1;
+	}
+	return (unsigned char) loop_buff[loop_tail++];
+}
+
+static int loop_bytes (char *p, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		int c = loop_byte ();
+		if (c < 0)
+			return -1;
+		p[i] = c;
+	}
+	return 0;
+}
+
+// Skip the shell's output up to a text (included)
+static int loop_expect (const char *text)
+{
+	int len = strlen (text), matched = 0;
+	while (matched < len)
+	{
+		int c = loop_byte ();
+		if (c < 0)
+		{
+			fprintf (stderr, "timed out waiting for \"%s\"\n", text);
+			return -1;
+		}
+		if (c == text[matched])
+			matched++;
+		else
+			matched = (c == text[0]);
+	}
+	return 0;
+}
+
+static void loop_send (const char *p, int n)
+{
+	while (n > 0)
+	{
+		int w = write (loop_in, p, n);
+		if (w > 0)
+		{
+			p += w;
+			n -= w;
+		}
+	}
+}
+
+static void loop_reply (char code, unsigned char seq)
+{
+	char reply[2] = { code, seq };
+	loop_send (reply, 2);
+}
+
+// Receive the region ("download"), which must hold loop_source by now. With errors, packets are rejected once in a
+// while, as if they were corrupted.
+static int loop_download (int errors)
+{
+	loop_send ("download buffer\r", 16);
+	if (loop_expect ("start the receiver") != 0)
+		return -1;
+	loop_send ("C", 1);
+
+	unsigned char expected = 1;
+	unsigned long done = 0, packets = 0;
+	while (1)
+	{
+		char header[4], data[SHELL_TRANSFER_BLOCK + 2];
+		int type = loop_byte ();
+		if (type < 0)
+			return -1;
+		if ((type != 0x02) && (type != 0x04))
+		{
+			fprintf (stderr, "download : unexpected byte 0x%02x\n", type);
+			return -1;
+		}
+		if (loop_bytes (header, (type == 0x04) ? 2 : 4) != 0)
+			return -1;
+		unsigned char seq = header[0];
+		if ((unsigned char) (header[0] ^ header[1]) != 0xFF)
+		{
+			fprintf (stderr, "download : corrupted header\n");
+			return -1;
+		}
+		if (type == 0x04)
+		{
+			if (seq != expected)
+				continue;		// Sent before the packet rejected
+			loop_reply (0x06, seq);
+			break;
+		}
+
+		int size = (unsigned char) header[2] | (unsigned char) header[3] << 8;
+		if ((size == 0) || (size > SHELL_TRANSFER_BLOCK) || (loop_bytes (data, size + 2) != 0))
+			return -1;
+		if (seq != expected)
+			continue;
+		if ((errors != 0) && ((++packets % LOOP_ERROR_PERIOD) == 0))
+		{
+			loop_reply (0x15, seq);		// Go back to this one
+			continue;
+		}
+		unsigned short crc = shell_crc16 (0, data, size);
+		if (((unsigned char) data[size] != (crc >> 8)) || ((unsigned char) data[size + 1] != (crc & 0xFF)) ||
+			(done + size > LOOP_SIZE) || (memcmp (data, loop_source + done, size) != 0))
+		{
+			fprintf (stderr, "download : packet %u corrupted\n", seq);
+			return -1;
+		}
+		done += size;
+		loop_reply (0x06, seq);
+		expected++;
+	}
+	if ((loop_expect ("bytes sent") != 0) || (done != LOOP_SIZE))
+		return -1;
+	return 0;
+}
+
+// Send loop_source to the region ("upload"), with the same window as the shell. With errors, the CRC of a packet is
+// corrupted once in a while : the shell must ask for it again.
+static int loop_upload (int errors)
+{
+	int packets = (LOOP_SIZE + SHELL_TRANSFER_BLOCK - 1) / SHELL_TRANSFER_BLOCK + 1;	// Data, then end of transmission
+	int acked = 0, next = 0, sent = 0;
+	static char packet[SHELL_TRANSFER_BLOCK + 7];
+
+	loop_send ("upload buffer\r", 14);
+	if ((loop_expect ("start the sender") != 0) || (loop_expect ("C") != 0))
+		return -1;
+
+	while (acked < packets)
+	{
+		if ((next < packets) && (next < acked + SHELL_TRANSFER_WINDOW))
+		{
+			unsigned char seq = next + 1;
+			if (next == packets - 1)
+			{
+				char eot[3] = { 0x04, seq, ~seq };
+				loop_send (eot, 3);
+			}
+			else
+			{
+				unsigned long offset = (unsigned long) next * SHELL_TRANSFER_BLOCK;
+				int size = (LOOP_SIZE - offset > SHELL_TRANSFER_BLOCK) ? SHELL_TRANSFER_BLOCK : LOOP_SIZE - offset;
+				unsigned short crc = shell_crc16 (0, loop_source + offset, size);
+				if ((errors != 0) && ((++sent % LOOP_ERROR_PERIOD) == 0))
+					crc ^= 1;
+				packet[0] = 0x02;
+				packet[1] = seq;
+				packet[2] = ~seq;
+				packet[3] = size;
+				packet[4] = size >> 8;
+				memcpy (packet + 5, loop_source + offset, size);
+				packet[5 + size] = crc >> 8;
+				packet[6 + size] = crc;
+				loop_send (packet, size + 7);
+			}
+			next++;
+			continue;
+		}
+
+		// The window is full : wait for an acknowledgement
+		char reply[2];
+		if (loop_bytes (reply, 2) != 0)
+			return -1;
+		int n = acked + (unsigned char) (reply[1] - (acked + 1));
+		if (n >= next)
+			continue;
+		if (reply[0] == 0x06)
+			acked = n + 1;
+		else if (reply[0] == 0x15)
+			acked = next = n;
+		else
+		{
+			fprintf (stderr, "upload : unexpected reply 0x%02x\n", (unsigned char) reply[0]);
+			return -1;
+		}
+	}
+	if (loop_expect ("bytes received") != 0)
+		return -1;
+	if (memcmp (loop_region, loop_source, LOOP_SIZE) != 0)
+	{
+		fprintf (stderr, "upload : the region doesn't hold the data sent\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Run a transfer, and print its rate
+static int loop_run (const char *name, int (*transfer) (int), int errors)
+{
+	unsigned long start = shell_cycles ();
+	if (transfer (errors) != 0)
+	{
+		fprintf (stderr, "%s failed\n", name);
+		return 1;
+	}
+	unsigned long elapsed = shell_cycles () - start;
+	printf ("%s_rate,%.0f,bytes/s\n", name, LOOP_SIZE * 1e9 / elapsed);
+	if (loop_expect ("loop") != 0)		// Back to the prompt
+		return 1;
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	int quick = (argc > 1) && (strcmp (argv[1], "-q") == 0);
+	int rounds = quick ? 1 : 10;
+
+	unsigned long seed = 1;
+	for (int i = 0; i < LOOP_SIZE; i++)
+	{
+		seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+		loop_source[i] = seed >> 56;
+		loop_region[i] = ~loop_source[i];
+	}
+
+	int in[2], out[2];
+	if ((pipe (in) == -1) || (pipe (out) == -1) || (shell_posix_open (&shell_state, &loop_port, in[0], out[1]) == -1))
+	{
+		perror ("shell_loopback_transfer");
+		return 1;
+	}
+	loop_in = in[1];
+	loop_out = out[0];
+	pthread_t shell;
+	pthread_create (&shell, 0, loop_shell, 0);
+
+	int failures = loop_expect ("loop") != 0;	// Up to the first prompt
+	printf ("metric,value,unit\n");
+	for (int i = 0; (i < rounds) && (failures == 0); i++)
+	{
+		failures += loop_run ("upload", loop_upload, 0);
+		failures += loop_run ("download", loop_download, 0);
+	}
+	failures += loop_run ("upload_errors", loop_upload, 1);
+	failures += loop_run ("download_errors", loop_download, 1);
+
+	close (loop_in);		// Ends the shell's main loop
+	pthread_join (shell, 0);
+	return (failures != 0);
+}
@@ -0,0 +1,100 @@
+/*
+ *  stress_editing.c
+ *
+ *  Stress test of line editing : random keys (typing, arrows, Home / End, Delete, Backspace, Ctrl-K / Ctrl-U, history
+ *  recall and search, completion, carriage returns) are sent to the shell one at a time, and its output goes through a
+ *  model of the terminal's line. Whenever the shell is back waiting for keys, the line on the screen must be the prompt
+ *  followed by the input buffer, nothing after it, and the cursor where the shell thinks it is. Prints CSV
+ *  ("metric,value,unit") : keys checked, and bytes of input and output. Exits non-zero on a mismatch, or if the shell
+ *  gets stuck.
+ *
+ *    shell_stress_editing [-q] [seed]
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "harness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRESS_PROMPT			"/edit>"
+
+static SHELL_COMMAND (command_nop)
+{
+	sprintf (sh->output, "\r\nok");
+	COMMAND_LAST_LINE
+}
+
+SHELL_BLOCK (root_block, "edit",
+	SHELL_CMD ("alpha", command_nop),
+	SHELL_CMD ("alps <n>", command_nop, "?i"),
+	SHELL_CMD ("beta", command_nop));
+
+// The line must show the prompt and the input buffer, with the cursor on the shell's position. Returns non-zero if not.
+static int stress_check (long key)
+{
+	char expected[HARNESS_COLS];
+	int length = snprintf (expected, sizeof (expected), "%s%.*s", STRESS_PROMPT, shell_state.index, shell_state.input);
+	int column = strlen (STRESS_PROMPT) + shell_state.cursor;
+	if (harness_shows (harness_row, expected, length) && (harness_col == column))
+		return 0;
+	fprintf (stderr, "key %ld : the line shows \"%.80s\", cursor %d, expected \"%s\", cursor %d\n", key,
+		harness_line (harness_row), harness_col, expected, column);
+	return 1;
+}
+
+static unsigned long stress_seed = 1;
+
+static unsigned int stress_random (unsigned int n)
+{
+	stress_seed = stress_seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (unsigned int) (stress_seed >> 33) % n;
+}
+
+int main (int argc, char **argv)
+{
+	static const char *keys[] =
+	{
+		"\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D", "\x1b[H", "\x1b[F", "\x1b[3~", "\x1bOH", "\x1bOF", "\x1b[1;5C", "\t", "\x12",
+		"\x0b", "\x15", "\x7f", "\x08", "\x01", "\x05", "\x10", "\x0e", "a", "l", "p", "x", " ", "al", "be", "alps 12",
+		"hi there ", "\r", "\r",
+	};
+	int quick = (argc > 1) && (strcmp (argv[1], "-q") == 0);
+	long count = quick ? 20000 : 200000;
+	if (argc > 1 + quick)
+		stress_seed = strtoul (argv[1 + quick], 0, 0);
+
+	if (harness_open ("shell_stress_editing", harness_terminal, 0) != 0)
+		return 1;
+
+	long checks = 0;
+	int errors = 0;
+	for (long i = 0; (i < count) && (errors == 0) && (harness_errors == 0); i++)
+	{
+		const char *key = keys[stress_random (sizeof (keys) / sizeof (keys[0]))];
+		harness_feed (key, strlen (key));
+		if (harness_settle () != 0)
+			break;
+		errors += stress_check (i);
+		checks++;
+	}
+
+	printf ("metric,value,unit\n");
+	printf ("keys,%ld,keys\n", checks);
+	printf ("input,%lu,bytes\n", harness_port.rx_bytes);
+	printf ("output,%lu,bytes\n", harness_port.tx_bytes);
+	return (errors != 0) || (harness_errors != 0);
+}
@@ -0,0 +1,198 @@
+/*
+ *  stress_instances.c
+ *
+ *  Stress test of concurrent shell instances : each instance runs on a thread of its own, with its own pipe for input and
+ *  its own file for output, against the same read-only command tree. Every instance gets a stream of numbered commands,
+ *  some of them in a sub-block. Its output must hold its own results, all of them and in order, and nothing else.
+ *  Prints CSV : commands per second for 1 to 32 instances, to show how throughput scales with the number of threads.
+ *  Exits non-zero on any cross-talk or lost command.
+ *
+ *    shell_stress_instances [-q]
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shell_posix.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STRESS_INSTANCES		32
+
+static t_shell_state stress_shell[STRESS_INSTANCES];
+static t_shell_posix stress_port[STRESS_INSTANCES];
+static unsigned long stress_runs[STRESS_INSTANCES];		// Commands run, per instance
+
+// Both commands print the instance they think they run on, and their argument
+static SHELL_COMMAND (command_mark)
+{
+	stress_runs[sh - stress_shell]++;
+	sprintf (sh->output, "\r\n@%d:%ld", (int) (sh - stress_shell), sh->arg[1].i);
+	COMMAND_LAST_LINE
+}
+
+static SHELL_COMMAND (command_inner)
+{
+	stress_runs[sh - stress_shell]++;
+	sprintf (sh->output, "\r\n#%d:%ld", (int) (sh - stress_shell), sh->arg[1].i);
+	COMMAND_LAST_LINE
+}
+
+SHELL_BLOCK_DECLARE (sub_block);
+SHELL_BLOCK (root_block, "stress",
+	SHELL_CMD ("mark <n>", command_mark, "i"),
+	SHELL_SUB ("sub", sub_block));
+SHELL_BLOCK (sub_block, "sub",
+	SHELL_CMD ("inner <n>", command_inner, "i"));
+
+typedef struct
+{
+	int id;
+	int commands;		// Number of numbered commands to run
+	int in;				// Write end of the instance's input
+	FILE *out;			// The instance's output
+} t_stress_thread;
+
+// The keystroke stream of an instance : "mark n", and every tenth command, "inner n" in the sub-block
+static char *stress_stream (int commands, int *length)
+{
+	char *stream = malloc (commands * 32);
+	*length = 0;
+	for (int n = 0; n < commands; n++)
+		if ((n % 10) == 9)
+			*length += sprintf (stream + *length, "cd sub\rinner %d\rcd..\r", n);
+		else
+			*length += sprintf (stream + *length, "mark %d\r", n);
+	return stream;
+}
+
+static void *stress_run (void *arg)
+{
+	t_stress_thread *t = (t_stress_thread *) arg;
+	t_shell_state *sh = &stress_shell[t->id];
+	int length, sent = 0;
+	char *stream = stress_stream (t->commands, &length);
+
+	while (1)
+	{
+		if (sent < length)
+		{
+			int n = write (t->in, stream + sent, length - sent);
+			if (n > 0)
+				sent += n;
+		}
+		int n = shell_posix_read (sh);
+		shell_poll (sh);
+		if ((sent == length) && (n == 0) && (stress_runs[t->id] == (unsigned long) t->commands) && (sh->fp == shell_state_idle) &&
+			(sh->rx_head == sh->rx_tail))
+			break;
+	}
+	free (stream);
+	return 0;
+}
+
+// The output of an instance must hold its results, in order : "@id:n", or "#id:n" for every tenth command
+static int stress_check (t_stress_thread *t)
+{
+	fflush (t->out);
+	long size = ftell (t->out);
+	char *text = malloc (size + 1);
+	rewind (t->out);
+	size = fread (text, 1, size, t->out);
+	text[size] = 0;
+
+	int expected = 0, errors = 0;
+	for (char *p = text; (p = strpbrk (p, "@#")) != 0; p++)
+	{
+		int id, n;
+		if ((sscanf (p + 1, "%d:%d", &id, &n) != 2) || (id != t->id) || (n != expected) || ((*p == '#') != ((n % 10) == 9)))
+		{
+			if (errors++ == 0)
+				fprintf (stderr, "instance %d : unexpected \"%.16s\" (expected result %d)\n", t->id, p, expected);
+		}
+		expected++;
+	}
+	if (expected != t->commands)
+	{
+		fprintf (stderr, "instance %d : %d results out of %d\n", t->id, expected, t->commands);
+		errors++;
+	}
+	free (text);
+	return errors;
+}
+
+// Run a number of instances at once. Returns the number of errors.
+static int stress (int instances, int commands)
+{
+	t_stress_thread thread[STRESS_INSTANCES];
+	pthread_t handle[STRESS_INSTANCES];
+
+	for (int i = 0; i < instances; i++)
+	{
+		int in[2];
+		memset (&stress_shell[i], 0, sizeof (stress_shell[i]));		// Starts from the initialization state
+		stress_runs[i] = 0;
+		thread[i].id = i;
+		thread[i].commands = commands;
+		thread[i].out = tmpfile ();
+		if ((thread[i].out == 0) || (pipe (in) == -1) ||
+			(shell_posix_open (&stress_shell[i], &stress_port[i], in[0], fileno (thread[i].out)) == -1))
+		{
+			perror ("shell_stress_instances");
+			exit (1);
+		}
+		thread[i].in = in[1];
+		fcntl (thread[i].in, F_SETFL, fcntl (thread[i].in, F_GETFL) | O_NONBLOCK);
+	}
+
+	unsigned long start = shell_cycles ();
+	for (int i = 0; i < instances; i++)
+		pthread_create (&handle[i], 0, stress_run, &thread[i]);
+	for (int i = 0; i < instances; i++)
+		pthread_join (handle[i], 0);
+	unsigned long elapsed = shell_cycles () - start;
+
+	int errors = 0;
+	for (int i = 0; i < instances; i++)
+	{
+		errors += stress_check (&thread[i]);
+		close (thread[i].in);
+		close (stress_port[i].in_fd);
+		shell_posix_close (&stress_shell[i]);
+		fclose (thread[i].out);
+	}
+	printf ("%d,%.0f\n", instances, (double) instances * commands * 1e9 / elapsed);
+	return errors;
+}
+
+int main (int argc, char **argv)
+{
+	int quick = (argc > 1) && (strcmp (argv[1], "-q") == 0);
+	int commands = quick ? 2000 : 20000;
+
+	// The dispatch index is shared : build it before the threads start, rather than from the first instances' init
+	shell_index_build ();
+
+	int errors = 0;
+	printf ("instances,commands_per_sec\n");
+	for (int instances = 1; instances <= STRESS_INSTANCES; instances *= 2)
+		errors += stress (instances, commands);
+	if (errors != 0)
+		fprintf (stderr, "%d errors\n", errors);
+	return (errors != 0);
+}
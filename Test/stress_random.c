@@ -0,0 +1,184 @@
+/*
+ *  stress_random.c
+ *
+ *  Stress test with random command lines : application commands, native ones (navigation, listing, log level, jobs,
+ *  variables, macros), wrong arguments and garbage, one after the other, for millions of commands. Each line is timed
+ *  from the moment it's written to the moment the shell is back at the prompt. Prints CSV ("metric,value,unit") :
+ *  commands per second, mean and worst latency. Exits non-zero if the worst latency is over the limit, if the rate is
+ *  below the baseline by more than the tolerance, or if the shell doesn't come back to the prompt. ctest passes the
+ *  baseline, the tolerance and the limit from the CMake cache (SHELL_STRESS_RATE, SHELL_STRESS_TOLERANCE and
+ *  SHELL_STRESS_LATENCY) : set them for the host that runs the tests.
+ *
+ *  Commands that wait for the peer or for time to pass (download, upload, watch, fg, trace show) aren't drawn : they
+ *  would be timed for the wait. Neither is binary mode. The fuzz driver covers them.
+ *
+ *    shell_stress_random [-q] [-n <commands>] [-l <latency limit, in us>] [-r <baseline, commands/s>] [-t <tolerance, %>]
+ *                        [-s <seed>]
+ *
+ *  Copyright 2022 Jean Roch
+ *
+ *  This file is part of STM Shell.
+ *
+ *  STM Shell is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  STM Shell is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty
+ *  of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with STM Shell.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "harness.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long stress_runs;		// Runs of the application commands
+
+static SHELL_COMMAND (command_mark)
+{
+	stress_runs++;
+	sprintf (sh->output, "\r\n%ld", sh->arg[1].i);
+	COMMAND_LAST_LINE
+}
+
+static SHELL_COMMAND (command_mode)
+{
+	stress_runs++;
+	sprintf (sh->output, "\r\nmode %d, gain %g", sh->arg[1].e, sh->arg[2].f);
+	COMMAND_LAST_LINE
+}
+
+typedef struct { int k; } t_lines_context;
+
+static SHELL_COMMAND (command_lines)
+{
+	t_lines_context *ctx = SHELL_CONTEXT (t_lines_context);
+
+	SHELL_BEGIN
+	stress_runs++;
+	for (ctx->k = 0; ctx->k < sh->arg[1].i; ctx->k++)
+		SHELL_YIELD_PRINTF ("\r\nline %d", ctx->k);
+	SHELL_END
+}
+
+SHELL_BLOCK_DECLARE (sub_block);
+SHELL_BLOCK (root_block, "stress",
+	SHELL_CMD ("mark <n>", command_mark, "i"),
+	SHELL_CMD ("mode <on|off> <gain>", command_mode, "{on|off}f"),
+	SHELL_CMD ("lines <n>", command_lines, "i"),
+	SHELL_SUB ("sub", sub_block));
+SHELL_BLOCK (sub_block, "sub",
+	SHELL_CMD ("inner <n>", command_mark, "i"));
+
+static unsigned long stress_seed = 1;
+
+static unsigned int stress_random (unsigned int n)
+{
+	stress_seed = stress_seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (unsigned int) (stress_seed >> 33) % n;
+}
+
+// A random command line, carriage return included. Returns its length.
+static int stress_line (char *line)
+{
+	static const char *natives[] =
+	{
+		"cd sub", "cd..", "cd /", "cd nowhere", "ls", "log", "log debug", "log error", "log loud", "jobs", "kill 3",
+		"get speed", "set speed 1", "trace", "trace select speed", "trace stop", "macro", "macro m ls", "macro m", "run m",
+		"stats", "mark", "mark 1x", "mode maybe 1", "inner 4", "cd sub;inner 5;cd..", "ls;ls", "\"unterminated",
+	};
+	int n = stress_random (10);
+
+	if (n < 4)
+		return sprintf (line, "mark %d\r", (int) stress_random (100000) - 50000);
+	if (n == 4)
+		return sprintf (line, "mode %s %d.%d\r", stress_random (2) ? "on" : "off", stress_random (100), stress_random (10));
+	if (n == 5)
+		return sprintf (line, "lines %d\r", stress_random (16));
+	if (n < 9)
+		return sprintf (line, "%s\r", natives[stress_random (sizeof (natives) / sizeof (natives[0]))]);
+
+	// Garbage : printable characters only, no control keys. It starts with a digit, so it's never a command word.
+	static const char garbage[] = "0123456789 abcxyz-+.\"";
+	int length = 1 + stress_random (48);
+	line[0] = '0' + stress_random (10);
+	for (int i = 1; i < length; i++)
+		line[i] = garbage[stress_random (sizeof (garbage) - 1)];
+	line[length++] = '\r';
+	line[length] = 0;
+	return length;
+}
+
+int main (int argc, char **argv)
+{
+	long commands = 2000000;
+	unsigned long limit = 50000;		// Worst latency allowed, in microseconds
+	double baseline = 0;				// Expected rate, in commands per second : not checked if 0...
+	double tolerance = 50;				// ... and how far below it the rate may be, in percent
+
+	for (int i = 1; i < argc; i++)
+		if (strcmp (argv[i], "-q") == 0)
+			commands = 20000;
+		else if ((strcmp (argv[i], "-n") == 0) && (i + 1 < argc))
+			commands = atol (argv[++i]);
+		else if ((strcmp (argv[i], "-l") == 0) && (i + 1 < argc))
+			limit = strtoul (argv[++i], 0, 0);
+		else if ((strcmp (argv[i], "-r") == 0) && (i + 1 < argc))
+			baseline = atof (argv[++i]);
+		else if ((strcmp (argv[i], "-t") == 0) && (i + 1 < argc))
+			tolerance = atof (argv[++i]);
+		else if ((strcmp (argv[i], "-s") == 0) && (i + 1 < argc))
+			stress_seed = strtoul (argv[++i], 0, 0);
+		else
+		{
+			fprintf (stderr, "usage : shell_stress_random [-q] [-n <commands>] [-l <latency limit, in us>] "
+				"[-r <baseline, commands/s>] [-t <tolerance, %%>] [-s <seed>]\n");
+			return 1;
+		}
+
+	if (harness_open ("shell_stress_random", 0, 0) != 0)
+		return 1;
+
+	unsigned long total = 0, worst = 0, bytes = 0;
+	char line[64];
+	for (long i = 0; i < commands; i++)
+	{
+		int length = stress_line (line);
+		unsigned long start = shell_cycles ();
+		harness_feed (line, length);
+		if (harness_settle () != 0)
+		{
+			fprintf (stderr, "command %ld (\"%.*s\") : the shell didn't come back to the prompt\n", i, length - 1, line);
+			return 1;
+		}
+		unsigned long elapsed = shell_cycles () - start;
+		total += elapsed;
+		bytes += length;
+		if (elapsed > worst)
+			worst = elapsed;
+	}
+
+	printf ("metric,value,unit\n");
+	printf ("commands,%ld,commands\n", commands);
+	printf ("app_commands,%lu,commands\n", stress_runs);
+	double rate = commands * 1e9 / total;
+	printf ("rate,%.0f,commands/s\n", rate);
+	printf ("input,%.1f,bytes/command\n", (double) bytes / commands);
+	printf ("mean_latency,%.2f,us\n", total / 1e3 / commands);
+	printf ("max_latency,%.1f,us\n", worst / 1e3);
+	int errors = 0;
+	if (worst / 1000 > limit)
+	{
+		fprintf (stderr, "worst latency %lu us, over the limit of %lu us\n", worst / 1000, limit);
+		errors++;
+	}
+	if (rate < baseline * (1 - tolerance / 100))
+	{
+		fprintf (stderr, "%.0f commands/s, more than %g%% below the baseline of %.0f commands/s\n", rate, tolerance, baseline);
+		errors++;
+	}
+	return (errors != 0);
+}